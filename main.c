@@ -1,10 +1,40 @@
+#define _GNU_SOURCE // for pipe2(), getline() and the other Linux extensions used below
 #include <sys/wait.h> // for waitpid() and associated macros
+#include <sys/resource.h> // for wait4() and struct rusage
 #include <unistd.h> // for fork()), chdir(), exec(), and pid_t
 #include <stdlib.h> // for malloc(), free(), exit(), execvp(), realloc(), EXIT_FAILURE and EXIT_SUCCESS
 #include <stdio.h> // for printf(), fprintf(), stderr, getchar() and perror()
 #include <string.h> // for strcmp(), strtok()
 #include <dirent.h>
 #include <termios.h>
+#include <signal.h> // for sigaction(), kill() and the signal set functions
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/epoll.h> // for the event loop
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/pidfd.h> // for pidfd_open()
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <math.h> // for sqrt(), link with -lm
+#include <sys/ioctl.h>
+#include <sys/syscall.h> // perf_event_open() has no glibc wrapper
+#include <linux/perf_event.h>
+#include <pthread.h> // link with -pthread
+#include <pwd.h>
+#include <grp.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h> // no liburing: rings are set up by hand
+#include <linux/fs.h> // for FICLONE
+#include <sys/inotify.h>
+#ifdef __x86_64__
+#include <immintrin.h> // SSE2, and AVX2 where the CPU has it, for the byte scanning
+#endif
 
 #define HISTORY_MAX 1000
 
@@ -17,6 +47,60 @@ typedef struct {
 
 struct termios orig_termios;
 
+// structure for one process in a job
+typedef struct Process {
+	struct Process *next; // next process in pipeline
+	char **argv;          // for exec; points into the caller's args, only valid during launch
+	char *command;        // this stage's words, for reports
+	pid_t pid;            // process ID
+	int status;           // reported status value
+	int pidfd;            // watched by the event loop until the process exits
+	char completed;       // true if process has completed
+	char stopped;         // true if process has stopped
+	struct rusage rusage; // from wait4() once completed
+	double end;           // monotonic time the exit was reaped
+} Process;
+
+// structure for a job -- a pipeline of processes sharing a process group
+typedef struct Job {
+	struct Job *next;     // next active job
+	int id;               // job number shown by "jobs"
+	char *command;        // command line, used for messages
+	Process *first_process;
+	pid_t pgid;           // process group ID
+	char notified;        // true if user told about stopped job
+	char foreground;      // true while the shell waits on this job
+	char timed;           // started with the "time" keyword
+	char timed_out;       // set once "timeout" has signalled the job
+	int timeout_fd;       // timerfd armed by "timeout", or -1
+	int timeout_signal;   // signal to send when it fires
+	double kill_after;    // seconds before escalating to SIGKILL; 0 = never
+	double start;         // monotonic launch time
+	struct termios tmodes; // saved terminal modes
+} Job;
+
+// callback for a file descriptor registered with the event loop
+typedef void (*ev_callback)(int fd, uint32_t events, void *data);
+
+typedef struct {
+	ev_callback cb;
+	void *data;
+} EvHandler;
+
+// State of the line editor while a command is being typed
+typedef struct {
+	char *buffer;
+	int bufsize;
+	int position;
+	int history_pos;
+	int esc;          // bytes of an escape sequence seen so far
+	int esc_timer;    // timerfd that gives up on an incomplete sequence
+	int done;         // 1 once a line is complete, -1 at end of input
+} LineEditor;
+
+// phases of lsh_loop timed by the "stats" instrumentation
+enum { PHASE_READ, PHASE_TOKENIZE, PHASE_DISPATCH, PHASE_SPAWN, PHASE_WAIT, PHASE_COUNT };
+
 // Function prototypes
 History *history_init(void);
 void history_add(History *hist, char *command);
@@ -26,8 +110,34 @@ void history_load(History *hist);
 void lsh_loop(void);
 char *lsh_read_line(void);
 char **lsh_split_line(char *line);
-int lsh_launch(char **args);
+char *expand_word(const char *word, char **pattern);
+void expand_word_list(const char *word, char ***words, size_t *n, size_t *cap);
+int lsh_launch(char **args, int background, int timed);
+Job *launch_job(char **args, int background);
+void apply_ulimits(void);
+double monotonic_seconds(void);
+void print_time_report(Job *j);
+void job_free(Job *j);
+void time_report_header(void);
+void time_report_row(const char *label, double real, struct rusage *ru);
+void prepare_child(void);
+void lsh_exec_child(char **args);
+void lsh_exec_line_child(const char *line);
+void subshell_init(void);
+void ev_init(void);
+int ev_add(int fd, uint32_t events, ev_callback cb, void *data);
+void ev_del(int fd);
+int ev_timer_add(long ms, ev_callback cb, void *data);
+void ev_timer_del(int fd);
+void ev_run_once(int timeout_ms);
+void on_signalfd(int fd, uint32_t events, void *data);
+void on_pidfd(int fd, uint32_t events, void *data);
+void reap_children(void);
+int jobs_need_notification(void);
+void le_redraw_after_notification(void);
 int lsh_execute(char **args);
+int job_status(Job *j);
+int wait_status_code(int status);
 int lsh_cd(char **args);
 int lsh_help(char **args);
 int lsh_exit(char **args);
@@ -43,10 +153,61 @@ int lsh_grep(char **args);
 int lsh_touch(char **args);
 int lsh_echo(char **args);
 int lsh_rm(char **args);
+int lsh_jobs(char **args);
+int lsh_fg(char **args);
+int lsh_bg(char **args);
+int lsh_wait(char **args);
+int lsh_kill(char **args);
+int lsh_parallel(char **args);
+int lsh_run(char **args);
+int lsh_bench(char **args);
+int lsh_perfstat(char **args);
+int lsh_stats(char **args);
+void dircache_stats(int reset);
+int lsh_timeout(char **args);
+int lsh_ulimit(char **args);
+int lsh_tree(char **args);
+int lsh_find(char **args);
+int lsh_du(char **args);
+int lsh_cp(char **args);
+int lsh_mkdir(char **args);
+int lsh_mv(char **args);
+int lsh_ln(char **args);
+int lsh_wc(char **args);
+int lsh_sort(char **args);
+int lsh_count(char **args);
+int lsh_uniq(char **args);
+int lsh_head(char **args);
+int lsh_tail(char **args);
+int lsh_cut(char **args);
+int lsh_field(char **args);
+uint64_t now_ns(void);
+void stats_phase(int phase, uint64_t start_ns);
+void stats_record_command(const char *kind, const char *name, uint64_t ns);
+void init_shell(void);
+void do_job_notification(void);
+
+extern char *builtin_str[];
+extern int (*builtin_func[]) (char **);
 
 // Add global history
 History *shell_history;
 
+// Job control state
+pid_t shell_pgid;
+int shell_terminal = STDIN_FILENO;
+int shell_is_interactive;
+Job *first_job = NULL;
+LineEditor *active_editor = NULL; // non-NULL while the prompt is up
+
+// Exit statuses: $? is last_status, PIPESTATUS has one entry per stage of
+// the last foreground pipeline
+int last_status = 0;
+int *pipestatus = NULL;
+int pipestatus_len = 0;
+int lsh_exit_requested = 0;
+int lsh_exit_status = 0;
+
 void enable_raw_mode() {
 	tcgetattr(STDIN_FILENO, &orig_termios);
 	struct termios raw = orig_termios;
@@ -58,123 +219,377 @@ void disable_raw_mode() {
 	tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios);
 }
 
+/* Event loop. The shell never blocks in read() or waitpid(); instead every
+ * source of work -- keyboard input, child exits (pidfds), signals (a
+ * signalfd for SIGCHLD) and timers (timerfds) -- is registered with one
+ * epoll instance and dispatched from ev_run_once(). Handlers are looked up
+ * by file descriptor so that removing one mid-batch is safe.
+ */
+
+#define EV_MAX_EVENTS 32
+
+int ev_epfd = -1;
+EvHandler *ev_handlers = NULL; // indexed by fd
+int ev_handlers_size = 0;
+int ev_sigfd = -1;
+sigset_t shell_orig_sigmask; // restored in children before exec
+
+void ev_init(void)
+{
+	sigset_t mask;
+
+	ev_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ev_epfd < 0) {
+		perror("lsh: epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+
+	// SIGCHLD is only ever delivered through the signalfd
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &shell_orig_sigmask);
+	ev_sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (ev_sigfd < 0) {
+		perror("lsh: signalfd");
+		exit(EXIT_FAILURE);
+	}
+	ev_add(ev_sigfd, EPOLLIN, on_signalfd, NULL);
+}
+
+int ev_add(int fd, uint32_t events, ev_callback cb, void *data)
+{
+	struct epoll_event ev;
+
+	if (fd >= ev_handlers_size) {
+		int size = ev_handlers_size ? ev_handlers_size : 64;
+		while (size <= fd)
+			size *= 2;
+		ev_handlers = realloc(ev_handlers, size * sizeof(EvHandler));
+		if (!ev_handlers) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(ev_handlers + ev_handlers_size, 0, (size - ev_handlers_size) * sizeof(EvHandler));
+		ev_handlers_size = size;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	if (epoll_ctl(ev_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return -1;
+	ev_handlers[fd].cb = cb;
+	ev_handlers[fd].data = data;
+	return 0;
+}
+
+void ev_del(int fd)
+{
+	if (fd < 0 || fd >= ev_handlers_size || !ev_handlers[fd].cb)
+		return;
+	epoll_ctl(ev_epfd, EPOLL_CTL_DEL, fd, NULL);
+	ev_handlers[fd].cb = NULL;
+	ev_handlers[fd].data = NULL;
+}
+
+// Arm a one-shot timer; the callback is responsible for ev_timer_del().
+int ev_timer_add(long ms, ev_callback cb, void *data)
+{
+	struct itimerspec its;
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fd < 0)
+		return -1;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+	if (ms <= 0)
+		its.it_value.tv_nsec = 1; // a zero value would disarm the timer
+	if (timerfd_settime(fd, 0, &its, NULL) < 0 || ev_add(fd, EPOLLIN, cb, data) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void ev_timer_del(int fd)
+{
+	if (fd < 0)
+		return;
+	ev_del(fd);
+	close(fd);
+}
+
+// Wait for and dispatch one batch of events
+void ev_run_once(int timeout_ms)
+{
+	struct epoll_event events[EV_MAX_EVENTS];
+	int n = epoll_wait(ev_epfd, events, EV_MAX_EVENTS, timeout_ms);
+
+	if (n < 0 && errno != EINTR) {
+		perror("lsh: epoll_wait");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < n; i++) {
+		int fd = events[i].data.fd;
+		// An earlier handler in this batch may have removed this one
+		if (fd < ev_handlers_size && ev_handlers[fd].cb)
+			ev_handlers[fd].cb(fd, events[i].events, ev_handlers[fd].data);
+	}
+}
+
+void on_signalfd(int fd, uint32_t events, void *data)
+{
+	struct signalfd_siginfo si;
+
+	(void)events;
+	(void)data;
+	// Drain; SIGCHLD coalesces so one pass over the job table covers them all
+	while (read(fd, &si, sizeof(si)) == sizeof(si))
+		;
+	reap_children();
+}
+
+// A pidfd turns readable once its process exits
+void on_pidfd(int fd, uint32_t events, void *data)
+{
+	(void)fd;
+	(void)events;
+	(void)data;
+	reap_children();
+}
+
+
 void lsh_loop(void)
 {
 	char *line;
 	char **args;
-	int status;
 
-	do {
+	while (!lsh_exit_requested) {
+		do_job_notification();
 		printf("> ");
+		uint64_t t0 = now_ns();
 		line = lsh_read_line();
+		stats_phase(PHASE_READ, t0);
+		if (line == NULL) { // end of input
+			lsh_exit_status = last_status;
+			break;
+		}
+		t0 = now_ns();
 		args = lsh_split_line(line);
-		status = lsh_execute(args);
+		stats_phase(PHASE_TOKENIZE, t0);
+		lsh_execute(args);
 
 		free(line);
 		free(args);
-	} while (status);
+	}
 }
 
 
 #define LSH_RL_BUFSIZE 1024
-char *lsh_read_line(void)
-{
-	int bufsize = LSH_RL_BUFSIZE;
-	int position = 0;
-	char *buffer = malloc(sizeof(char) * bufsize);
-	int c;
-	int history_pos = shell_history->count;
+#define LSH_ESC_TIMEOUT_MS 50
+
+// Keyboard input that has been read but not yet consumed, e.g. a pasted block of lines
+char stdin_pending[4096];
+int stdin_pending_len = 0;
+int stdin_pending_pos = 0;
 
-	if (!buffer){
+void le_ensure(LineEditor *le, int need)
+{
+	if (need < le->bufsize)
+		return;
+	while (le->bufsize <= need)
+		le->bufsize += LSH_RL_BUFSIZE;
+	le->buffer = realloc(le->buffer, le->bufsize);
+	if (!le->buffer) {
 		fprintf(stderr, "lsh: allocation error\n");
 		exit(EXIT_FAILURE);
-       	}
+	}
+}
 
-	enable_raw_mode();
+void le_set(LineEditor *le, const char *text)
+{
+	le->position = strlen(text);
+	le_ensure(le, le->position);
+	memcpy(le->buffer, text, le->position + 1);
+	printf("\r> %s\033[K", le->buffer); // clear to end of line
+}
 
-	while (1) {
-		// Read a character
-		c = getchar();
-
-		if (c ==27) { //ESC Sequence
-			char seq[3];
-			seq[0] = getchar();
-			seq[1] = getchar();
-
-			if (seq[0] == '[') {
-					if (seq[1] == 'A') { //Up arrow
-						if (history_pos > 0) {
-							history_pos--;
-							strcpy(buffer, shell_history->commands[history_pos]);
-							printf("\r> %s\033[K", buffer); // clear to end of line
-							position = strlen(buffer);
-						}
-						continue;
-				}
-				else if (seq[1] == 'B') { //Down arrow
-						if (history_pos < shell_history->count -1) { // Fixed bounds check
-							history_pos++;
-							strcpy(buffer, shell_history->commands[history_pos]);
-							printf("\r> %s\033[K]", buffer); // clear to end of line
-							position = strlen(buffer);
-						}
-						else if (history_pos < shell_history->count -1) {
-							// Clear line if at newest command
-							buffer[0] = '\0';
-							printf("\r> \033[K");
-							position = 0;
-						}
-						continue;
-				}
+// A lone ESC press: forget it rather than swallowing the next keys
+void on_esc_timeout(int fd, uint32_t events, void *data)
+{
+	LineEditor *le = data;
+	(void)events;
+	ev_timer_del(fd);
+	le->esc_timer = -1;
+	le->esc = 0;
+}
+
+// Feed one byte of keyboard input into the editor
+void le_feed(LineEditor *le, int c)
+{
+	if (le->esc) {
+		if (le->esc == 1 && c == '[') {
+			le->esc = 2;
+			return;
+		}
+		ev_timer_del(le->esc_timer);
+		le->esc_timer = -1;
+		le->esc = 0;
+
+		if (c == 'A') { //Up arrow
+			if (le->history_pos > 0) {
+				le->history_pos--;
+				le_set(le, shell_history->commands[le->history_pos]);
 			}
-			continue;
 		}
-		if (c == '\n') {
-			buffer[position] = '\0';
-			printf("\n");
-			disable_raw_mode();
-			if (position > 0) {
-			history_add(shell_history, buffer);
+		else if (c == 'B') { //Down arrow
+			if (le->history_pos < shell_history->count - 1) {
+				le->history_pos++;
+				le_set(le, shell_history->commands[le->history_pos]);
+			}
+			else if (le->history_pos == shell_history->count - 1) {
+				// Clear line if at newest command
+				le->history_pos++;
+				le_set(le, "");
 			}
-			return buffer;
 		}
+		return;
+	}
 
-		if (c == '\t') { //tab key
-			char **completions = get_completions(buffer);
-			if (completions && completions[0]) {
-				strcpy(buffer, completions[0]);
-				printf("\r> %s", buffer);
-				position = strlen(buffer);
-			}
-			free_completions(completions);
-			continue;
+	if (c == 27) { //ESC Sequence
+		le->esc = 1;
+		le->esc_timer = ev_timer_add(LSH_ESC_TIMEOUT_MS, on_esc_timeout, le);
+		return;
+	}
+
+	if (c == '\n') {
+		le->buffer[le->position] = '\0';
+		printf("\n");
+		le->done = 1;
+		return;
+	}
+
+	if (c == '\t') { //tab key
+		le->buffer[le->position] = '\0';
+		char **completions = get_completions(le->buffer);
+		if (completions && completions[0]) {
+			le_set(le, completions[0]);
 		}
+		free_completions(completions);
+		return;
+	}
 
-		if (c == 127) { //Backspace
-			if (position > 0) {
-				position--;
-				printf("\b \b"); // move back, print space, move back again
-			}
-			continue;
+	if (c == 127) { //Backspace
+		if (le->position > 0) {
+			le->position--;
+			printf("\b \b"); // move back, print space, move back again
 		}
+		return;
+	}
 
-		if (c >= 32) {  // Printable characters
-        	    buffer[position] = c;
-           	 position++;
-           	 printf("%c", c);
-       		 }
+	if (c >= 32) {  // Printable characters
+		le_ensure(le, le->position + 1);
+		le->buffer[le->position++] = c;
+		printf("%c", c);
+	}
+}
+
+// Consume buffered keyboard input until the line is complete
+void le_drain_pending(LineEditor *le)
+{
+	while (!le->done && stdin_pending_pos < stdin_pending_len)
+		le_feed(le, (unsigned char)stdin_pending[stdin_pending_pos++]);
+	fflush(stdout);
+}
 
+void on_stdin(int fd, uint32_t events, void *data)
+{
+	LineEditor *le = data;
+	// Don't read past the end of the line from a pipe: a command we are
+	// about to run may want the rest of our input.
+	size_t want = shell_is_interactive ? sizeof(stdin_pending) : 1;
+	ssize_t n;
 
-		// If we have exceeded the buffer, reallocate
-		if (position >= bufsize) {
-			bufsize += LSH_RL_BUFSIZE;
-			buffer = realloc(buffer, bufsize);
-			if (!buffer) {
-				fprintf(stderr, "lsh: allocation error\n");
-				exit(EXIT_FAILURE);
-			}
+	(void)events;
+	n = read(fd, stdin_pending, want);
+	if (n < 0) {
+		if (errno != EINTR && errno != EAGAIN)
+			le->done = -1;
+		return;
+	}
+	if (n == 0) {
+		le->done = -1; // end of input
+		return;
+	}
+	stdin_pending_len = n;
+	stdin_pending_pos = 0;
+	le_drain_pending(le);
+}
+
+// Job notices that arrive while the user is typing are printed above a
+// redrawn prompt rather than waiting for the next command.
+void le_redraw_after_notification(void)
+{
+	if (!active_editor || !jobs_need_notification())
+		return;
+	printf("\r\033[K");
+	fflush(stdout);
+	do_job_notification();
+	active_editor->buffer[active_editor->position] = '\0';
+	printf("> %s", active_editor->buffer);
+	fflush(stdout);
+}
+
+char *lsh_read_line(void)
+{
+	LineEditor le;
+	int pollable;
+
+	memset(&le, 0, sizeof(le));
+	le.bufsize = LSH_RL_BUFSIZE;
+	le.buffer = malloc(sizeof(char) * le.bufsize);
+	le.history_pos = shell_history->count;
+	le.esc_timer = -1;
+
+	if (!le.buffer){
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	enable_raw_mode();
+	fflush(stdout);
+	active_editor = &le;
+
+	le_drain_pending(&le);
+	// Regular files can't be polled; reading them never blocks anyway
+	pollable = ev_add(STDIN_FILENO, EPOLLIN, on_stdin, &le) == 0;
+	while (!le.done) {
+		if (pollable)
+			ev_run_once(-1);
+		else
+			on_stdin(STDIN_FILENO, EPOLLIN, &le);
+	}
+	if (pollable)
+		ev_del(STDIN_FILENO);
+
+	active_editor = NULL;
+	ev_timer_del(le.esc_timer);
+	disable_raw_mode();
+
+	if (le.done < 0) {
+		if (le.position == 0) {
+			free(le.buffer);
+			return NULL;
 		}
+		// run whatever was typed before end of input
+		le.buffer[le.position] = '\0';
+		printf("\n");
 	}
+	if (le.position > 0) {
+		history_add(shell_history, le.buffer);
+	}
+	return le.buffer;
 }
 
 
@@ -182,19 +597,108 @@ char *lsh_read_line(void)
 
 #define LSH_TOK_BUFSIZE 64
 #define LSH_TOK_DELM " \t\r\n\a" //Delimiters for splitting
+#define LSH_TOK_OPS "|&;" // characters that start an operator
+
+// Operator tokens. lsh_split_line() returns these very pointers, so an
+// operator is recognised by identity and a quoted "|" stays a plain word.
+char OP_PIPE[] = "|";
+char OP_AND[] = "&&";
+char OP_OR[] = "||";
+char OP_SEMI[] = ";";
+char OP_BG[] = "&";
+
+int is_operator(const char *token)
+{
+	return token == OP_PIPE || token == OP_AND || token == OP_OR || token == OP_SEMI || token == OP_BG;
+}
+
+// The operator at the start of s, or NULL; *len is set to its length
+char *match_operator(const char *s, int *len)
+{
+	*len = 2;
+	if (s[0] == '&' && s[1] == '&')
+		return OP_AND;
+	if (s[0] == '|' && s[1] == '|')
+		return OP_OR;
+	*len = 1;
+	if (s[0] == '|')
+		return OP_PIPE;
+	if (s[0] == '&')
+		return OP_BG;
+	if (s[0] == ';')
+		return OP_SEMI;
+	return NULL;
+}
+
+// Like strtok(), but a '...' or "..." section (or a backslash-escaped
+// character) can hold delimiters, and the operators above end a word even
+// without spaces around them. Quotes are left in the word for expand_word().
+// A word that runs into an operator ("a;b") is terminated where the
+// operator was, so the operator is handed back through *pending instead.
+char *lsh_next_token(char **cursor, char **pending)
+{
+	char *src = *cursor, *token, *op;
+	int len;
+
+	if (*pending) {
+		token = *pending;
+		*pending = NULL;
+		return token;
+	}
+	while (*src && strchr(LSH_TOK_DELM, *src))
+		src++;
+	if (*src == '\0')
+		return NULL;
+	if ((op = match_operator(src, &len))) {
+		*cursor = src + len;
+		return op;
+	}
+
+	token = src;
+	while (*src && !strchr(LSH_TOK_DELM, *src) && !strchr(LSH_TOK_OPS, *src)) {
+		if (*src == '"' || *src == '\'') {
+			char quote = *src++;
+			while (*src && *src != quote) {
+				if (quote == '"' && *src == '\\' && src[1])
+					src++;
+				src++;
+			}
+			if (*src)
+				src++; // closing quote
+		}
+		else if (*src == '\\' && src[1]) {
+			src += 2;
+		}
+		else {
+			src++;
+		}
+	}
+	if ((op = match_operator(src, &len))) {
+		*pending = op;
+		*cursor = src + len;
+	}
+	else {
+		// Step past the delimiter before terminating
+		*cursor = *src ? src + 1 : src;
+	}
+	*src = '\0';
+	return token;
+}
 
 char **lsh_split_line(char *line) // returns an array of strings 
 {
 	int bufsize = LSH_TOK_BUFSIZE, position = 0;
 	char **tokens = malloc(bufsize * sizeof(char*)); // allocate array of string pointers
 	char *token; 
+	char *cursor = line;
+	char *pending = NULL;
 
 	if (!tokens) {
 		fprintf(stderr, "lsh: allocation error\n");
 		exit(EXIT_FAILURE);
 	}
 
-	token = strtok(line, LSH_TOK_DELM);  // Split on delimiters
+	token = lsh_next_token(&cursor, &pending);  // Split on delimiters
 	while (token != NULL) {
 		tokens[position] = token;  // store pointer to token
 		position++;
@@ -209,7 +713,7 @@ char **lsh_split_line(char *line) // returns an array of strings
 			}
 		}
 		//Get next token
-		token = strtok(NULL, LSH_TOK_DELM);
+		token = lsh_next_token(&cursor, &pending);
 	}
 	tokens[position] = NULL;
 	return tokens;
@@ -223,285 +727,10983 @@ char **lsh_split_line(char *line) // returns an array of strings
  * - memory management
 */
 
+// Append n bytes of data to the malloc'd string *s of length *len
+void str_append(char **s, size_t *len, size_t *cap, const char *data, size_t n)
+{
+	if (*len + n + 1 > *cap) {
+		while (*len + n + 1 > *cap)
+			*cap = *cap ? *cap * 2 : 64;
+		*s = realloc(*s, *cap);
+		if (!*s) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memcpy(*s + *len, data, n);
+	*len += n;
+	(*s)[*len] = '\0';
+}
+
+// Append one status number to *s, after a space unless first
+void str_append_status(char **s, size_t *len, size_t *cap, int status, int first)
+{
+	char num[16];
+	int n = snprintf(num, sizeof(num), "%s%d", first ? "" : " ", status);
+	str_append(s, len, cap, num, n);
+}
+
+// Expand the parameter at p (just past the '$'): $?, $PIPESTATUS,
+// ${PIPESTATUS}, ${PIPESTATUS[n]} and ${PIPESTATUS[@]}. Returns the number
+// of characters used, or 0 if p names none of them (the '$' is then literal).
+int expand_parameter(const char *p, char **s, size_t *len, size_t *cap)
+{
+	const char *q;
+	char *end;
+
+	if (*p == '?') {
+		str_append_status(s, len, cap, last_status, 1);
+		return 1;
+	}
+	if (strncmp(p, "PIPESTATUS", 10) == 0 || strncmp(p, "{PIPESTATUS}", 12) == 0) {
+		// Without a subscript, the first element, as in bash
+		if (pipestatus_len)
+			str_append_status(s, len, cap, pipestatus[0], 1);
+		return p[0] == '{' ? 12 : 10;
+	}
+	if (strncmp(p, "{PIPESTATUS[", 12) != 0)
+		return 0;
+	q = p + 12;
+	if ((q[0] == '@' || q[0] == '*') && strncmp(q + 1, "]}", 2) == 0) {
+		for (int i = 0; i < pipestatus_len; i++)
+			str_append_status(s, len, cap, pipestatus[i], i == 0);
+		return (int)(q + 3 - p);
+	}
+	long i = strtol(q, &end, 10);
+	if (end == q || strncmp(end, "]}", 2) != 0)
+		return 0;
+	if (i >= 0 && i < pipestatus_len)
+		str_append_status(s, len, cap, pipestatus[i], 1);
+	return (int)(end + 2 - p);
+}
+
+// Append n bytes to a pattern being built next to the expanded word:
+// quoted characters go in escaped, so only unquoted ones act as wildcards
+void pattern_append(char **pat, size_t *len, size_t *cap, const char *data, size_t n, int quoted)
+{
+	for (size_t i = 0; i < n; i++) {
+		if ((quoted || data[i] == '\\') && data[i] && strchr("*?[]\\", data[i]))
+			str_append(pat, len, cap, "\\", 1);
+		str_append(pat, len, cap, data + i, 1);
+	}
+}
+
+// Quote removal and parameter expansion of one word, into a new string.
+// Nothing is expanded inside single quotes; inside double quotes a
+// backslash only escapes '"', '\\' and '$'. If pattern is not NULL and
+// the word has an unquoted '*', '?' or '[', *pattern is set to the word
+// as a pattern for glob_expand(), else to NULL.
+char *expand_word(const char *word, char **pattern)
+{
+	char *s = NULL, *pat = NULL;
+	size_t len = 0, cap = 0, plen = 0, pcap = 0;
+	char quote = 0;
+	int magic = 0;
+
+	str_append(&s, &len, &cap, "", 0);
+	for (const char *p = word; *p; p++) {
+		size_t before = len;
+		int quoted = 1;
+
+		if (quote == '\'') {
+			if (*p == '\'')
+				quote = 0;
+			else
+				str_append(&s, &len, &cap, p, 1);
+		}
+		else if (*p == '\'' && !quote) {
+			quote = '\'';
+		}
+		else if (*p == '"') {
+			quote = quote ? 0 : '"';
+		}
+		else if (*p == '\\' && p[1] && (!quote || strchr("\"\\$", p[1]))) {
+			str_append(&s, &len, &cap, ++p, 1);
+		}
+		else if (*p == '$' && p[1]) {
+			int used = expand_parameter(p + 1, &s, &len, &cap);
+			if (used == 0)
+				str_append(&s, &len, &cap, p, 1);
+			p += used;
+		}
+		else {
+			str_append(&s, &len, &cap, p, 1);
+			quoted = quote != 0;
+			if (!quoted && (*p == '*' || *p == '?' || *p == '['))
+				magic = 1;
+		}
+		if (pattern)
+			pattern_append(&pat, &plen, &pcap, s + before, len - before, quoted);
+	}
+	if (pattern)
+		*pattern = magic ? pat : NULL;
+	if (!magic)
+		free(pat);
+	return s;
+}
+
+
+
+/* Job control, following the layout of the glibc manual's sample shell:
+ * every external command runs as a job in its own process group, the
+ * terminal is handed to whichever job is in the foreground, and the event
+ * loop reaps children as they change state (pidfds for exits, the SIGCHLD
+ * signalfd for stops and continues) so that background jobs are noticed
+ * without the prompt ever blocking on them.
+ */
+
+// Make sure the shell is running interactively as the foreground job before proceeding.
+void init_shell(void)
+{
+	shell_is_interactive = isatty(shell_terminal);
+
+	if (shell_is_interactive) {
+		// Loop until we are in the foreground
+		while (tcgetpgrp(shell_terminal) != (shell_pgid = getpgrp()))
+			kill(-shell_pgid, SIGTTIN);
+
+		// Ignore interactive and job-control signals
+		signal(SIGINT, SIG_IGN);
+		signal(SIGQUIT, SIG_IGN);
+		signal(SIGTSTP, SIG_IGN);
+		signal(SIGTTIN, SIG_IGN);
+		signal(SIGTTOU, SIG_IGN);
+
+		// Put ourselves in our own process group and grab control of the terminal
+		shell_pgid = getpid();
+		if (setpgid(shell_pgid, shell_pgid) < 0 && errno != EPERM) {
+			perror("lsh: couldn't put the shell in its own process group");
+			exit(EXIT_FAILURE);
+		}
+		tcsetpgrp(shell_terminal, shell_pgid);
+		tcgetattr(shell_terminal, &orig_termios);
+	}
+
+	ev_init();
+}
+
+Job *find_job_by_id(int id)
+{
+	for (Job *j = first_job; j; j = j->next)
+		if (j->id == id)
+			return j;
+	return NULL;
+}
+
+// Return true if all processes in the job have stopped or completed.
+int job_is_stopped(Job *j)
+{
+	for (Process *p = j->first_process; p; p = p->next)
+		if (!p->completed && !p->stopped)
+			return 0;
+	return 1;
+}
+
+// Return true if all processes in the job have completed.
+int job_is_completed(Job *j)
+{
+	for (Process *p = j->first_process; p; p = p->next)
+		if (!p->completed)
+			return 0;
+	return 1;
+}
+
+// Store the status of process p as returned by wait4.
+void mark_process_status(Job *j, Process *p, int status, struct rusage *ru)
+{
+	p->status = status;
+	if (WIFSTOPPED(status)) {
+		p->stopped = 1;
+	}
+	else if (WIFCONTINUED(status)) {
+		p->stopped = 0;
+	}
+	else {
+		p->completed = 1;
+		p->rusage = *ru;
+		p->end = monotonic_seconds();
+		if (p->pidfd >= 0) {
+			ev_del(p->pidfd);
+			close(p->pidfd);
+			p->pidfd = -1;
+		}
+	}
+	j->notified = 0;
+}
+
+// Collect state changes of our jobs' processes without blocking. Only pids
+// in the job table are waited for, so builtins that run their own children
+// can reap those themselves.
+void reap_children(void)
+{
+	struct rusage ru;
+	int status;
+
+	for (Job *j = first_job; j; j = j->next)
+		for (Process *p = j->first_process; p; p = p->next)
+			while (!p->completed && wait4(p->pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru) > 0)
+				mark_process_status(j, p, status, &ru);
+	le_redraw_after_notification();
+}
+
+// Join words with single spaces into a new string
+char *join_words(char **words)
+{
+	size_t len = 0;
+	char *s;
+
+	for (int i = 0; words[i]; i++)
+		len += strlen(words[i]) + 1;
+	s = malloc(len + 1);
+	if (!s) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	s[0] = '\0';
+	for (int i = 0; words[i]; i++) {
+		if (i > 0)
+			strcat(s, " ");
+		strcat(s, words[i]);
+	}
+	return s;
+}
+
+// Build a job from args, one process per OP_PIPE-separated stage. The
+// OP_PIPE tokens are replaced by NULLs so each process's argv points into args.
+// Returns NULL on an empty stage.
+Job *job_new(char **args)
+{
+	Job *j = calloc(1, sizeof(Job));
+	Process **tail;
+	int id = 1;
+
+	if (!j) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Job numbers are reused once the highest job finishes, like bash
+	for (Job *it = first_job; it; it = it->next)
+		if (it->id >= id)
+			id = it->id + 1;
+	j->id = id;
+
+	j->command = join_words(args);
+	j->timeout_fd = -1;
+
+	tail = &j->first_process;
+	char **stage = args;
+	for (int i = 0; ; i++) {
+		if (args[i] && args[i] != OP_PIPE)
+			continue;
+		int last = args[i] == NULL;
+		args[i] = NULL;
+
+		Process *p = calloc(1, sizeof(Process));
+		if (!p) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		p->argv = stage;
+		p->command = join_words(stage);
+		p->pidfd = -1;
+		*tail = p;
+		tail = &p->next;
+		if (stage[0] == NULL) {
+			fprintf(stderr, "lsh: syntax error near \"|\"\n");
+			job_free(j);
+			return NULL;
+		}
+		if (last)
+			break;
+		stage = &args[i + 1];
+	}
+	j->tmodes = orig_termios;
+	return j;
+}
+
+// Append to the job list
+void job_add(Job *j)
+{
+	Job **tail = &first_job;
+	while (*tail)
+		tail = &(*tail)->next;
+	*tail = j;
+}
+
+// Unlink and free a job
+void job_free(Job *j)
+{
+	for (Job **it = &first_job; *it; it = &(*it)->next) {
+		if (*it == j) {
+			*it = j->next;
+			break;
+		}
+	}
+	Process *p = j->first_process;
+	while (p) {
+		Process *next = p->next;
+		if (p->pidfd >= 0) {
+			ev_del(p->pidfd);
+			close(p->pidfd);
+		}
+		free(p->command);
+		free(p);
+		p = next;
+	}
+	ev_timer_del(j->timeout_fd);
+	free(j->command);
+	free(j);
+}
+
+// The most recently started job that has not finished, for "%%" and bare fg/bg
+Job *current_job(void)
+{
+	Job *cur = NULL;
+	for (Job *j = first_job; j; j = j->next)
+		if (!job_is_completed(j))
+			cur = j;
+	return cur;
+}
+
+void format_job_info(Job *j, const char *state)
+{
+	fprintf(stderr, "[%d]%c %-8s %s\n", j->id, j == current_job() ? '+' : ' ', state, j->command);
+}
+
+// Wall time of a finished job, filed under the name of its first program
+void stats_record_job(Job *j)
+{
+	double end = j->start;
+	char name[64];
+
+	for (Process *p = j->first_process; p; p = p->next)
+		if (p->end > end)
+			end = p->end;
+	snprintf(name, sizeof(name), "%s", j->first_process->command);
+	name[strcspn(name, " ")] = '\0';
+	stats_record_command("cmd", name, (uint64_t)((end - j->start) * 1e9));
+}
+
+// Shell exit status for a wait() status: the exit code, or 128 plus the
+// signal that killed or stopped the process
+int wait_status_code(int status)
+{
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	if (WIFSTOPPED(status))
+		return 128 + WSTOPSIG(status);
+	return 0;
+}
+
+// A job's status is that of its last stage. One that "timeout" had to
+// signal reports 124, as timeout(1) does, unless it took a SIGKILL.
+int job_status(Job *j)
+{
+	Process *p = j->first_process;
+
+	while (p->next)
+		p = p->next;
+	if (j->timed_out && job_is_completed(j) && !(WIFSIGNALED(p->status) && WTERMSIG(p->status) == SIGKILL))
+		return 124;
+	return wait_status_code(p->status);
+}
+
+// Record the statuses of a job's stages as PIPESTATUS
+void set_pipestatus(Job *j)
+{
+	int n = 0;
+
+	for (Process *p = j->first_process; p; p = p->next)
+		n++;
+	pipestatus = realloc(pipestatus, n * sizeof(int));
+	if (!pipestatus) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	pipestatus_len = 0;
+	for (Process *p = j->first_process; p; p = p->next)
+		pipestatus[pipestatus_len++] = wait_status_code(p->status);
+}
+
+// Run the event loop until the job stops or finishes.
+void wait_for_job(Job *j)
+{
+	while (!job_is_stopped(j))
+		ev_run_once(-1);
+}
+
+// Put job j in the foreground. If cont is nonzero, restore the saved
+// terminal modes and send the process group a SIGCONT to wake it up first.
+// Returns the job's status once it stops or finishes.
+int put_job_in_foreground(Job *j, int cont)
+{
+	int status;
+
+	j->foreground = 1;
+	if (shell_is_interactive)
+		tcsetpgrp(shell_terminal, j->pgid);
+
+	if (cont) {
+		if (shell_is_interactive)
+			tcsetattr(shell_terminal, TCSADRAIN, &j->tmodes);
+		for (Process *p = j->first_process; p; p = p->next)
+			p->stopped = 0;
+		if (kill(-j->pgid, SIGCONT) < 0)
+			perror("lsh: kill (SIGCONT)");
+	}
+
+	uint64_t t0 = now_ns();
+	wait_for_job(j);
+	stats_phase(PHASE_WAIT, t0);
+	j->foreground = 0;
+
+	if (shell_is_interactive) {
+		// Put the shell back in the foreground and restore its terminal modes
+		tcsetpgrp(shell_terminal, shell_pgid);
+		tcgetattr(shell_terminal, &j->tmodes);
+		tcsetattr(shell_terminal, TCSADRAIN, &orig_termios);
+	}
+
+	status = job_status(j);
+	set_pipestatus(j);
+	if (job_is_completed(j)) {
+		if (j->timed)
+			print_time_report(j);
+		stats_record_job(j);
+		job_free(j);
+	}
+	else {
+		fprintf(stderr, "\n");
+		format_job_info(j, "Stopped");
+		j->notified = 1;
+	}
+	return status;
+}
+
+// Put a job in the background. If cont is nonzero, send it a SIGCONT.
+void put_job_in_background(Job *j, int cont)
+{
+	if (cont) {
+		for (Process *p = j->first_process; p; p = p->next)
+			p->stopped = 0;
+		if (kill(-j->pgid, SIGCONT) < 0)
+			perror("lsh: kill (SIGCONT)");
+	}
+}
+
+// True if do_job_notification() has something to report
+int jobs_need_notification(void)
+{
+	for (Job *j = first_job; j; j = j->next)
+		if (!j->foreground && (job_is_completed(j) || (job_is_stopped(j) && !j->notified)))
+			return 1;
+	return 0;
+}
+
+// Report stopped and finished background jobs, and forget the finished ones.
+void do_job_notification(void)
+{
+	Job *j, *jnext;
+
+	for (j = first_job; j; j = jnext) {
+		jnext = j->next;
+
+		if (job_is_completed(j)) {
+			format_job_info(j, "Done");
+			if (j->timed)
+				print_time_report(j);
+			stats_record_job(j);
+			job_free(j);
+		}
+		else if (job_is_stopped(j) && !j->notified) {
+			format_job_info(j, "Stopped");
+			j->notified = 1;
+		}
+	}
+}
+
+// Undo the shell's signal setup in a freshly forked child and apply the
+// limits set with "ulimit"
+void prepare_child(void)
+{
+	if (shell_is_interactive) {
+		signal(SIGINT, SIG_DFL);
+		signal(SIGQUIT, SIG_DFL);
+		signal(SIGTSTP, SIG_DFL);
+		signal(SIGTTIN, SIG_DFL);
+		signal(SIGTTOU, SIG_DFL);
+	}
+	sigprocmask(SIG_SETMASK, &shell_orig_sigmask, NULL);
+	apply_ulimits();
+}
+
+// A forked child that goes on running shell code (a builtin, or a whole
+// command line) must not share the parent's epoll instance or job table.
+void subshell_init(void)
+{
+	memset(ev_handlers, 0, ev_handlers_size * sizeof(EvHandler));
+	close(ev_epfd);
+	close(ev_sigfd);
+	first_job = NULL; // the parent's jobs; this copy of them is simply dropped
+	active_editor = NULL;
+	shell_is_interactive = 0;
+	ev_init();
+}
+
+// Run args (already expanded) in a forked child: builtins run in place,
+// anything else is exec'd. Exits with 127 if the program is not found.
+void lsh_exec_child(char **args)
+{
+	for (int i = 0; i < lsh_num_builtins(); i++) {
+		if (strcmp(args[0], builtin_str[i]) == 0) {
+			subshell_init();
+			int status = (*builtin_func[i])(args);
+			// _exit: flushing the shell's other stdio streams here could
+			// rewind file offsets we share with the parent
+			fflush(stdout);
+			_exit(status);
+		}
+	}
+
+	// execvp replaces current process with new program
+	// args[0] is program name
+	// args is array of arguments
+	execvp(args[0], args);
+	int err = errno;
+	perror("lsh");
+	_exit(err == ENOENT ? 127 : 126);
+}
+
+// Run a whole command line in a forked child. A simple command replaces
+// the child directly; pipelines and lists are run by the child acting as
+// a shell, so they need no "sh -c".
+void lsh_exec_line_child(const char *line)
+{
+	char *copy = strdup(line);
+	char **args = lsh_split_line(copy);
+	char **words = NULL;
+	size_t n = 0, cap = 0;
+	int i;
+
+	if (args[0] == NULL)
+		_exit(EXIT_SUCCESS);
+	for (i = 0; args[i] && !is_operator(args[i]); i++)
+		;
+	if (args[i] || strcmp(args[0], "!") == 0 || strcmp(args[0], "time") == 0) {
+		subshell_init();
+		int status = lsh_execute(args);
+		fflush(stdout);
+		_exit(status);
+	}
+	for (i = 0; args[i]; i++)
+		expand_word_list(args[i], &words, &n, &cap);
+	words[n] = NULL;
+	lsh_exec_child(words);
+}
+
+// Run args as a job in the foreground or the background. Returns the
+// job's status, or 0 for a job left running in the background.
+int lsh_launch(char **args, int background, int timed)
+{
+	Job *j = launch_job(args, background);
+
+	if (!j)
+		return 1;
+	j->timed = timed;
+	if (background) {
+		fprintf(stderr, "[%d] %d\n", j->id, (int)j->pgid);
+		put_job_in_background(j, 0);
+		return 0;
+	}
+	return put_job_in_foreground(j, 0);
+}
+
+// Start every stage of args as one job and add it to the job table. Stages
+// are connected by pipes and share the process group of the first.
+// Returns NULL if nothing could be started.
+Job *launch_job(char **args, int background)
+{
+	pid_t pid;
+	int mypipe[2], infile, outfile;
+	uint64_t spawn_start = now_ns();
+	Job *j = job_new(args);
+
+	if (!j)
+		return NULL;
+	j->start = monotonic_seconds();
+
+	fflush(stdout);
+	infile = STDIN_FILENO;
+	for (Process *p = j->first_process; p; p = p->next) {
+		// Set up pipes, if necessary
+		if (p->next) {
+			if (pipe2(mypipe, O_CLOEXEC) < 0) {
+				// This stage and the rest can't run: fail them like a
+				// fork error, so the job still finishes
+				perror("lsh: pipe");
+				if (infile != STDIN_FILENO)
+					close(infile);
+				for (; p; p = p->next) {
+					p->completed = 1;
+					p->status = EXIT_FAILURE << 8;
+					p->end = monotonic_seconds();
+				}
+				break;
+			}
+			outfile = mypipe[1];
+		}
+		else {
+			outfile = STDOUT_FILENO;
+		}
+
+		pid = fork(); // Creates a copy of current process
+		if (pid == 0){
+			// Child process
+			// Put the process into the job's process group and, for
+			// foreground jobs, give it the terminal. Both parent and
+			// child do this to avoid racing each other.
+			pid = getpid();
+			setpgid(pid, j->pgid ? j->pgid : pid);
+			if (shell_is_interactive && !background)
+				tcsetpgrp(shell_terminal, j->pgid ? j->pgid : pid);
+			prepare_child();
+
+			if (infile != STDIN_FILENO) {
+				dup2(infile, STDIN_FILENO);
+				close(infile);
+			}
+			if (outfile != STDOUT_FILENO) {
+				dup2(outfile, STDOUT_FILENO);
+				close(outfile);
+				close(mypipe[0]);
+			}
+			lsh_exec_child(p->argv);
+		}
+		else if (pid < 0) {
+			// Error forking: treat this stage as failed and carry on
+			perror("lsh");
+			p->completed = 1;
+			p->status = EXIT_FAILURE << 8;
+			p->end = monotonic_seconds();
+		}
+		else {
+			// Parent process
+			p->pid = pid;
+			if (!j->pgid)
+				j->pgid = pid;
+			setpgid(pid, j->pgid);
+			p->pidfd = pidfd_open(pid, 0);
+			if (p->pidfd >= 0)
+				ev_add(p->pidfd, EPOLLIN, on_pidfd, NULL);
+		}
+
+		// Clean up after pipes
+		if (infile != STDIN_FILENO)
+			close(infile);
+		if (outfile != STDOUT_FILENO)
+			close(outfile);
+		infile = mypipe[0];
+	}
+	job_add(j);
+	stats_phase(PHASE_SPAWN, spawn_start);
+
+	if (!j->pgid) {
+		// Nothing could be started
+		job_free(j);
+		return NULL;
+	}
+	return j;
+}
+
+
+/* "time" keyword: report wall clock (monotonic) and, per pipeline stage,
+ * the rusage collected by wait4(): CPU time, peak RSS, voluntary and
+ * involuntary context switches and major page faults.
+ */
+
+double timeval_seconds(struct timeval tv)
+{
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void time_report_header(void)
+{
+	fprintf(stderr, "%-24s %9s %9s %9s %10s %8s %8s %7s\n",
+		"command", "real", "user", "sys", "max rss", "vol cs", "invol cs", "maj flt");
+}
+
+void time_report_row(const char *label, double real, struct rusage *ru)
+{
+	char name[25];
+
+	// Keep the columns aligned for long command lines
+	snprintf(name, sizeof(name), "%s", label);
+	if (strlen(label) > 24)
+		memcpy(name + 21, "...", 4);
+	fprintf(stderr, "%-24s %8.3fs %8.3fs %8.3fs %7.1f MB %8ld %8ld %7ld\n",
+		name, real, timeval_seconds(ru->ru_utime), timeval_seconds(ru->ru_stime),
+		ru->ru_maxrss / 1024.0, ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_majflt);
+}
+
+void print_time_report(Job *j)
+{
+	struct rusage total;
+	double end = j->start;
+	int stages = 0;
+
+	memset(&total, 0, sizeof(total));
+	time_report_header();
+	for (Process *p = j->first_process; p; p = p->next) {
+		time_report_row(p->command, p->end - j->start, &p->rusage);
+
+		total.ru_utime.tv_sec += p->rusage.ru_utime.tv_sec;
+		total.ru_utime.tv_usec += p->rusage.ru_utime.tv_usec;
+		total.ru_stime.tv_sec += p->rusage.ru_stime.tv_sec;
+		total.ru_stime.tv_usec += p->rusage.ru_stime.tv_usec;
+		if (p->rusage.ru_maxrss > total.ru_maxrss)
+			total.ru_maxrss = p->rusage.ru_maxrss;
+		total.ru_nvcsw += p->rusage.ru_nvcsw;
+		total.ru_nivcsw += p->rusage.ru_nivcsw;
+		total.ru_majflt += p->rusage.ru_majflt;
+		if (p->end > end)
+			end = p->end;
+		stages++;
+	}
+	if (stages > 1)
+		time_report_row("total", end - j->start, &total);
+}
+
+
+
+
+// list of builtin commands followed by their corresponding functions
+
+char *builtin_str[] = {
+	"cd",
+	"help",
+	"exit",
+	"ls",
+	"pwd",
+	"clear",
+	"history",
+	"cat",
+	"grep",
+	"touch",
+	"echo",
+	"rm",
+	"jobs",
+	"fg",
+	"bg",
+	"wait",
+	"kill",
+	"parallel",
+	"run",
+	"bench",
+	"perfstat",
+	"stats",
+	"timeout",
+	"ulimit",
+	"tree",
+	"find",
+	"du",
+	"cp",
+	"mkdir",
+	"mv",
+	"ln",
+	"wc",
+	"sort",
+	"count",
+	"uniq",
+	"head",
+	"tail",
+	"cut",
+	"field"
+};
+
+int (*builtin_func[]) (char **) = {
+	&lsh_cd,
+	&lsh_help,
+	&lsh_exit,
+	&lsh_ls,
+	&lsh_pwd,
+	&lsh_clear,
+	&lsh_history,
+	&lsh_cat,
+	&lsh_grep,
+	&lsh_touch,
+	&lsh_echo,
+	&lsh_rm,
+	&lsh_jobs,
+	&lsh_fg,
+	&lsh_bg,
+	&lsh_wait,
+	&lsh_kill,
+	&lsh_parallel,
+	&lsh_run,
+	&lsh_bench,
+	&lsh_perfstat,
+	&lsh_stats,
+	&lsh_timeout,
+	&lsh_ulimit,
+	&lsh_tree,
+	&lsh_find,
+	&lsh_du,
+	&lsh_cp,
+	&lsh_mkdir,
+	&lsh_mv,
+	&lsh_ln,
+	&lsh_wc,
+	&lsh_sort,
+	&lsh_count,
+	&lsh_uniq,
+	&lsh_head,
+	&lsh_tail,
+	&lsh_cut,
+	&lsh_field
+};
+
+int lsh_num_builtins() {
+	return sizeof(builtin_str) / sizeof(char *);
+}
+
+// Builtin function implementations.
+
+int lsh_cd(char **args)
+{
+	if (args[1] == NULL) {
+		fprintf(stderr, "lsh: expected argument to \"cd\"\n");
+		return 1;
+	}
+	else {
+		if (chdir(args[1]) != 0) {
+			perror("lsh");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+int lsh_help(char **args)
+{
+	int i;
+	printf("Based off Stephen Brennan's LSH\n");
+	printf("Type program names and arguments, and hit enter.\n");
+	printf("The following are built in:\n");
+
+	for (i=0; i < lsh_num_builtins(); i++) {
+		printf(" %s\n", builtin_str[i]);
+	}
+	printf("Use the man command for information on other programs.\n");
+	return 0;
+}
+
+// exit [status] -- without a status, exit with that of the last command
+int lsh_exit(char **args)
+{
+	static int warned = 0;
+
+	// Like bash, refuse once to leave stopped jobs behind
+	for (Job *j = first_job; j; j = j->next) {
+		if (!warned && job_is_stopped(j) && !job_is_completed(j)) {
+			fprintf(stderr, "lsh: there are stopped jobs\n");
+			warned = 1;
+			return 1;
+		}
+	}
+	lsh_exit_requested = 1;
+	lsh_exit_status = args[1] ? atoi(args[1]) & 0xff : last_status;
+	return lsh_exit_status;
+}
+
+
+int lsh_pwd(char **args)
+{
+	char cwd[1024];
+	if (getcwd(cwd, sizeof(cwd)) != NULL) {
+		printf("%s\n", cwd);
+	}
+	else {
+		perror("lsh");
+		return 1;
+	}
+	return 0;
+}
+
+
+int lsh_clear(char **args) 
+{
+	//ANSI escape code to clear screen and move cursor to top
+	printf("\033[2J\033[H");
+	return 0;
+}
+
+
+int lsh_cat(char **args)
+{
+	// With no file, copy stdin so cat works at the end of a pipeline
+	FILE *fp = args[1] ? fopen(args[1], "r") : stdin;
+	if (fp == NULL) {
+		perror("lsh");
+		return 1;
+	}
+
+	char buffer[1024];
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		printf("%s", buffer);
+	}
+
+	if (fp != stdin)
+		fclose(fp);
+	return 0;
+}
+
+
+int lsh_grep(char **args) {
+	if (args[1] == NULL) {
+		fprintf(stderr, "lsh: grep requires a pattern\n");
+		return 2;
+	}
+
+	// With no file, search stdin (e.g. "ls | grep txt")
+	FILE *fp = args[2] ? fopen(args[2], "r") : stdin;
+	if (fp == NULL) {
+		perror("lsh");
+		return 2;
+	}
+
+	char *pattern = args[1];
+	char buffer[1024];
+	int line_number = 1;
+	int found = 0;
+
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		if (strstr(buffer, pattern)) {
+			printf("%d: %s", line_number, buffer);
+			found = 1;
+		}
+		line_number++;
+	}
+	if (fp != stdin)
+		fclose(fp);
+	// Like grep(1): 0 if something matched, 1 if not, 2 on error
+	return found ? 0 : 1;
+}
+
+
+int lsh_echo(char **args) {
+	if (args[1] == NULL) {
+		printf("\n");
+		return 0;
+	}
+
+	int i = 1;
+	while (args[i] != NULL && strcmp(args[i], ">") != 0) {
+		printf("%s ", args[i]);
+		i++;
+	}
+
+	if (args[i] && strcmp(args[i], ">") == 0 && args[i+1]) {
+		// Redirect to file
+		FILE *fp = fopen(args[i+1], "w");
+		if (fp == NULL) {
+			perror("lsh");
+			return 1;
+		}
+		for (int j = 1; j < i; j++) {
+			fprintf(fp, "%s ", args[j]);
+		}
+		fclose(fp);
+	}
+	else {
+		printf("\n");
+	}
+	return 0;
+}
+
+
+// Parse a job spec ("%n", "%%", "%+" or a bare number) into a job.
+// With no spec, the current job is used.
+Job *parse_job_spec(const char *spec, const char *cmd)
+{
+	Job *j;
+
+	if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+		j = current_job();
+		if (!j)
+			fprintf(stderr, "lsh: %s: no current job\n", cmd);
+		return j;
+	}
+	if (spec[0] == '%')
+		spec++;
+
+	char *end;
+	long id = strtol(spec, &end, 10);
+	j = (*spec && *end == '\0') ? find_job_by_id((int)id) : NULL;
+	if (!j)
+		fprintf(stderr, "lsh: %s: %s: no such job\n", cmd, spec);
+	return j;
+}
+
+
+int lsh_jobs(char **args)
+{
+	for (Job *j = first_job; j; j = j->next) {
+		const char *state = job_is_completed(j) ? "Done" : job_is_stopped(j) ? "Stopped" : "Running";
+		printf("[%d]%c %-8s %s\n", j->id, j == current_job() ? '+' : ' ', state, j->command);
+		if (job_is_stopped(j))
+			j->notified = 1;
+	}
+	return 0;
+}
+
+
+int lsh_fg(char **args)
+{
+	Job *j = parse_job_spec(args[1], "fg");
+	if (!j)
+		return 1;
+
+	printf("%s\n", j->command);
+	return put_job_in_foreground(j, 1);
+}
+
+
+int lsh_bg(char **args)
+{
+	Job *j = parse_job_spec(args[1], "bg");
+	if (!j)
+		return 1;
+
+	fprintf(stderr, "[%d]+ %s &\n", j->id, j->command);
+	put_job_in_background(j, 1);
+	return 0;
+}
+
+
+// wait [%job|pid ...] -- with no arguments, wait for every running job.
+// Returns the status of the last job named, or 127 if it was not found.
+int lsh_wait(char **args)
+{
+	int ret = 0;
+
+	if (args[1] == NULL) {
+		for (Job *j = first_job; j; j = j->next)
+			wait_for_job(j);
+	}
+	for (int i = 1; args[i]; i++) {
+		Job *j = NULL;
+
+		if (args[i][0] == '%') {
+			j = parse_job_spec(args[i], "wait");
+		}
+		else {
+			pid_t pid = (pid_t)atoi(args[i]);
+			for (Job *it = first_job; it && !j; it = it->next)
+				for (Process *p = it->first_process; p; p = p->next)
+					if (p->pid == pid)
+						j = it;
+			if (!j)
+				fprintf(stderr, "lsh: wait: pid %s is not a child of this shell\n", args[i]);
+		}
+		ret = 127;
+		if (j) {
+			wait_for_job(j);
+			ret = job_status(j);
+		}
+	}
+	return ret;
+}
+
+
+static const struct {
+	const char *name;
+	int num;
+} signal_names[] = {
+	{"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+	{"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+	{"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+	{"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU}, {"WINCH", SIGWINCH}
+};
+
+// Accepts "9", "KILL" or "SIGKILL"; returns -1 if unknown
+int parse_signal(const char *s)
+{
+	char *end;
+	long n = strtol(s, &end, 10);
+	if (*s && *end == '\0')
+		return (n > 0 && n < NSIG) ? (int)n : -1;
+
+	if (strncmp(s, "SIG", 3) == 0)
+		s += 3;
+	for (size_t i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]); i++)
+		if (strcmp(s, signal_names[i].name) == 0)
+			return signal_names[i].num;
+	return -1;
+}
+
+
+// kill [-SIG | -s SIG] %job|pid ...   and   kill -l
+int lsh_kill(char **args)
+{
+	int sig = SIGTERM;
+	int i = 1;
+
+	if (args[1] && strcmp(args[1], "-l") == 0) {
+		for (size_t k = 0; k < sizeof(signal_names) / sizeof(signal_names[0]); k++)
+			printf("%2d) SIG%s\n", signal_names[k].num, signal_names[k].name);
+		return 0;
+	}
+	if (args[1] && strcmp(args[1], "-s") == 0 && args[2]) {
+		sig = parse_signal(args[2]);
+		i = 3;
+	}
+	else if (args[1] && args[1][0] == '-') {
+		sig = parse_signal(args[1] + 1);
+		i = 2;
+	}
+	if (sig < 0) {
+		fprintf(stderr, "lsh: kill: invalid signal specification\n");
+		return 1;
+	}
+	if (args[i] == NULL) {
+		fprintf(stderr, "lsh: kill: usage: kill [-s sigspec | -signum] pid | %%job ...\n");
+		return 1;
+	}
+
+	int ret = 0;
+	for (; args[i]; i++) {
+		if (args[i][0] == '%') {
+			Job *j = parse_job_spec(args[i], "kill");
+			if (!j) {
+				ret = 1;
+				continue;
+			}
+			if (kill(-j->pgid, sig) < 0) {
+				perror("lsh: kill");
+				ret = 1;
+			}
+			// A stopped job has to be woken up to act on the signal
+			else if (job_is_stopped(j) && sig != SIGCONT && sig != SIGSTOP)
+				kill(-j->pgid, SIGCONT);
+		}
+		else if (kill((pid_t)atoi(args[i]), sig) < 0) {
+			perror("lsh: kill");
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
+
+/* parallel -- run a command template once per input line with up to N
+ * children at a time.
+ *
+ *   parallel [-j N] [-k] [-u] [-a file] command [args...] [::: arg...]
+ *
+ * "{}" in the template is replaced by the argument ("{.}" without its
+ * extension, "{/}" its basename, "{#}" the job number); with no "{}" the
+ * argument is appended. Arguments come from ":::", from "-a file" or from
+ * stdin, and are read lazily so the input can be arbitrarily long.
+ *
+ * Every running child is watched through its pidfd and its stdout/stderr
+ * pipes, so a slot is refilled the moment a job finishes. Output is
+ * grouped per job; with -k it is also printed in input order. In that mode
+ * the oldest unfinished job streams straight through and at most
+ * PAR_WINDOW_FACTOR * N jobs may be started ahead of it, which bounds how
+ * much finished-but-unprinted output is held in memory.
+ */
+
+#define PAR_WINDOW_FACTOR 4
+#define PAR_READ_CHUNK 65536
+#define OUTBUF_BLOCK (256 * 1024)
+
+typedef struct {
+	char *data;
+	size_t len;
+	size_t cap;
+} OutBuf;
+
+struct Parallel;
+
+typedef struct {
+	struct Parallel *par;
+	long seq;
+	pid_t pid;
+	int pidfd;
+	int out_fd;      // read ends of the child's stdout/stderr, -1 at EOF
+	int err_fd;
+	OutBuf out;
+	OutBuf err;
+	int status;
+	char exited;
+	char streaming;  // output is written through instead of buffered
+	char wait_at_eof; // no pidfd: reap with waitpid() once both pipes close
+} ParJob;
+
+typedef struct Parallel {
+	char **tmpl;
+	int max_jobs;
+	int keep_order;
+	int ungroup;
+	FILE *input;     // argument lines, or NULL when using list
+	char **list;     // arguments given after ":::"
+	int list_pos;
+	ParJob **window; // with -k, started but unprinted jobs, indexed by seq % window_size
+	long window_size;
+	long next_seq;   // sequence number of the next job to start
+	long next_emit;  // with -k, the next job whose output is printed
+	int active;
+	int failed;
+	int halted;      // stop starting jobs, e.g. after Ctrl-C
+} Parallel;
+
+// write() all of buf, retrying on short writes
+int write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+void outbuf_append(OutBuf *b, const char *data, size_t len)
+{
+	if (b->len + len > b->cap) {
+		size_t cap = b->cap ? b->cap : 4096;
+		while (cap < b->len + len)
+			cap *= 2;
+		b->data = realloc(b->data, cap);
+		if (!b->data) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		b->cap = cap;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+void outbuf_flush(OutBuf *b, int fd)
+{
+	write_all(fd, b->data, b->len);
+	free(b->data);
+	memset(b, 0, sizeof(*b));
+}
+
+// Append, writing the buffer out to fd each time it passes OUTBUF_BLOCK,
+// for builtins that produce a lot of output
+void outbuf_write(OutBuf *b, int fd, const char *data, size_t len)
+{
+	outbuf_append(b, data, len);
+	if (b->len >= OUTBUF_BLOCK) {
+		write_all(fd, b->data, b->len);
+		b->len = 0;
+	}
+}
+
+// Next argument, without its newline; NULL once the input is exhausted
+char *par_next_arg(Parallel *par)
+{
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t n;
+
+	if (!par->input)
+		return par->list[par->list_pos] ? strdup(par->list[par->list_pos++]) : NULL;
+
+	n = getline(&line, &cap, par->input);
+	if (n < 0) {
+		free(line);
+		return NULL;
+	}
+	if (n > 0 && line[n - 1] == '\n')
+		line[n - 1] = '\0';
+	return line;
+}
+
+// Expand one template word; returns a new string
+char *par_expand(const char *word, const char *arg, long seq, int *used)
+{
+	OutBuf b = {0};
+	const char *base = strrchr(arg, '/') ? strrchr(arg, '/') + 1 : arg;
+	const char *dot = strrchr(base, '.');
+	char num[32];
+
+	for (const char *w = word; *w; ) {
+		if (strncmp(w, "{}", 2) == 0) {
+			outbuf_append(&b, arg, strlen(arg));
+			w += 2;
+		}
+		else if (strncmp(w, "{.}", 3) == 0) {
+			outbuf_append(&b, arg, dot && dot != base ? (size_t)(dot - arg) : strlen(arg));
+			w += 3;
+		}
+		else if (strncmp(w, "{/}", 3) == 0) {
+			outbuf_append(&b, base, strlen(base));
+			w += 3;
+		}
+		else if (strncmp(w, "{#}", 3) == 0) {
+			snprintf(num, sizeof(num), "%ld", seq + 1);
+			outbuf_append(&b, num, strlen(num));
+			w += 3;
+		}
+		else {
+			outbuf_append(&b, w++, 1);
+			continue;
+		}
+		*used = 1;
+	}
+	outbuf_append(&b, "", 1);
+	return b.data;
+}
+
+void par_job_close_fd(int *fd)
+{
+	if (*fd >= 0) {
+		ev_del(*fd);
+		close(*fd);
+		*fd = -1;
+	}
+}
+
+void par_job_free(ParJob *job)
+{
+	par_job_close_fd(&job->out_fd);
+	par_job_close_fd(&job->err_fd);
+	par_job_close_fd(&job->pidfd);
+	free(job->out.data);
+	free(job->err.data);
+	free(job);
+}
+
+int par_job_done(ParJob *job)
+{
+	return job->exited && job->out_fd < 0 && job->err_fd < 0;
+}
+
+void par_emit(ParJob *job)
+{
+	outbuf_flush(&job->out, STDOUT_FILENO);
+	outbuf_flush(&job->err, STDERR_FILENO);
+}
+
+void par_fill(Parallel *par);
+
+// Print whatever can be printed now that job has finished
+void par_job_finished(ParJob *job)
+{
+	Parallel *par = job->par;
+
+	par->active--;
+	if (!WIFEXITED(job->status) || WEXITSTATUS(job->status) != 0)
+		par->failed++;
+	if (WIFSIGNALED(job->status) && WTERMSIG(job->status) == SIGINT)
+		par->halted = 1;
+
+	if (!par->keep_order) {
+		par_emit(job);
+		par_job_free(job);
+	}
+	else {
+		// Release finished jobs from the head of the queue, then let the
+		// new head stream its output live
+		ParJob *head;
+		while ((head = par->window[par->next_emit % par->window_size]) && par_job_done(head)) {
+			par_emit(head);
+			par->window[par->next_emit % par->window_size] = NULL;
+			par_job_free(head);
+			par->next_emit++;
+		}
+		if (head && !head->streaming) {
+			par_emit(head);
+			head->streaming = 1;
+		}
+	}
+	par_fill(par);
+}
+
+void on_par_output(int fd, uint32_t events, void *data)
+{
+	ParJob *job = data;
+	char buf[PAR_READ_CHUNK];
+	ssize_t n = read(fd, buf, sizeof(buf));
+	int is_out = fd == job->out_fd;
+
+	(void)events;
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (n <= 0) {
+		par_job_close_fd(is_out ? &job->out_fd : &job->err_fd);
+		if (job->wait_at_eof && job->out_fd < 0 && job->err_fd < 0) {
+			waitpid(job->pid, &job->status, 0);
+			job->exited = 1;
+		}
+		if (par_job_done(job))
+			par_job_finished(job);
+		return;
+	}
+	if (job->streaming)
+		write_all(is_out ? STDOUT_FILENO : STDERR_FILENO, buf, n);
+	else
+		outbuf_append(is_out ? &job->out : &job->err, buf, n);
+}
+
+void on_par_exit(int fd, uint32_t events, void *data)
+{
+	ParJob *job = data;
+
+	(void)events;
+	(void)fd;
+	if (waitpid(job->pid, &job->status, WNOHANG) <= 0)
+		return;
+	job->exited = 1;
+	par_job_close_fd(&job->pidfd);
+	if (par_job_done(job))
+		par_job_finished(job);
+}
+
+// Start job number par->next_seq with argument arg
+int par_spawn(Parallel *par, char *arg)
+{
+	int out[2], err[2], used = 0, n = 0;
+	ParJob *job = calloc(1, sizeof(ParJob));
+	char **argv;
+
+	for (n = 0; par->tmpl[n]; n++)
+		;
+	argv = malloc((n + 2) * sizeof(char *));
+	if (!job || !argv || pipe2(out, O_CLOEXEC) < 0) {
+		perror("lsh: parallel");
+		free(job);
+		free(argv);
+		return -1;
+	}
+	if (pipe2(err, O_CLOEXEC) < 0) {
+		perror("lsh: parallel");
+		close(out[0]);
+		close(out[1]);
+		free(job);
+		free(argv);
+		return -1;
+	}
+	for (int i = 0; i < n; i++)
+		argv[i] = par_expand(par->tmpl[i], arg, par->next_seq, &used);
+	argv[n] = used ? NULL : strdup(arg);
+	argv[n + 1] = NULL;
+
+	job->par = par;
+	job->seq = par->next_seq;
+	job->streaming = par->ungroup || (par->keep_order && job->seq == par->next_emit);
+
+	fflush(stdout);
+	job->pid = fork();
+	if (job->pid == 0) {
+		prepare_child();
+		dup2(out[1], STDOUT_FILENO);
+		dup2(err[1], STDERR_FILENO);
+		lsh_exec_child(argv);
+	}
+	close(out[1]);
+	close(err[1]);
+	for (int i = 0; argv[i]; i++)
+		free(argv[i]);
+	free(argv);
+
+	if (job->pid < 0) {
+		perror("lsh: parallel");
+		close(out[0]);
+		close(err[0]);
+		free(job);
+		return -1;
+	}
+
+	job->out_fd = out[0];
+	job->err_fd = err[0];
+	job->pidfd = pidfd_open(job->pid, 0);
+	ev_add(job->out_fd, EPOLLIN, on_par_output, job);
+	ev_add(job->err_fd, EPOLLIN, on_par_output, job);
+	if (job->pidfd >= 0 && ev_add(job->pidfd, EPOLLIN, on_par_exit, job) < 0) {
+		close(job->pidfd);
+		job->pidfd = -1;
+	}
+	// No pidfd: fall back to a blocking wait once the pipes close
+	if (job->pidfd < 0)
+		job->wait_at_eof = 1;
+
+	if (par->keep_order)
+		par->window[job->seq % par->window_size] = job;
+	par->next_seq++;
+	par->active++;
+	return 0;
+}
+
+// Start jobs until every slot is busy or the input runs out
+void par_fill(Parallel *par)
+{
+	while (!par->halted && par->active < par->max_jobs) {
+		// With -k, don't run too far ahead of the oldest unprinted job
+		if (par->keep_order && par->next_seq - par->next_emit >= par->window_size)
+			break;
+
+		char *arg = par_next_arg(par);
+		if (!arg) {
+			par->halted = 1;
+			break;
+		}
+		int failed = par_spawn(par, arg);
+		free(arg);
+		if (failed) {
+			par->halted = 1;
+			break;
+		}
+	}
+}
+
+int lsh_parallel(char **args)
+{
+	Parallel par;
+	int i;
+
+	memset(&par, 0, sizeof(par));
+	par.max_jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (par.max_jobs < 1)
+		par.max_jobs = 1;
+
+	for (i = 1; args[i] && args[i][0] == '-'; i++) {
+		if (strcmp(args[i], "-j") == 0 && args[i + 1]) {
+			par.max_jobs = atoi(args[++i]);
+		}
+		else if (strncmp(args[i], "-j", 2) == 0 && args[i][2]) {
+			par.max_jobs = atoi(args[i] + 2);
+		}
+		else if (strcmp(args[i], "-k") == 0) {
+			par.keep_order = 1;
+		}
+		else if (strcmp(args[i], "-u") == 0) {
+			par.ungroup = 1;
+		}
+		else if (strcmp(args[i], "-a") == 0 && args[i + 1]) {
+			if (par.input)
+				fclose(par.input);
+			par.input = fopen(args[++i], "r");
+			if (!par.input) {
+				perror("lsh: parallel");
+				return 1;
+			}
+		}
+		else {
+			fprintf(stderr, "lsh: parallel: unknown option %s\n", args[i]);
+			return 1;
+		}
+	}
+	if (par.max_jobs < 1) {
+		fprintf(stderr, "lsh: parallel: -j needs a positive number\n");
+		if (par.input)
+			fclose(par.input);
+		return 1;
+	}
+
+	par.tmpl = &args[i];
+	for (; args[i]; i++) {
+		if (strcmp(args[i], ":::") == 0) {
+			args[i] = NULL;
+			par.list = &args[i + 1];
+			break;
+		}
+	}
+	if (par.tmpl[0] == NULL) {
+		fprintf(stderr, "lsh: parallel: usage: parallel [-j N] [-k] [-u] [-a file] command [::: args...]\n");
+		if (par.input)
+			fclose(par.input);
+		return 1;
+	}
+	if (!par.list && !par.input)
+		par.input = fdopen(dup(STDIN_FILENO), "r");
+	else if (par.list && par.input) {
+		fclose(par.input);
+		par.input = NULL;
+	}
+
+	par.window_size = (long)par.max_jobs * PAR_WINDOW_FACTOR;
+	par.window = calloc(par.window_size, sizeof(ParJob *));
+	if (!par.window) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+
+	par_fill(&par);
+	while (par.active > 0)
+		ev_run_once(-1);
+
+	if (par.input)
+		fclose(par.input);
+	free(par.window);
+	if (par.failed)
+		fprintf(stderr, "lsh: parallel: %d job%s failed\n", par.failed, par.failed == 1 ? "" : "s");
+	// Like GNU parallel: the number of failed jobs, capped at 101
+	return par.failed > 101 ? 101 : par.failed;
+}
+
+
+/* run -- a small make-like task runner.
+ *
+ *   run [-f file] [-j N] [-n] [target...]
+ *
+ * Tasks are read from "Taskfile" (or -f file):
+ *
+ *   # comment
+ *   build: compile link        task name, then the tasks it depends on
+ *       in: main.c util.h      inputs, compared by mtime against...
+ *       out: my_shell          ...outputs; a task with both is skipped
+ *       gcc -o my_shell main.c when it is up to date
+ *
+ * Any other indented line is a command; a task's commands run one after
+ * another, while independent tasks run concurrently up to -j. A task also
+ * reruns if any of its dependencies ran. When everything is done a timing
+ * summary with the critical path is printed.
+ */
+
+#define TASKFILE_DEFAULT "Taskfile"
+
+enum { TASK_IDLE, TASK_WAITING, TASK_RUNNING, TASK_DONE, TASK_SKIPPED, TASK_FAILED };
+
+struct TaskRunner;
+
+typedef struct Task {
+	struct TaskRunner *runner;
+	char *name;
+	char **deps;
+	int ndeps;
+	char **inputs;
+	int ninputs;
+	char **outputs;
+	int noutputs;
+	char **cmds;
+	int ncmds;
+	struct Task **dep_tasks;
+	struct Task **dependents;
+	int ndependents;
+	int state;
+	int pending;      // dependencies that haven't finished yet
+	int mark;         // DFS colour while selecting targets
+	int ran;          // commands were actually executed
+	pid_t pid;
+	int pidfd;
+	double start;
+	double end;
+	double path;      // length of the longest dependency chain ending here
+	struct Task *path_prev;
+} Task;
+
+typedef struct TaskRunner {
+	Task **tasks;
+	int ntasks;
+	Task **ready;     // FIFO of tasks whose dependencies are all done
+	int nready;
+	int ready_head;
+	int running;
+	int max_jobs;
+	int failed;
+	int dry_run;
+} TaskRunner;
+
+// mtimes looked up during one "run", so shared inputs are only stat'ed once
+typedef struct StatCacheEntry {
+	struct StatCacheEntry *next;
+	char *path;
+	int exists;
+	struct timespec mtime;
+} StatCacheEntry;
+
+#define STAT_CACHE_BUCKETS 256
+StatCacheEntry *stat_cache[STAT_CACHE_BUCKETS];
+
+double monotonic_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned long hash_string(const char *s)
+{
+	unsigned long h = 5381; // djb2
+	while (*s)
+		h = h * 33 + (unsigned char)*s++;
+	return h;
+}
+
+StatCacheEntry *stat_cache_lookup(const char *path)
+{
+	unsigned long b = hash_string(path) % STAT_CACHE_BUCKETS;
+	struct stat st;
+
+	for (StatCacheEntry *e = stat_cache[b]; e; e = e->next)
+		if (strcmp(e->path, path) == 0)
+			return e;
+
+	StatCacheEntry *e = calloc(1, sizeof(StatCacheEntry));
+	e->path = strdup(path);
+	if (stat(path, &st) == 0) {
+		e->exists = 1;
+		e->mtime = st.st_mtim;
+	}
+	e->next = stat_cache[b];
+	stat_cache[b] = e;
+	return e;
+}
+
+// Forget a path whose file has just been rewritten
+void stat_cache_invalidate(const char *path)
+{
+	unsigned long b = hash_string(path) % STAT_CACHE_BUCKETS;
+	for (StatCacheEntry **it = &stat_cache[b]; *it; it = &(*it)->next) {
+		if (strcmp((*it)->path, path) == 0) {
+			StatCacheEntry *e = *it;
+			*it = e->next;
+			free(e->path);
+			free(e);
+			return;
+		}
+	}
+}
+
+void stat_cache_clear(void)
+{
+	for (int b = 0; b < STAT_CACHE_BUCKETS; b++) {
+		while (stat_cache[b]) {
+			StatCacheEntry *e = stat_cache[b];
+			stat_cache[b] = e->next;
+			free(e->path);
+			free(e);
+		}
+	}
+}
+
+int timespec_cmp(struct timespec a, struct timespec b)
+{
+	if (a.tv_sec != b.tv_sec)
+		return a.tv_sec < b.tv_sec ? -1 : 1;
+	if (a.tv_nsec != b.tv_nsec)
+		return a.tv_nsec < b.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+void strvec_push(char ***vec, int *n, const char *s)
+{
+	*vec = realloc(*vec, (*n + 2) * sizeof(char *));
+	if (!*vec) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	(*vec)[(*n)++] = strdup(s);
+	(*vec)[*n] = NULL;
+}
+
+void strvec_free(char **vec, int n)
+{
+	for (int i = 0; i < n; i++)
+		free(vec[i]);
+	free(vec);
+}
+
+// Split a whitespace separated list onto vec
+void strvec_push_words(char ***vec, int *n, char *words)
+{
+	for (char *w = strtok(words, LSH_TOK_DELM); w; w = strtok(NULL, LSH_TOK_DELM))
+		strvec_push(vec, n, w);
+}
+
+Task *task_find(TaskRunner *tr, const char *name)
+{
+	for (int i = 0; i < tr->ntasks; i++)
+		if (strcmp(tr->tasks[i]->name, name) == 0)
+			return tr->tasks[i];
+	return NULL;
+}
+
+void task_free(Task *t)
+{
+	free(t->name);
+	strvec_free(t->deps, t->ndeps);
+	strvec_free(t->inputs, t->ninputs);
+	strvec_free(t->outputs, t->noutputs);
+	strvec_free(t->cmds, t->ncmds);
+	free(t->dep_tasks);
+	free(t->dependents);
+	if (t->pidfd >= 0) {
+		ev_del(t->pidfd);
+		close(t->pidfd);
+	}
+	free(t);
+}
+
+int taskfile_parse(TaskRunner *tr, const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	char *line = NULL;
+	size_t cap = 0;
+	int lineno = 0;
+	Task *cur = NULL;
+
+	if (!fp) {
+		fprintf(stderr, "lsh: run: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (getline(&line, &cap, fp) >= 0) {
+		char *s = line;
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		while (*s == ' ' || *s == '\t')
+			s++;
+		if (*s == '\0' || *s == '#')
+			continue;
+
+		if (s == line) {
+			// "name: deps..."
+			char *colon = strchr(s, ':');
+			if (!colon) {
+				fprintf(stderr, "lsh: run: %s:%d: expected \"name: deps\"\n", path, lineno);
+				goto fail;
+			}
+			*colon = '\0';
+			char *end = colon;
+			while (end > s && (end[-1] == ' ' || end[-1] == '\t'))
+				*--end = '\0';
+			if (task_find(tr, s)) {
+				fprintf(stderr, "lsh: run: %s:%d: task \"%s\" defined twice\n", path, lineno, s);
+				goto fail;
+			}
+			cur = calloc(1, sizeof(Task));
+			cur->name = strdup(s);
+			cur->pidfd = -1;
+			cur->runner = tr;
+			strvec_push_words(&cur->deps, &cur->ndeps, colon + 1);
+			tr->tasks = realloc(tr->tasks, (tr->ntasks + 1) * sizeof(Task *));
+			tr->tasks[tr->ntasks++] = cur;
+		}
+		else if (!cur) {
+			fprintf(stderr, "lsh: run: %s:%d: command outside of a task\n", path, lineno);
+			goto fail;
+		}
+		else if (strncmp(s, "in:", 3) == 0) {
+			strvec_push_words(&cur->inputs, &cur->ninputs, s + 3);
+		}
+		else if (strncmp(s, "out:", 4) == 0) {
+			strvec_push_words(&cur->outputs, &cur->noutputs, s + 4);
+		}
+		else {
+			strvec_push(&cur->cmds, &cur->ncmds, s);
+		}
+	}
+	free(line);
+	fclose(fp);
+	return 0;
+
+fail:
+	free(line);
+	fclose(fp);
+	return -1;
+}
+
+// Resolve dependency names and pick the tasks needed for t, rejecting cycles
+int task_select(TaskRunner *tr, Task *t)
+{
+	if (t->mark == 2)
+		return 0;
+	if (t->mark == 1) {
+		fprintf(stderr, "lsh: run: dependency cycle through \"%s\"\n", t->name);
+		return -1;
+	}
+	t->mark = 1;
+	t->dep_tasks = calloc(t->ndeps + 1, sizeof(Task *));
+	for (int i = 0; i < t->ndeps; i++) {
+		Task *d = task_find(tr, t->deps[i]);
+		if (!d) {
+			fprintf(stderr, "lsh: run: \"%s\" depends on unknown task \"%s\"\n", t->name, t->deps[i]);
+			return -1;
+		}
+		if (task_select(tr, d) < 0)
+			return -1;
+		t->dep_tasks[i] = d;
+		d->dependents = realloc(d->dependents, (d->ndependents + 1) * sizeof(Task *));
+		d->dependents[d->ndependents++] = t;
+	}
+	t->mark = 2;
+	t->state = TASK_WAITING;
+	t->pending = t->ndeps;
+	return 0;
+}
+
+// True if every output exists and is at least as new as every input
+int task_up_to_date(Task *t)
+{
+	struct timespec oldest_out = {0, 0}, newest_in = {0, 0};
+
+	if (t->noutputs == 0 || t->ninputs == 0)
+		return 0;
+	for (int i = 0; i < t->ndeps; i++)
+		if (t->dep_tasks[i]->ran)
+			return 0;
+
+	for (int i = 0; i < t->noutputs; i++) {
+		StatCacheEntry *e = stat_cache_lookup(t->outputs[i]);
+		if (!e->exists)
+			return 0;
+		if (i == 0 || timespec_cmp(e->mtime, oldest_out) < 0)
+			oldest_out = e->mtime;
+	}
+	for (int i = 0; i < t->ninputs; i++) {
+		StatCacheEntry *e = stat_cache_lookup(t->inputs[i]);
+		if (!e->exists) {
+			fprintf(stderr, "lsh: run: %s: input %s does not exist\n", t->name, t->inputs[i]);
+			return 0;
+		}
+		if (timespec_cmp(e->mtime, newest_in) > 0)
+			newest_in = e->mtime;
+	}
+	return timespec_cmp(newest_in, oldest_out) <= 0;
+}
+
+// Body of a task's child: run its commands in order, stopping at the first failure
+void task_exec(Task *t)
+{
+	for (int i = 0; i < t->ncmds; i++) {
+		int status;
+		pid_t pid;
+
+		if (i == t->ncmds - 1)
+			lsh_exec_line_child(t->cmds[i]); // last command: no need to fork again
+		pid = fork();
+		if (pid == 0)
+			lsh_exec_line_child(t->cmds[i]);
+		if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+			perror("lsh: run");
+			_exit(EXIT_FAILURE);
+		}
+		if (wait_status_code(status) != 0)
+			_exit(wait_status_code(status));
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+void task_finish(TaskRunner *tr, Task *t);
+
+void on_task_exit(int fd, uint32_t events, void *data)
+{
+	Task *t = data;
+	int status;
+
+	(void)fd;
+	(void)events;
+	if (waitpid(t->pid, &status, WNOHANG) <= 0)
+		return;
+	ev_del(t->pidfd);
+	close(t->pidfd);
+	t->pidfd = -1;
+	t->end = monotonic_seconds();
+	for (int i = 0; i < t->noutputs; i++)
+		stat_cache_invalidate(t->outputs[i]);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		if (WIFEXITED(status))
+			fprintf(stderr, "lsh: run: task \"%s\" failed with status %d\n", t->name, WEXITSTATUS(status));
+		else
+			fprintf(stderr, "lsh: run: task \"%s\" killed by signal %d\n", t->name, WTERMSIG(status));
+		t->state = TASK_FAILED;
+	}
+	else {
+		t->state = TASK_DONE;
+	}
+	t->runner->running--;
+	task_finish(t->runner, t);
+}
+
+void task_ready(TaskRunner *tr, Task *t)
+{
+	tr->ready = realloc(tr->ready, (tr->nready + 1) * sizeof(Task *));
+	tr->ready[tr->nready++] = t;
+}
+
+void task_start(TaskRunner *tr, Task *t)
+{
+	t->start = monotonic_seconds();
+
+	if (task_up_to_date(t)) {
+		t->end = t->start;
+		t->state = TASK_SKIPPED;
+		printf("run: %s is up to date\n", t->name);
+		return;
+	}
+	t->ran = 1;
+	printf("run: %s\n", t->name);
+	if (tr->dry_run || t->ncmds == 0) {
+		for (int i = 0; tr->dry_run && i < t->ncmds; i++)
+			printf("    %s\n", t->cmds[i]);
+		t->end = t->start;
+		t->state = TASK_DONE;
+		return;
+	}
+
+	fflush(stdout);
+	t->pid = fork();
+	if (t->pid == 0) {
+		prepare_child();
+		task_exec(t);
+	}
+	if (t->pid < 0) {
+		perror("lsh: run");
+		t->state = TASK_FAILED;
+		return;
+	}
+	t->state = TASK_RUNNING;
+	t->pidfd = pidfd_open(t->pid, 0);
+	if (t->pidfd < 0 || ev_add(t->pidfd, EPOLLIN, on_task_exit, t) < 0) {
+		perror("lsh: run: pidfd_open");
+		waitpid(t->pid, NULL, 0);
+		t->state = TASK_FAILED;
+		return;
+	}
+	tr->running++;
+}
+
+// Called once t is DONE, SKIPPED or FAILED: release its dependents
+void task_finish(TaskRunner *tr, Task *t)
+{
+	double longest = 0;
+
+	for (int i = 0; i < t->ndeps; i++) {
+		if (t->dep_tasks[i]->path >= longest) {
+			longest = t->dep_tasks[i]->path;
+			t->path_prev = t->dep_tasks[i];
+		}
+	}
+	t->path = longest + (t->end - t->start);
+
+	if (t->state == TASK_FAILED) {
+		tr->failed = 1;
+		return;
+	}
+	for (int i = 0; i < t->ndependents; i++) {
+		Task *d = t->dependents[i];
+		if (d->state == TASK_WAITING && --d->pending == 0)
+			task_ready(tr, d);
+	}
+}
+
+void task_summary(TaskRunner *tr, Task **targets, int ntargets, double wall)
+{
+	double busy = 0;
+	Task *last = NULL;
+
+	printf("\n%-20s %10s  %s\n", "task", "seconds", "status");
+	for (int i = 0; i < tr->ntasks; i++) {
+		Task *t = tr->tasks[i];
+		const char *state;
+
+		switch (t->state) {
+		case TASK_DONE:    state = "done"; break;
+		case TASK_SKIPPED: state = "up to date"; break;
+		case TASK_FAILED:  state = "FAILED"; break;
+		case TASK_WAITING: state = "not run"; break;
+		default:           continue;
+		}
+		if (t->state == TASK_WAITING) {
+			printf("%-20s %10s  %s\n", t->name, "-", state);
+			continue;
+		}
+		printf("%-20s %10.3f  %s\n", t->name, t->end - t->start, state);
+		busy += t->end - t->start;
+	}
+
+	for (int i = 0; i < ntargets; i++)
+		if (targets[i]->state != TASK_WAITING && (!last || targets[i]->path > last->path))
+			last = targets[i];
+	printf("wall %.3fs, task time %.3fs", wall, busy);
+	if (busy > 0 && wall > 0)
+		printf(" (%.2fx parallelism)", busy / wall);
+	printf("\n");
+	if (last) {
+		// Walk the chain back from the target, then print it forwards
+		int n = 0;
+		for (Task *t = last; t; t = t->path_prev)
+			n++;
+		Task **chain = malloc(n * sizeof(Task *));
+		int k = n;
+		for (Task *t = last; t; t = t->path_prev)
+			chain[--k] = t;
+		printf("critical path %.3fs:", last->path);
+		for (k = 0; k < n; k++)
+			printf("%s %s (%.3fs)", k ? " ->" : "", chain[k]->name, chain[k]->end - chain[k]->start);
+		printf("\n");
+		free(chain);
+	}
+}
+
+int lsh_run(char **args)
+{
+	TaskRunner tr;
+	const char *file = TASKFILE_DEFAULT;
+	char **names = NULL;
+	int nnames = 0;
+	Task **targets = NULL;
+	int ntargets = 0;
+	double started;
+	int ret = 1;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.max_jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	for (int i = 1; args[i]; i++) {
+		if (strcmp(args[i], "-f") == 0 && args[i + 1])
+			file = args[++i];
+		else if (strcmp(args[i], "-j") == 0 && args[i + 1])
+			tr.max_jobs = atoi(args[++i]);
+		else if (strncmp(args[i], "-j", 2) == 0 && args[i][2])
+			tr.max_jobs = atoi(args[i] + 2);
+		else if (strcmp(args[i], "-n") == 0)
+			tr.dry_run = 1;
+		else if (args[i][0] == '-') {
+			fprintf(stderr, "lsh: run: usage: run [-f file] [-j N] [-n] [target...]\n");
+			return 1;
+		}
+		else
+			strvec_push(&names, &nnames, args[i]);
+	}
+	if (tr.max_jobs < 1)
+		tr.max_jobs = 1;
+
+	if (taskfile_parse(&tr, file) < 0)
+		goto out;
+	if (tr.ntasks == 0) {
+		fprintf(stderr, "lsh: run: %s defines no tasks\n", file);
+		goto out;
+	}
+	if (nnames == 0)
+		strvec_push(&names, &nnames, tr.tasks[0]->name);
+
+	targets = malloc(nnames * sizeof(Task *));
+	for (int i = 0; i < nnames; i++) {
+		Task *t = task_find(&tr, names[i]);
+		if (!t) {
+			fprintf(stderr, "lsh: run: no task named \"%s\"\n", names[i]);
+			goto out;
+		}
+		if (task_select(&tr, t) < 0)
+			goto out;
+		targets[ntargets++] = t;
+	}
+	for (int i = 0; i < tr.ntasks; i++)
+		if (tr.tasks[i]->state == TASK_WAITING && tr.tasks[i]->pending == 0)
+			task_ready(&tr, tr.tasks[i]);
+
+	started = monotonic_seconds();
+	for (;;) {
+		// Fill free slots; tasks that finish without a child release their
+		// dependents immediately
+		while (!tr.failed && tr.running < tr.max_jobs && tr.ready_head < tr.nready) {
+			Task *t = tr.ready[tr.ready_head++];
+			task_start(&tr, t);
+			if (t->state != TASK_RUNNING)
+				task_finish(&tr, t);
+		}
+		if (tr.running == 0)
+			break;
+		ev_run_once(-1);
+	}
+	task_summary(&tr, targets, ntargets, monotonic_seconds() - started);
+	ret = tr.failed;
+
+out:
+	for (int i = 0; i < tr.ntasks; i++)
+		task_free(tr.tasks[i]);
+	free(tr.tasks);
+	free(tr.ready);
+	free(targets);
+	strvec_free(names, nnames);
+	stat_cache_clear();
+	return ret;
+}
+
+
+/* bench -- repeated, statistically summarised command timing.
+ *
+ *   bench [-w warmup] [-n runs] [-p prepare] [--drop-caches] [-i] [-o]
+ *         [--export-csv file] [--export-json file] command [command...]
+ *
+ * Each command is a single word (quote it) and is run directly from the
+ * shell, so only a pipeline gets an extra process. Output goes to /dev/null
+ * unless -o is given. -p runs a command before every run (untimed);
+ * --drop-caches syncs and drops the page cache instead (needs root). A
+ * failing run aborts the benchmark unless -i is given.
+ *
+ * For each command the wall times are summarised as mean, stddev, median,
+ * min/max and percentiles, with a 95% confidence interval for the mean.
+ * Runs whose modified z-score (based on the median absolute deviation)
+ * exceeds 3.5 are reported as outliers. With several commands the fastest
+ * is compared against the rest.
+ */
+
+#define BENCH_DEFAULT_RUNS 10
+#define BENCH_OUTLIER_Z 3.5
+
+typedef struct {
+	char *command;
+	double *times;    // wall seconds per run
+	int nruns;
+	double user;      // mean CPU seconds per run
+	double sys;
+	double mean;
+	double stddev;
+	double median;
+	double min;
+	double max;
+	double p5, p25, p75, p95;
+	double ci;        // half-width of the 95% confidence interval of the mean
+	int outliers;
+} BenchResult;
+
+typedef struct {
+	pid_t pid;
+	int done;
+	int status;
+	struct rusage ru;
+} BenchChild;
+
+int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Percentile of sorted data, interpolating between neighbouring samples
+double percentile(const double *sorted, int n, double pct)
+{
+	double rank = pct / 100.0 * (n - 1);
+	int lo = (int)rank;
+
+	if (lo >= n - 1)
+		return sorted[n - 1];
+	return sorted[lo] + (rank - lo) * (sorted[lo + 1] - sorted[lo]);
+}
+
+// Two-sided 95% Student's t critical value for df degrees of freedom
+double t_critical_95(int df)
+{
+	static const double table[] = {
+		0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+		2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+		2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+	};
+	if (df < 1)
+		return 0;
+	if (df <= 30)
+		return table[df];
+	return df <= 60 ? 2.000 : df <= 120 ? 1.980 : 1.960;
+}
+
+void bench_summarise(BenchResult *r)
+{
+	int n = r->nruns;
+	double *sorted = malloc(n * sizeof(double));
+	double *dev = malloc(n * sizeof(double));
+	double sum = 0, sq = 0, mad;
+
+	memcpy(sorted, r->times, n * sizeof(double));
+	qsort(sorted, n, sizeof(double), compare_doubles);
+	for (int i = 0; i < n; i++)
+		sum += sorted[i];
+	r->mean = sum / n;
+	for (int i = 0; i < n; i++)
+		sq += (sorted[i] - r->mean) * (sorted[i] - r->mean);
+	r->stddev = n > 1 ? sqrt(sq / (n - 1)) : 0;
+	r->ci = n > 1 ? t_critical_95(n - 1) * r->stddev / sqrt(n) : 0;
+	r->median = percentile(sorted, n, 50);
+	r->min = sorted[0];
+	r->max = sorted[n - 1];
+	r->p5 = percentile(sorted, n, 5);
+	r->p25 = percentile(sorted, n, 25);
+	r->p75 = percentile(sorted, n, 75);
+	r->p95 = percentile(sorted, n, 95);
+
+	// Modified z-score: 0.6745 * |x - median| / MAD
+	for (int i = 0; i < n; i++)
+		dev[i] = fabs(sorted[i] - r->median);
+	qsort(dev, n, sizeof(double), compare_doubles);
+	mad = percentile(dev, n, 50);
+	r->outliers = 0;
+	for (int i = 0; mad > 0 && i < n; i++)
+		if (0.6745 * fabs(sorted[i] - r->median) / mad > BENCH_OUTLIER_Z)
+			r->outliers++;
+	free(sorted);
+	free(dev);
+}
+
+// Print a duration with a unit that suits its size
+void format_duration(char *buf, size_t size, double secs)
+{
+	if (secs < 1e-3)
+		snprintf(buf, size, "%.1f us", secs * 1e6);
+	else if (secs < 1)
+		snprintf(buf, size, "%.2f ms", secs * 1e3);
+	else
+		snprintf(buf, size, "%.3f s", secs);
+}
+
+void on_bench_exit(int fd, uint32_t events, void *data)
+{
+	BenchChild *c = data;
+
+	(void)fd;
+	(void)events;
+	if (wait4(c->pid, &c->status, WNOHANG, &c->ru) > 0)
+		c->done = 1;
+}
+
+// Run line once with output discarded unless show_output; returns the wall
+// time in seconds or -1 if it could not be run or failed.
+double bench_run_once(const char *line, int show_output, struct rusage *ru)
+{
+	BenchChild c;
+	int pidfd;
+	double start;
+
+	memset(&c, 0, sizeof(c));
+	fflush(stdout);
+	start = monotonic_seconds();
+	c.pid = fork();
+	if (c.pid == 0) {
+		prepare_child();
+		int devnull = open("/dev/null", O_RDWR);
+		dup2(devnull, STDIN_FILENO);
+		if (!show_output) {
+			dup2(devnull, STDOUT_FILENO);
+			dup2(devnull, STDERR_FILENO);
+		}
+		lsh_exec_line_child(line);
+	}
+	if (c.pid < 0) {
+		perror("lsh: bench");
+		return -1;
+	}
+
+	pidfd = pidfd_open(c.pid, 0);
+	if (pidfd < 0 || ev_add(pidfd, EPOLLIN, on_bench_exit, &c) < 0) {
+		c.done = wait4(c.pid, &c.status, 0, &c.ru) > 0;
+	}
+	while (!c.done)
+		ev_run_once(-1);
+	double elapsed = monotonic_seconds() - start;
+	if (pidfd >= 0) {
+		ev_del(pidfd);
+		close(pidfd);
+	}
+
+	if (ru)
+		*ru = c.ru;
+	if (!WIFEXITED(c.status) || WEXITSTATUS(c.status) != 0)
+		return -elapsed - 1;
+	return elapsed;
+}
+
+// Before each run: either the user's prepare command or a page cache drop
+int bench_prepare(const char *prepare, int drop_caches)
+{
+	if (drop_caches) {
+		int fd;
+		sync();
+		fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+		if (fd < 0 || write(fd, "3\n", 2) != 2) {
+			perror("lsh: bench: /proc/sys/vm/drop_caches");
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+		close(fd);
+	}
+	if (prepare && bench_run_once(prepare, 0, NULL) < 0) {
+		fprintf(stderr, "lsh: bench: prepare command \"%s\" failed\n", prepare);
+		return -1;
+	}
+	return 0;
+}
+
+void bench_print(BenchResult *r, int index)
+{
+	char mean[32], sd[32], ci[32], med[32], lo[32], hi[32], p5[32], p95[32];
+
+	format_duration(mean, sizeof(mean), r->mean);
+	format_duration(sd, sizeof(sd), r->stddev);
+	format_duration(ci, sizeof(ci), r->ci);
+	format_duration(med, sizeof(med), r->median);
+	format_duration(lo, sizeof(lo), r->min);
+	format_duration(hi, sizeof(hi), r->max);
+	format_duration(p5, sizeof(p5), r->p5);
+	format_duration(p95, sizeof(p95), r->p95);
+
+	printf("Benchmark %d: %s\n", index + 1, r->command);
+	printf("  Time (mean ± σ):   %10s ± %s   [95%% CI ± %s]   User: %.2f ms, System: %.2f ms\n",
+		mean, sd, ci, r->user * 1e3, r->sys * 1e3);
+	printf("  Median:            %10s   p5 %s   p95 %s\n", med, p5, p95);
+	printf("  Range (min … max): %10s … %s   %d runs\n", lo, hi, r->nruns);
+	if (r->outliers)
+		printf("  Warning: %d statistical outlier%s detected; consider more warmup runs or a quieter system.\n",
+			r->outliers, r->outliers == 1 ? "" : "s");
+	printf("\n");
+}
+
+void bench_compare(BenchResult *res, int n)
+{
+	int fastest = 0;
+
+	for (int i = 1; i < n; i++)
+		if (res[i].mean < res[fastest].mean)
+			fastest = i;
+	printf("Summary\n  %s ran\n", res[fastest].command);
+	for (int i = 0; i < n; i++) {
+		if (i == fastest)
+			continue;
+		BenchResult *f = &res[fastest], *r = &res[i];
+		double ratio = r->mean / f->mean;
+		// Propagate the relative uncertainties of both means
+		double rel_sd = sqrt(pow(r->stddev / r->mean, 2) + pow(f->stddev / f->mean, 2));
+		double rel_ci = sqrt(pow(r->ci / r->mean, 2) + pow(f->ci / f->mean, 2));
+		printf("    %6.2f ± %.2f times faster than %s  (95%% CI %.2f … %.2f)\n",
+			ratio, ratio * rel_sd, r->command, ratio * (1 - rel_ci), ratio * (1 + rel_ci));
+	}
+}
+
+// Minimal JSON string escaping for command lines
+void json_print_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+int bench_export(BenchResult *res, int n, const char *csv, const char *json)
+{
+	FILE *fp;
+
+	if (csv) {
+		if (!(fp = fopen(csv, "w"))) {
+			perror("lsh: bench");
+			return -1;
+		}
+		fprintf(fp, "command,mean,stddev,median,user,system,min,max,p5,p95,ci95,runs,outliers\n");
+		for (int i = 0; i < n; i++) {
+			BenchResult *r = &res[i];
+			fputc('"', fp);
+			for (const char *c = r->command; *c; c++)
+				fprintf(fp, *c == '"' ? "\"\"" : "%c", *c);
+			fprintf(fp, "\",%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%d,%d\n",
+				r->mean, r->stddev, r->median, r->user, r->sys, r->min, r->max,
+				r->p5, r->p95, r->ci, r->nruns, r->outliers);
+		}
+		fclose(fp);
+	}
+	if (json) {
+		if (!(fp = fopen(json, "w"))) {
+			perror("lsh: bench");
+			return -1;
+		}
+		fprintf(fp, "{\n  \"results\": [\n");
+		for (int i = 0; i < n; i++) {
+			BenchResult *r = &res[i];
+			fprintf(fp, "    {\n      \"command\": ");
+			json_print_string(fp, r->command);
+			fprintf(fp, ",\n      \"mean\": %.9f,\n      \"stddev\": %.9f,\n      \"median\": %.9f,\n"
+				"      \"user\": %.9f,\n      \"system\": %.9f,\n      \"min\": %.9f,\n      \"max\": %.9f,\n"
+				"      \"p5\": %.9f,\n      \"p25\": %.9f,\n      \"p75\": %.9f,\n      \"p95\": %.9f,\n"
+				"      \"ci95\": %.9f,\n      \"outliers\": %d,\n      \"times\": [",
+				r->mean, r->stddev, r->median, r->user, r->sys, r->min, r->max,
+				r->p5, r->p25, r->p75, r->p95, r->ci, r->outliers);
+			for (int k = 0; k < r->nruns; k++)
+				fprintf(fp, "%s%.9f", k ? ", " : "", r->times[k]);
+			fprintf(fp, "]\n    }%s\n", i + 1 < n ? "," : "");
+		}
+		fprintf(fp, "  ]\n}\n");
+		fclose(fp);
+	}
+	return 0;
+}
+
+int lsh_bench(char **args)
+{
+	int warmup = 0, runs = BENCH_DEFAULT_RUNS, show_output = 0, ignore_failure = 0, drop_caches = 0;
+	const char *prepare = NULL, *csv = NULL, *json = NULL;
+	BenchResult *res = NULL;
+	char **cmds = NULL;
+	int ncmds = 0, ncmd_args = 0, i;
+	int ret = 1;
+
+	// Options may come before or after the commands
+	for (i = 1; args[i]; i++) {
+		if (args[i][0] != '-')
+			strvec_push(&cmds, &ncmd_args, args[i]);
+		else if (strcmp(args[i], "-w") == 0 && args[i + 1])
+			warmup = atoi(args[++i]);
+		else if (strcmp(args[i], "-n") == 0 && args[i + 1])
+			runs = atoi(args[++i]);
+		else if (strcmp(args[i], "-p") == 0 && args[i + 1])
+			prepare = args[++i];
+		else if (strcmp(args[i], "--drop-caches") == 0)
+			drop_caches = 1;
+		else if (strcmp(args[i], "-i") == 0)
+			ignore_failure = 1;
+		else if (strcmp(args[i], "-o") == 0)
+			show_output = 1;
+		else if (strcmp(args[i], "--export-csv") == 0 && args[i + 1])
+			csv = args[++i];
+		else if (strcmp(args[i], "--export-json") == 0 && args[i + 1])
+			json = args[++i];
+		else {
+			fprintf(stderr, "lsh: bench: unknown option %s\n", args[i]);
+			strvec_free(cmds, ncmd_args);
+			return 1;
+		}
+	}
+	if (ncmd_args == 0 || runs < 2 || warmup < 0) {
+		fprintf(stderr, "lsh: bench: usage: bench [-w warmup] [-n runs>=2] [-p prepare] [--drop-caches] [-i] [-o]\n"
+			"                  [--export-csv file] [--export-json file] 'command' ...\n");
+		strvec_free(cmds, ncmd_args);
+		return 1;
+	}
+
+	for (i = 0; i < ncmd_args; i++) {
+		BenchResult *r;
+		struct rusage ru;
+		double elapsed;
+
+		res = realloc(res, (ncmds + 1) * sizeof(BenchResult));
+		r = &res[ncmds++];
+		memset(r, 0, sizeof(*r));
+		r->command = cmds[i];
+		r->times = malloc(runs * sizeof(double));
+
+		for (int k = 0; k < warmup; k++) {
+			if (bench_prepare(prepare, drop_caches) < 0)
+				goto out;
+			if (bench_run_once(r->command, show_output, NULL) < 0 && !ignore_failure) {
+				fprintf(stderr, "lsh: bench: \"%s\" failed during warmup (use -i to ignore)\n", r->command);
+				goto out;
+			}
+		}
+		for (int k = 0; k < runs; k++) {
+			if (bench_prepare(prepare, drop_caches) < 0)
+				goto out;
+			elapsed = bench_run_once(r->command, show_output, &ru);
+			if (elapsed < 0) {
+				if (!ignore_failure) {
+					fprintf(stderr, "lsh: bench: \"%s\" failed (use -i to ignore)\n", r->command);
+					goto out;
+				}
+				elapsed = -elapsed - 1;
+			}
+			r->times[r->nruns++] = elapsed;
+			r->user += timeval_seconds(ru.ru_utime) / runs;
+			r->sys += timeval_seconds(ru.ru_stime) / runs;
+			if (shell_is_interactive && !show_output) {
+				fprintf(stderr, "\r  %s: run %d/%d\033[K", r->command, k + 1, runs);
+				if (k + 1 == runs)
+					fprintf(stderr, "\r\033[K");
+			}
+		}
+		bench_summarise(r);
+		bench_print(r, ncmds - 1);
+	}
+	if (ncmds > 1)
+		bench_compare(res, ncmds);
+	ret = bench_export(res, ncmds, csv, json) < 0;
+
+out:
+	for (int k = 0; k < ncmds; k++)
+		free(res[k].times);
+	free(res);
+	strvec_free(cmds, ncmd_args);
+	return ret;
+}
+
+
+/* perfstat -- count hardware and software events for one command.
+ *
+ *   perfstat command [args...]
+ *
+ * The child is forked and parked on a pipe while the counters are attached
+ * to it with perf_event_open(); inherit makes them follow every process it
+ * creates, and enable_on_exec starts counting only once the program itself
+ * is running. Hardware counters (cycles, instructions, caches, branches)
+ * are often unavailable in VMs and containers or blocked by
+ * perf_event_paranoid; in that case only the software counters are shown.
+ */
+
+typedef struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+	int fd;
+	uint64_t value;
+	double scale;     // enabled/running; > 1 when the PMU was multiplexed
+} PerfCounter;
+
+int perf_event_open(struct perf_event_attr *attr, pid_t pid, int cpu, int group_fd, unsigned long flags)
+{
+	return (int)syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+int perf_counter_open(PerfCounter *c, pid_t pid, int on_exec)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = c->type;
+	attr.config = c->config;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.enable_on_exec = on_exec;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	c->fd = perf_event_open(&attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	if (c->fd < 0 && errno == EACCES) {
+		// perf_event_paranoid >= 2 still allows counting user space only
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		c->fd = perf_event_open(&attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	}
+	return c->fd;
+}
+
+void perf_counter_read(PerfCounter *c)
+{
+	uint64_t buf[3]; // value, time enabled, time running
+
+	c->value = 0;
+	c->scale = 0;
+	if (c->fd < 0 || read(c->fd, buf, sizeof(buf)) != sizeof(buf) || buf[2] == 0)
+		return;
+	c->scale = (double)buf[1] / buf[2];
+	c->value = (uint64_t)(buf[0] * c->scale);
+}
+
+PerfCounter *perf_find(PerfCounter *cs, int n, const char *name)
+{
+	for (int i = 0; i < n; i++)
+		if (strcmp(cs[i].name, name) == 0 && cs[i].fd >= 0 && cs[i].scale > 0)
+			return &cs[i];
+	return NULL;
+}
+
+// Wait for a child through its pidfd; falls back to a blocking wait4
+void wait_child_event_loop(pid_t pid, int *status, struct rusage *ru)
+{
+	BenchChild c;
+	int pidfd = pidfd_open(pid, 0);
+
+	memset(&c, 0, sizeof(c));
+	c.pid = pid;
+	if (pidfd < 0 || ev_add(pidfd, EPOLLIN, on_bench_exit, &c) < 0)
+		c.done = wait4(pid, &c.status, 0, &c.ru) > 0;
+	while (!c.done)
+		ev_run_once(-1);
+	if (pidfd >= 0) {
+		ev_del(pidfd);
+		close(pidfd);
+	}
+	*status = c.status;
+	if (ru)
+		*ru = c.ru;
+}
+
+int lsh_perfstat(char **args)
+{
+	PerfCounter counters[] = {
+		{"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, -1, 0, 0},
+		{"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, -1, 0, 0},
+		{"cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, -1, 0, 0},
+		{"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, -1, 0, 0},
+		{"major-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ, -1, 0, 0},
+		{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1, 0, 0},
+		{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1, 0, 0},
+		{"cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, -1, 0, 0},
+		{"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1, 0, 0},
+		{"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS, -1, 0, 0},
+		{"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1, 0, 0},
+	};
+	int ncounters = sizeof(counters) / sizeof(counters[0]);
+	int go[2], status, opened = 0, hardware = 0, on_exec;
+	struct rusage ru;
+	double start, wall;
+	pid_t pid;
+	char **cmd = &args[1];
+
+	if (cmd[0] == NULL) {
+		fprintf(stderr, "lsh: perfstat: usage: perfstat command [args...]\n");
+		return 1;
+	}
+	if (pipe2(go, O_CLOEXEC) < 0) {
+		perror("lsh: perfstat");
+		return 1;
+	}
+
+	// Counting can start at exec only if the child actually execs
+	on_exec = 1;
+	for (int i = 0; i < lsh_num_builtins(); i++)
+		if (strcmp(cmd[0], builtin_str[i]) == 0)
+			on_exec = 0;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		char c;
+		prepare_child();
+		close(go[1]);
+		// Park until the parent has attached the counters
+		if (read(go[0], &c, 1) != 1)
+			_exit(EXIT_FAILURE);
+		close(go[0]);
+		lsh_exec_child(cmd);
+	}
+	close(go[0]);
+	if (pid < 0) {
+		perror("lsh: perfstat");
+		close(go[1]);
+		return 1;
+	}
+
+	for (int i = 0; i < ncounters; i++) {
+		if (perf_counter_open(&counters[i], pid, on_exec) >= 0) {
+			opened++;
+			if (counters[i].type == PERF_TYPE_HARDWARE)
+				hardware++;
+			if (!on_exec)
+				ioctl(counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+	if (opened == 0)
+		fprintf(stderr, "lsh: perfstat: perf_event_open: %s (see /proc/sys/kernel/perf_event_paranoid)\n", strerror(errno));
+
+	start = monotonic_seconds();
+	if (write(go[1], "x", 1) != 1)
+		perror("lsh: perfstat");
+	close(go[1]);
+	wait_child_event_loop(pid, &status, &ru);
+	wall = monotonic_seconds() - start;
+
+	for (int i = 0; i < ncounters; i++)
+		perf_counter_read(&counters[i]);
+
+	fprintf(stderr, "\n Performance counter stats for '");
+	for (int i = 0; cmd[i]; i++)
+		fprintf(stderr, "%s%s", i ? " " : "", cmd[i]);
+	fprintf(stderr, "':\n\n");
+
+	for (int i = 0; i < ncounters; i++) {
+		PerfCounter *c = &counters[i];
+		PerfCounter *other;
+
+		if (c->fd < 0)
+			continue;
+		if (c->scale == 0) {
+			fprintf(stderr, "   %18s      %-18s\n", "<not counted>", c->name);
+			continue;
+		}
+		if (c->config == PERF_COUNT_SW_TASK_CLOCK && c->type == PERF_TYPE_SOFTWARE)
+			fprintf(stderr, "   %18.2f msec %-18s #  %6.3f CPUs utilized", c->value / 1e6, c->name,
+				wall > 0 ? c->value / 1e9 / wall : 0);
+		else
+			fprintf(stderr, "   %18llu      %-18s", (unsigned long long)c->value, c->name);
+
+		if (strcmp(c->name, "instructions") == 0 && (other = perf_find(counters, ncounters, "cycles")) && other->value)
+			fprintf(stderr, " #  %6.2f insn per cycle", (double)c->value / other->value);
+		else if (strcmp(c->name, "cache-misses") == 0 && (other = perf_find(counters, ncounters, "cache-references")) && other->value)
+			fprintf(stderr, " #  %6.2f%% of all cache refs", 100.0 * c->value / other->value);
+		else if (strcmp(c->name, "branch-misses") == 0 && (other = perf_find(counters, ncounters, "branches")) && other->value)
+			fprintf(stderr, " #  %6.2f%% of all branches", 100.0 * c->value / other->value);
+		if (c->scale > 1.0001)
+			fprintf(stderr, "  (%.1f%%)", 100.0 / c->scale);
+		fprintf(stderr, "\n");
+	}
+	for (int i = 0; i < ncounters; i++)
+		if (counters[i].fd >= 0)
+			close(counters[i].fd);
+	if (opened > 0 && hardware == 0)
+		fprintf(stderr, "\n   hardware counters unavailable; showing software counters only\n");
+
+	fprintf(stderr, "\n   %18.9f seconds time elapsed\n", wall);
+	fprintf(stderr, "   %18.9f seconds user\n", timeval_seconds(ru.ru_utime));
+	fprintf(stderr, "   %18.9f seconds sys\n\n", timeval_seconds(ru.ru_stime));
+	return wait_status_code(status);
+}
+
+
+/* Shell self-instrumentation. Every phase of lsh_loop (read, tokenize,
+ * dispatch, spawn, wait), every builtin and every external command records
+ * its wall time into a log-bucketed histogram in the spirit of HdrHistogram:
+ * 8 linear sub-buckets per power of two, so any recorded value is known to
+ * within 12.5%. A record is two vDSO clock_gettime() calls plus a few
+ * relaxed atomic adds, cheap enough to leave on all the time. "stats"
+ * prints the percentiles, and the directory cache's counters; "stats -r"
+ * resets them.
+ */
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+#define STATS_MAX_COMMANDS 64
+
+typedef struct {
+	char name[40];
+	_Atomic uint64_t count;
+	_Atomic uint64_t sum;     // nanoseconds
+	_Atomic uint64_t max;
+	_Atomic uint64_t buckets[HIST_BUCKETS];
+} Histogram;
+
+Histogram phase_hist[PHASE_COUNT] = {
+	{.name = "phase read (incl. idle)"},
+	{.name = "phase tokenize"},
+	{.name = "phase dispatch"},
+	{.name = "phase spawn"},
+	{.name = "phase wait"},
+};
+Histogram *command_hist[STATS_MAX_COMMANDS]; // builtins and external commands, by name
+int command_hist_count = 0;
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int hist_index(uint64_t v)
+{
+	if (v < HIST_SUB)
+		return (int)v;
+	int msb = 63 - __builtin_clzll(v);
+	int shift = msb - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+}
+
+// Smallest value that lands in bucket idx
+uint64_t hist_bucket_low(int idx)
+{
+	if (idx < HIST_SUB)
+		return idx;
+	int shift = idx / HIST_SUB - 1;
+	return (uint64_t)(HIST_SUB + idx % HIST_SUB) << shift;
+}
+
+void hist_record(Histogram *h, uint64_t ns)
+{
+	uint64_t old;
+
+	atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->buckets[hist_index(ns)], 1, memory_order_relaxed);
+	old = atomic_load_explicit(&h->max, memory_order_relaxed);
+	while (ns > old && !atomic_compare_exchange_weak_explicit(&h->max, &old, ns,
+			memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+// Value at the given percentile, reported as the middle of its bucket
+uint64_t hist_percentile(Histogram *h, double pct)
+{
+	uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+	uint64_t want = (uint64_t)ceil(pct / 100.0 * count), seen = 0;
+
+	if (want == 0)
+		want = 1;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+		if (seen >= want) {
+			uint64_t lo = hist_bucket_low(i), hi = hist_bucket_low(i + 1);
+			uint64_t mid = lo + (hi - lo) / 2;
+			uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+			return mid < max ? mid : max;
+		}
+	}
+	return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+void hist_reset(Histogram *h)
+{
+	atomic_store_explicit(&h->count, 0, memory_order_relaxed);
+	atomic_store_explicit(&h->sum, 0, memory_order_relaxed);
+	atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+	for (int i = 0; i < HIST_BUCKETS; i++)
+		atomic_store_explicit(&h->buckets[i], 0, memory_order_relaxed);
+}
+
+void stats_phase(int phase, uint64_t start_ns)
+{
+	hist_record(&phase_hist[phase], now_ns() - start_ns);
+}
+
+// Histogram for "builtin NAME" or "cmd NAME"; distinct names past the
+// table size share one "other" entry
+Histogram *stats_command_hist(const char *kind, const char *name)
+{
+	char key[40];
+	const char *base = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+
+	snprintf(key, sizeof(key), "%s %s", kind, base);
+	for (int i = 0; i < command_hist_count; i++)
+		if (strcmp(command_hist[i]->name, key) == 0)
+			return command_hist[i];
+	if (command_hist_count == STATS_MAX_COMMANDS - 1) {
+		snprintf(key, sizeof(key), "%s", "(other commands)");
+		for (int i = 0; i < command_hist_count; i++)
+			if (strcmp(command_hist[i]->name, key) == 0)
+				return command_hist[i];
+	}
+	Histogram *h = calloc(1, sizeof(Histogram));
+	if (!h) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	snprintf(h->name, sizeof(h->name), "%s", key);
+	command_hist[command_hist_count++] = h;
+	return h;
+}
+
+void stats_record_command(const char *kind, const char *name, uint64_t ns)
+{
+	hist_record(stats_command_hist(kind, name), ns);
+}
+
+void stats_print_row(Histogram *h)
+{
+	uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+	char mean[32], p50[32], p90[32], p99[32], p999[32], max[32];
+
+	if (count == 0)
+		return;
+	format_duration(mean, sizeof(mean), atomic_load_explicit(&h->sum, memory_order_relaxed) / 1e9 / count);
+	format_duration(p50, sizeof(p50), hist_percentile(h, 50) / 1e9);
+	format_duration(p90, sizeof(p90), hist_percentile(h, 90) / 1e9);
+	format_duration(p99, sizeof(p99), hist_percentile(h, 99) / 1e9);
+	format_duration(p999, sizeof(p999), hist_percentile(h, 99.9) / 1e9);
+	format_duration(max, sizeof(max), atomic_load_explicit(&h->max, memory_order_relaxed) / 1e9);
+	printf("%-26s %7llu %11s %11s %11s %11s %11s %11s\n", h->name, (unsigned long long)count,
+		mean, p50, p90, p99, p999, max);
+}
+
+int lsh_stats(char **args)
+{
+	if (args[1] && strcmp(args[1], "-r") == 0) {
+		for (int i = 0; i < PHASE_COUNT; i++)
+			hist_reset(&phase_hist[i]);
+		for (int i = 0; i < command_hist_count; i++)
+			hist_reset(command_hist[i]);
+		dircache_stats(1);
+		return 0;
+	}
+	printf("%-26s %7s %11s %11s %11s %11s %11s %11s\n", "", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+	for (int i = 0; i < PHASE_COUNT; i++)
+		stats_print_row(&phase_hist[i]);
+	for (int i = 0; i < command_hist_count; i++)
+		stats_print_row(command_hist[i]);
+	dircache_stats(0);
+	return 0;
+}
+
+
+/* timeout [-s SIG] [-k DURATION] DURATION command [args...]
+ *
+ * Runs the command as an ordinary foreground job with a timerfd armed in
+ * the event loop; there is no watchdog process. When it fires the job's
+ * process group gets SIGTERM (or -s SIG), and if it is still around
+ * kill-after later (-k, default 5s, 0 to disable) it gets SIGKILL.
+ * Durations are seconds with an optional ms, s, m, h or d suffix.
+ */
+
+#define TIMEOUT_KILL_AFTER_DEFAULT 5.0
+
+// Parse "1.5", "250ms", "2m" ...; returns -1 if malformed
+int parse_duration(const char *s, double *secs)
+{
+	char *end;
+	double v = strtod(s, &end);
+
+	if (end == s || v < 0)
+		return -1;
+	if (strcmp(end, "") == 0 || strcmp(end, "s") == 0)
+		*secs = v;
+	else if (strcmp(end, "ms") == 0)
+		*secs = v / 1000;
+	else if (strcmp(end, "m") == 0)
+		*secs = v * 60;
+	else if (strcmp(end, "h") == 0)
+		*secs = v * 3600;
+	else if (strcmp(end, "d") == 0)
+		*secs = v * 86400;
+	else
+		return -1;
+	return 0;
+}
+
+void on_job_timeout(int fd, uint32_t events, void *data)
+{
+	Job *j = data;
+
+	(void)events;
+	ev_timer_del(fd);
+	j->timeout_fd = -1;
+
+	if (!j->timed_out) {
+		j->timed_out = 1;
+		fprintf(stderr, "\nlsh: timeout: %s: timed out\n", j->command);
+		kill(-j->pgid, j->timeout_signal);
+		if (job_is_stopped(j))
+			kill(-j->pgid, SIGCONT); // a stopped job can't act on the signal
+		if (j->kill_after > 0)
+			j->timeout_fd = ev_timer_add((long)(j->kill_after * 1000), on_job_timeout, j);
+	}
+	else {
+		fprintf(stderr, "lsh: timeout: %s: sending SIGKILL\n", j->command);
+		kill(-j->pgid, SIGKILL);
+	}
+}
+
+int lsh_timeout(char **args)
+{
+	double limit, kill_after = TIMEOUT_KILL_AFTER_DEFAULT;
+	int sig = SIGTERM;
+	int i;
+
+	for (i = 1; args[i] && args[i][0] == '-' && args[i + 1]; i += 2) {
+		if (strcmp(args[i], "-s") == 0) {
+			sig = parse_signal(args[i + 1]);
+			if (sig < 0) {
+				fprintf(stderr, "lsh: timeout: %s: invalid signal\n", args[i + 1]);
+				return 1;
+			}
+		}
+		else if (strcmp(args[i], "-k") == 0) {
+			if (parse_duration(args[i + 1], &kill_after) < 0) {
+				fprintf(stderr, "lsh: timeout: invalid duration %s\n", args[i + 1]);
+				return 1;
+			}
+		}
+		else {
+			break;
+		}
+	}
+	if (!args[i] || !args[i + 1]) {
+		fprintf(stderr, "lsh: timeout: usage: timeout [-s SIG] [-k DURATION] DURATION command [args...]\n");
+		return 1;
+	}
+	if (parse_duration(args[i], &limit) < 0) {
+		fprintf(stderr, "lsh: timeout: invalid duration %s\n", args[i]);
+		return 1;
+	}
+
+	Job *j = launch_job(&args[i + 1], 0);
+	if (!j)
+		return 1;
+	j->timeout_signal = sig;
+	j->kill_after = kill_after;
+	j->timeout_fd = ev_timer_add((long)(limit * 1000), on_job_timeout, j);
+	if (j->timeout_fd < 0)
+		perror("lsh: timeout: timerfd");
+	return put_job_in_foreground(j, 0);
+}
+
+
+/* ulimit [-S|-H] [-a | -c|-n|-t|-v [limit|unlimited]]
+ *
+ * Limits are not applied to the shell itself (a CPU or address space limit
+ * would eventually kill it); they are recorded here and set with
+ * setrlimit() in every child between fork and exec. -S or -H changes only
+ * the soft or hard limit; by default both are set.
+ */
+
+typedef struct {
+	char flag;
+	int resource;
+	const char *desc;
+	rlim_t unit;      // bytes (or items) per unit on the command line
+	char set_soft;    // a value has been given for children
+	char set_hard;
+	struct rlimit lim;
+} UlimitEntry;
+
+UlimitEntry ulimits[] = {
+	{'c', RLIMIT_CORE, "core file size (kbytes)", 1024, 0, 0, {0, 0}},
+	{'n', RLIMIT_NOFILE, "open files", 1, 0, 0, {0, 0}},
+	{'t', RLIMIT_CPU, "cpu time (seconds)", 1, 0, 0, {0, 0}},
+	{'v', RLIMIT_AS, "virtual memory (kbytes)", 1024, 0, 0, {0, 0}},
+};
+#define NUM_ULIMITS (int)(sizeof(ulimits) / sizeof(ulimits[0]))
+
+// Called in the child between fork and exec
+void apply_ulimits(void)
+{
+	for (int i = 0; i < NUM_ULIMITS; i++) {
+		UlimitEntry *u = &ulimits[i];
+		struct rlimit lim;
+
+		if (!u->set_soft && !u->set_hard)
+			continue;
+		getrlimit(u->resource, &lim);
+		if (u->set_hard)
+			lim.rlim_max = u->lim.rlim_max;
+		if (u->set_soft)
+			lim.rlim_cur = u->lim.rlim_cur;
+		if (setrlimit(u->resource, &lim) < 0)
+			fprintf(stderr, "lsh: ulimit -%c: %s\n", u->flag, strerror(errno));
+	}
+}
+
+// The limit children will get: our own, overridden by any ulimit setting
+void ulimit_effective(UlimitEntry *u, struct rlimit *lim)
+{
+	getrlimit(u->resource, lim);
+	if (u->set_soft)
+		lim->rlim_cur = u->lim.rlim_cur;
+	if (u->set_hard)
+		lim->rlim_max = u->lim.rlim_max;
+}
+
+void ulimit_print(UlimitEntry *u, int hard, int with_desc)
+{
+	struct rlimit lim;
+	rlim_t v;
+
+	ulimit_effective(u, &lim);
+	v = hard ? lim.rlim_max : lim.rlim_cur;
+	if (with_desc)
+		printf("%-28s (-%c) ", u->desc, u->flag);
+	if (v == RLIM_INFINITY)
+		printf("unlimited\n");
+	else
+		printf("%llu\n", (unsigned long long)(v / u->unit));
+}
+
+int lsh_ulimit(char **args)
+{
+	int soft = 0, hard = 0, all = 0;
+	UlimitEntry *u = NULL;
+	const char *value = NULL;
+
+	for (int i = 1; args[i]; i++) {
+		if (args[i][0] != '-' || !args[i][1]) {
+			value = args[i];
+			continue;
+		}
+		for (const char *f = args[i] + 1; *f; f++) {
+			if (*f == 'S')
+				soft = 1;
+			else if (*f == 'H')
+				hard = 1;
+			else if (*f == 'a')
+				all = 1;
+			else {
+				u = NULL;
+				for (int k = 0; k < NUM_ULIMITS; k++)
+					if (ulimits[k].flag == *f)
+						u = &ulimits[k];
+				if (!u) {
+					fprintf(stderr, "lsh: ulimit: -%c: invalid option\n", *f);
+					return 1;
+				}
+			}
+		}
+	}
+
+	if (all) {
+		for (int k = 0; k < NUM_ULIMITS; k++)
+			ulimit_print(&ulimits[k], hard && !soft, 1);
+		return 0;
+	}
+	if (!u) {
+		fprintf(stderr, "lsh: ulimit: usage: ulimit [-S|-H] [-a | -c|-n|-t|-v [limit|unlimited]]\n");
+		return 1;
+	}
+	if (!value) {
+		ulimit_print(u, hard && !soft, 0);
+		return 0;
+	}
+
+	rlim_t v;
+	struct rlimit own, cur;
+	if (strcmp(value, "unlimited") == 0) {
+		v = RLIM_INFINITY;
+	}
+	else {
+		char *end;
+		unsigned long long n = strtoull(value, &end, 10);
+		if (*end || end == value) {
+			fprintf(stderr, "lsh: ulimit: %s: invalid number\n", value);
+			return 1;
+		}
+		v = (rlim_t)n * u->unit;
+	}
+	if (!soft && !hard)
+		soft = hard = 1;
+
+	// Catch what setrlimit() would refuse now rather than in every child
+	getrlimit(u->resource, &own);
+	ulimit_effective(u, &cur);
+	if (geteuid() != 0 && hard && v > own.rlim_max) {
+		fprintf(stderr, "lsh: ulimit -%c: cannot raise the hard limit\n", u->flag);
+		return 1;
+	}
+	if (soft && !hard && v > cur.rlim_max) {
+		fprintf(stderr, "lsh: ulimit -%c: soft limit exceeds the hard limit\n", u->flag);
+		return 1;
+	}
+	if (hard && !soft && v < cur.rlim_cur) {
+		fprintf(stderr, "lsh: ulimit -%c: hard limit below the soft limit\n", u->flag);
+		return 1;
+	}
+	if (soft) {
+		u->set_soft = 1;
+		u->lim.rlim_cur = v;
+	}
+	if (hard) {
+		u->set_hard = 1;
+		u->lim.rlim_max = v;
+	}
+	return 0;
+}
+
+
+/* ls [-aAlFR1C] [--color[=when]] [path...]
+ *
+ * Directories are read with getdents64() straight into a chain of buffers
+ * that the entry names keep pointing into, so no name is ever copied or
+ * allocated on its own. Names are sorted in byte order (the C locale,
+ * which is all the shell uses) by an MSD radix sort over 8-byte key
+ * prefixes held next to the entry pointers, so most passes never touch
+ * the names themselves. On a terminal the listing is laid out in columns
+ * like GNU ls; otherwise, or with -1, it is one name per line. Output is
+ * collected and written in large blocks rather than a printf per name.
+ *
+ * -l needs a statx() per entry; those calls are spread over a thread per
+ * CPU, and owner and group names are looked up once per id and session.
+ * Colours (--color) and -F indicators come from d_type alone when -l is
+ * not given, so they cost no extra system calls; executables are only
+ * told apart in the long format, where the mode is known anyway. -R runs
+ * on the parallel directory walker further down.
+ */
+
+#define DIR_BLOCK_MIN 4096
+#define DIR_BLOCK_MAX (1024 * 1024)
+#define DIR_BLOCK_SPARE 1024 // room for another getdents64 call (an entry is at most 280 bytes)
+#define RADIX_CUTOFF 32      // below this many names, insertion sort
+#define LS_COL_GAP 2
+#define LS_STAT_CHUNK 256     // entries per parallel statx() work item
+#define LS_RECENT_SECS (365L * 86400 / 2)
+#define PARALLEL_MAX_THREADS 64
+
+// getdents64 buffer; entry names point into data
+typedef struct DirBlock {
+	struct DirBlock *next;
+	size_t size;
+	size_t used;
+	char data[];
+} DirBlock;
+
+typedef struct {
+	const char *name;
+	ino_t ino;
+	unsigned char type;   // DT_* from getdents64; DT_UNKNOWN if the filesystem doesn't say
+} DirEntry;
+
+// the entries of one directory
+typedef struct {
+	DirEntry *entries;
+	size_t count;
+	size_t cap;
+	DirBlock *blocks;
+} DirList;
+
+#define DL_HIDDEN 1 // include names starting with '.'
+#define DL_DOTS   2 // include "." and ".." too
+
+typedef struct {
+	uint64_t key;   // 8 bytes of the name from the current depth on, big-endian
+	DirEntry *e;
+} SortItem;
+
+void dirlist_add(DirList *dl, const char *name, ino_t ino, unsigned char type)
+{
+	if (dl->count == dl->cap) {
+		dl->cap = dl->cap ? dl->cap * 2 : 16;
+		dl->entries = realloc(dl->entries, dl->cap * sizeof(DirEntry));
+		if (!dl->entries) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	dl->entries[dl->count].name = name;
+	dl->entries[dl->count].ino = ino;
+	dl->entries[dl->count].type = type;
+	dl->count++;
+}
+
+void dirlist_free(DirList *dl)
+{
+	while (dl->blocks) {
+		DirBlock *next = dl->blocks->next;
+		free(dl->blocks);
+		dl->blocks = next;
+	}
+	free(dl->entries);
+	memset(dl, 0, sizeof(*dl));
+}
+
+// Does flags ask for name? Hidden names need DL_HIDDEN, "." and ".." DL_DOTS
+int dirlist_wanted(const char *name, int flags)
+{
+	if (name[0] != '.')
+		return 1;
+	if (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))
+		return flags & DL_DOTS;
+	return flags & DL_HIDDEN;
+}
+
+// Read every entry of the open directory fd into dl (which must be
+// empty). The first buffer is small, so that walking many small
+// directories stays cheap, and later ones double up to 1 MB. Returns -1
+// with errno set on a read error; dl still has to be freed.
+int dirlist_read(int fd, DirList *dl, int flags)
+{
+	DirBlock *b = NULL;
+	size_t size = DIR_BLOCK_MIN;
+
+	for (;;) {
+		if (!b || b->size - b->used < DIR_BLOCK_SPARE) {
+			b = malloc(sizeof(DirBlock) + size);
+			if (!b) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+			b->size = size;
+			b->used = 0;
+			b->next = dl->blocks;
+			dl->blocks = b;
+			if (size < DIR_BLOCK_MAX)
+				size *= 2;
+		}
+
+		ssize_t n = getdents64(fd, b->data + b->used, b->size - b->used);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return n < 0 ? -1 : 0;
+		for (char *p = b->data + b->used; p < b->data + b->used + n; ) {
+			struct dirent64 *d = (struct dirent64 *)p;
+			p += d->d_reclen;
+			if (dirlist_wanted(d->d_name, flags))
+				dirlist_add(dl, d->d_name, d->d_ino, d->d_type);
+		}
+		b->used += n;
+	}
+}
+
+// Up to 8 bytes of s, big-endian and zero-padded, so that comparing keys
+// compares the strings' next 8 bytes
+uint64_t name_key(const char *s)
+{
+	uint64_t k = 0;
+	for (int i = 0; i < 8; i++) {
+		k <<= 8;
+		if (*s)
+			k |= (unsigned char)*s++;
+	}
+	return k;
+}
+
+// MSD radix sort of names that all share their first depth bytes
+void radix_sort_names(SortItem *a, SortItem *tmp, size_t n, size_t depth)
+{
+	size_t count[256], start[256];
+
+	if (n < RADIX_CUTOFF) {
+		for (size_t i = 1; i < n; i++) {
+			SortItem x = a[i];
+			size_t j = i;
+			while (j > 0 && (a[j - 1].key > x.key || (a[j - 1].key == x.key && strcmp(a[j - 1].e->name + depth, x.e->name + depth) > 0))) {
+				a[j] = a[j - 1];
+				j--;
+			}
+			a[j] = x;
+		}
+		return;
+	}
+
+	// Every 8 levels, load the next 8 bytes of each name
+	if (depth > 0 && depth % 8 == 0)
+		for (size_t i = 0; i < n; i++)
+			a[i].key = name_key(a[i].e->name + depth);
+	int shift = 56 - 8 * (depth % 8);
+
+	memset(count, 0, sizeof(count));
+	for (size_t i = 0; i < n; i++)
+		count[(a[i].key >> shift) & 0xff]++;
+
+	// A byte that every name shares needs no distribution pass
+	int byte = (a[0].key >> shift) & 0xff;
+	if (count[byte] == n) {
+		if (byte != 0)
+			radix_sort_names(a, tmp, n, depth + 1);
+		return;
+	}
+
+	start[0] = 0;
+	for (int b = 1; b < 256; b++)
+		start[b] = start[b - 1] + count[b - 1];
+	for (size_t i = 0; i < n; i++)
+		tmp[start[(a[i].key >> shift) & 0xff]++] = a[i];
+	memcpy(a, tmp, n * sizeof(SortItem));
+
+	// Bucket 0 holds names that end here, which are all equal
+	size_t pos = count[0];
+	for (int b = 1; b < 256; b++) {
+		if (count[b] > 1)
+			radix_sort_names(a + pos, tmp, count[b], depth + 1);
+		pos += count[b];
+	}
+}
+
+// Sort entries by name, in byte order
+void dirlist_sort(DirList *dl)
+{
+	size_t n = dl->count;
+	SortItem *a = malloc(n * sizeof(SortItem));
+	SortItem *tmp = malloc(n * sizeof(SortItem));
+	DirEntry *sorted = malloc(n * sizeof(DirEntry));
+
+	if (n == 0)
+		goto out;
+	if (!a || !tmp || !sorted) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < n; i++) {
+		a[i].key = name_key(dl->entries[i].name);
+		a[i].e = &dl->entries[i];
+	}
+	radix_sort_names(a, tmp, n, 0);
+	for (size_t i = 0; i < n; i++)
+		sorted[i] = *a[i].e;
+	free(dl->entries);
+	dl->entries = sorted;
+	dl->cap = n;
+	sorted = NULL;
+out:
+	free(sorted);
+	free(tmp);
+	free(a);
+}
+
+/* Directory cache. ls, tab completion and pathname expansion get their
+ * listings through dircache_list(), which keeps each directory's sorted
+ * entries (names and d_type, hidden ones included) for the whole
+ * session, keyed by (dev, ino). A listing is only used while the
+ * directory's mtime is the one it was read at. Since an mtime can miss
+ * two changes within one clock tick, every cached directory also has an
+ * inotify watch, added before the directory is read; the watch's events
+ * drop the listing, both when the event loop sees them at the prompt
+ * and before any lookup. The least recently used listings are dropped
+ * past DIRCACHE_MAX_BYTES or DIRCACHE_MAX_DIRS (each is an inotify watch
+ * too), and a listing over a quarter of the budget is never kept. Forked
+ * children share the inotify fd, so they go past the cache: reading the
+ * events there would lose them for the shell. "stats" shows the counters.
+ */
+
+#define DIRCACHE_BUCKETS 256
+#define DIRCACHE_MAX_BYTES (16 * 1024 * 1024)
+#define DIRCACHE_MAX_DIRS 1024
+#define DIRCACHE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR)
+
+typedef struct DirCacheEntry {
+	struct DirCacheEntry *hnext;    // hash chain
+	struct DirCacheEntry *newer;    // LRU list
+	struct DirCacheEntry *older;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	int wd;                         // inotify watch, or -1
+	size_t bytes;
+	DirList list;                   // sorted, with "." and ".."
+} DirCacheEntry;
+
+typedef struct {
+	DirCacheEntry *buckets[DIRCACHE_BUCKETS];
+	DirCacheEntry *newest;
+	DirCacheEntry *oldest;
+	size_t bytes;
+	size_t count;
+	int fd;                         // inotify, or -1
+	pid_t pid;                      // the shell's, to tell a forked child
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t stale;                 // found with another mtime
+	uint64_t invalidated;           // dropped by an inotify event
+	uint64_t evicted;
+} DirCache;
+
+DirCache dircache = {.fd = -1};
+
+DirCacheEntry **dircache_slot(dev_t dev, ino_t ino)
+{
+	DirCacheEntry **p = &dircache.buckets[(ino ^ dev * 31) % DIRCACHE_BUCKETS];
+
+	while (*p && ((*p)->dev != dev || (*p)->ino != ino))
+		p = &(*p)->hnext;
+	return p;
+}
+
+void dircache_unlink_lru(DirCacheEntry *e)
+{
+	*(e->newer ? &e->newer->older : &dircache.newest) = e->older;
+	*(e->older ? &e->older->newer : &dircache.oldest) = e->newer;
+}
+
+void dircache_push_lru(DirCacheEntry *e)
+{
+	e->newer = NULL;
+	e->older = dircache.newest;
+	*(dircache.newest ? &dircache.newest->newer : &dircache.oldest) = e;
+	dircache.newest = e;
+}
+
+void dircache_drop(DirCacheEntry *e)
+{
+	*dircache_slot(e->dev, e->ino) = e->hnext;
+	dircache_unlink_lru(e);
+	if (e->wd >= 0)
+		inotify_rm_watch(dircache.fd, e->wd);
+	dircache.bytes -= e->bytes;
+	dircache.count--;
+	dirlist_free(&e->list);
+	free(e);
+}
+
+void dircache_clear(void)
+{
+	while (dircache.newest)
+		dircache_drop(dircache.newest);
+}
+
+// Drop the listings inotify has news about
+void dircache_drain(void)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+
+	while ((n = read(dircache.fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + n; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + ev->len;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				dircache.invalidated += dircache.count;
+				dircache_clear();
+				continue;
+			}
+			// The watch goes with the listing; IN_IGNORED for it finds nothing
+			for (DirCacheEntry *e = dircache.newest; e; e = e->older) {
+				if (e->wd == ev->wd) {
+					dircache.invalidated++;
+					dircache_drop(e);
+					break;
+				}
+			}
+		}
+	}
+}
+
+void on_dircache_event(int fd, uint32_t events, void *data)
+{
+	(void)fd;
+	(void)events;
+	(void)data;
+	dircache_drain();
+}
+
+// Copy the entries of src that flags asks for into dst, names shared
+void dircache_copy(DirList *src, DirList *dst, int flags)
+{
+	for (size_t i = 0; i < src->count; i++)
+		if (dirlist_wanted(src->entries[i].name, flags))
+			dirlist_add(dst, src->entries[i].name, src->entries[i].ino, src->entries[i].type);
+}
+
+// The entries of the directory open as fd, as dirlist_read() with flags
+// would give them but sorted, from the cache when it can. dl must be
+// empty and is freed with dirlist_free(); its names stay valid until the
+// next dircache_list() call. Returns -1 with errno set on a read error.
+int dircache_list(int fd, DirList *dl, int flags)
+{
+	DirCacheEntry **slot, *e;
+	struct stat st;
+	DirList all;
+	size_t bytes;
+	char path[64];
+	int wd;
+
+	if (dircache.pid == 0) {
+		dircache.pid = getpid();
+		dircache.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (dircache.fd >= 0 && ev_epfd >= 0)
+			ev_add(dircache.fd, EPOLLIN, on_dircache_event, NULL);
+	}
+	if (dircache.fd < 0 || getpid() != dircache.pid || fstat(fd, &st) < 0) {
+		if (dirlist_read(fd, dl, flags) < 0)
+			return -1;
+		dirlist_sort(dl);
+		return 0;
+	}
+
+	dircache_drain();
+	slot = dircache_slot(st.st_dev, st.st_ino);
+	if ((e = *slot) && e->mtime.tv_sec == st.st_mtim.tv_sec && e->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+		dircache.hits++;
+		dircache_unlink_lru(e);
+		dircache_push_lru(e);
+		dircache_copy(&e->list, dl, flags);
+		return 0;
+	}
+	if (e) {
+		dircache.stale++;
+		dircache_drop(e);
+	}
+	dircache.misses++;
+
+	// Watch first, so that a change during the read is not missed
+	while (dircache.count >= DIRCACHE_MAX_DIRS) {
+		dircache.evicted++;
+		dircache_drop(dircache.oldest);
+	}
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	wd = inotify_add_watch(dircache.fd, path, DIRCACHE_EVENTS);
+	memset(&all, 0, sizeof(all));
+	if (dirlist_read(fd, &all, DL_HIDDEN | DL_DOTS) < 0) {
+		int err = errno;
+		dirlist_free(&all);
+		if (wd >= 0)
+			inotify_rm_watch(dircache.fd, wd);
+		errno = err;
+		return -1;
+	}
+	dirlist_sort(&all);
+
+	bytes = sizeof(DirCacheEntry) + all.cap * sizeof(DirEntry);
+	for (DirBlock *b = all.blocks; b; b = b->next)
+		bytes += sizeof(DirBlock) + b->size;
+	if (wd < 0 || bytes > DIRCACHE_MAX_BYTES / 4) {
+		if (wd >= 0)
+			inotify_rm_watch(dircache.fd, wd);
+		// Not kept: hand the listing itself over
+		dircache_copy(&all, dl, flags);
+		dl->blocks = all.blocks;
+		all.blocks = NULL;
+		dirlist_free(&all);
+		return 0;
+	}
+
+	while (dircache.oldest && dircache.bytes + bytes > DIRCACHE_MAX_BYTES) {
+		dircache.evicted++;
+		dircache_drop(dircache.oldest);
+	}
+	e = calloc(1, sizeof(DirCacheEntry));
+	if (!e) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	e->dev = st.st_dev;
+	e->ino = st.st_ino;
+	e->mtime = st.st_mtim;
+	e->wd = wd;
+	e->bytes = bytes;
+	e->list = all;
+	slot = dircache_slot(st.st_dev, st.st_ino); // eviction may have moved it
+	e->hnext = *slot;
+	*slot = e;
+	dircache_push_lru(e);
+	dircache.bytes += bytes;
+	dircache.count++;
+	dircache_copy(&e->list, dl, flags);
+	return 0;
+}
+
+// For "stats": print the counters, or with reset, zero them
+void dircache_stats(int reset)
+{
+	if (reset) {
+		dircache.hits = dircache.misses = dircache.stale = 0;
+		dircache.invalidated = dircache.evicted = 0;
+		return;
+	}
+	if (dircache.hits + dircache.misses == 0)
+		return;
+	printf("\ndircache: %llu hits, %llu misses (%llu stale), %llu invalidated, %llu evicted; %zu dirs, %zu KB cached\n",
+		(unsigned long long)dircache.hits, (unsigned long long)dircache.misses,
+		(unsigned long long)dircache.stale, (unsigned long long)dircache.invalidated,
+		(unsigned long long)dircache.evicted, dircache.count, dircache.bytes / 1024);
+}
+
+
+// Width of the terminal on stdout, else $COLUMNS, else 80
+int output_width(void)
+{
+	struct winsize ws;
+	const char *env = getenv("COLUMNS");
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+		return ws.ws_col;
+	if (env && atoi(env) > 0)
+		return atoi(env);
+	return 80;
+}
+
+typedef struct {
+	void (*fn)(void *ctx, size_t begin, size_t end);
+	void *ctx;
+	size_t n;
+	size_t chunk;
+	atomic_size_t next;
+} ParallelFor;
+
+void *parallel_for_worker(void *arg)
+{
+	ParallelFor *pf = arg;
+
+	for (;;) {
+		size_t begin = atomic_fetch_add_explicit(&pf->next, pf->chunk, memory_order_relaxed);
+		if (begin >= pf->n)
+			return NULL;
+		pf->fn(pf->ctx, begin, begin + pf->chunk < pf->n ? begin + pf->chunk : pf->n);
+	}
+}
+
+// Call fn on chunks of [0, n) from up to one thread per CPU, the calling
+// thread included, and return once all of them are done. Threads take
+// the next chunk as they finish one, so slow chunks don't hold the rest up.
+void parallel_for(size_t n, size_t chunk, void (*fn)(void *ctx, size_t begin, size_t end), void *ctx)
+{
+	pthread_t threads[PARALLEL_MAX_THREADS];
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t nthreads = (n + chunk - 1) / chunk;
+	ParallelFor pf = {fn, ctx, n, chunk, 0};
+	size_t started = 0;
+
+	if (ncpu < 1)
+		ncpu = 1;
+	if (nthreads > (size_t)ncpu)
+		nthreads = ncpu;
+	if (nthreads > PARALLEL_MAX_THREADS)
+		nthreads = PARALLEL_MAX_THREADS;
+	for (size_t i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[started], NULL, parallel_for_worker, &pf) != 0)
+			break; // fewer threads just means more work for the rest
+		started++;
+	}
+	parallel_for_worker(&pf);
+	for (size_t i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+typedef struct {
+	unsigned id;
+	char *name;     // NULL marks an empty slot
+} IdName;
+
+// uid or gid -> name, filled in on first use and kept for the session
+typedef struct {
+	IdName *slots;
+	size_t cap;     // a power of two
+	size_t count;
+	int group;
+} IdCache;
+
+IdCache user_names = {NULL, 0, 0, 0};
+IdCache group_names = {NULL, 0, 0, 1};
+
+IdName *id_cache_slot(IdName *slots, size_t cap, unsigned id)
+{
+	size_t i = (id * 2654435761u) & (cap - 1);
+	while (slots[i].name && slots[i].id != id)
+		i = (i + 1) & (cap - 1);
+	return &slots[i];
+}
+
+// The user or group name for id, or the number if it has none. One NSS
+// lookup per id and session, instead of one per line of "ls -l".
+const char *id_cache_name(IdCache *c, unsigned id)
+{
+	char buf[4096], num[16];
+	const char *name = NULL;
+	IdName *slot;
+
+	if (c->cap) {
+		slot = id_cache_slot(c->slots, c->cap, id);
+		if (slot->name)
+			return slot->name;
+	}
+
+	if (c->group) {
+		struct group gr, *res = NULL;
+		if (getgrgid_r(id, &gr, buf, sizeof(buf), &res) == 0 && res)
+			name = gr.gr_name;
+	}
+	else {
+		struct passwd pw, *res = NULL;
+		if (getpwuid_r(id, &pw, buf, sizeof(buf), &res) == 0 && res)
+			name = pw.pw_name;
+	}
+	if (!name) {
+		snprintf(num, sizeof(num), "%u", id);
+		name = num;
+	}
+
+	// Keep the table at most half full
+	if ((c->count + 1) * 2 > c->cap) {
+		size_t cap = c->cap ? c->cap * 2 : 64;
+		IdName *slots = calloc(cap, sizeof(IdName));
+		if (!slots) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		for (size_t i = 0; i < c->cap; i++)
+			if (c->slots[i].name)
+				*id_cache_slot(slots, cap, c->slots[i].id) = c->slots[i];
+		free(c->slots);
+		c->slots = slots;
+		c->cap = cap;
+	}
+	slot = id_cache_slot(c->slots, c->cap, id);
+	slot->id = id;
+	slot->name = strdup(name);
+	c->count++;
+	return slot->name;
+}
+
+// What "ls -l" needs from statx(), kept small as there is one per entry
+typedef struct {
+	uint32_t mode;
+	uint32_t nlink;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t size;
+	uint64_t blocks;
+	int64_t mtime;
+	uint32_t rdev_major;
+	uint32_t rdev_minor;
+	int err;        // errno if statx failed, else 0
+} LsStat;
+
+typedef struct {
+	int dirfd;
+	DirList *dl;
+	LsStat *st;
+	unsigned mask;
+} LsStatJob;
+
+void ls_stat_range(void *ctx, size_t begin, size_t end)
+{
+	LsStatJob *job = ctx;
+	struct statx stx;
+
+	for (size_t i = begin; i < end; i++) {
+		LsStat *s = &job->st[i];
+		if (statx(job->dirfd, job->dl->entries[i].name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, job->mask, &stx) < 0) {
+			memset(s, 0, sizeof(*s));
+			s->err = errno;
+			continue;
+		}
+		s->mode = stx.stx_mode;
+		s->nlink = stx.stx_nlink;
+		s->uid = stx.stx_uid;
+		s->gid = stx.stx_gid;
+		s->size = stx.stx_size;
+		s->blocks = stx.stx_blocks;
+		s->mtime = stx.stx_mtime.tv_sec;
+		s->rdev_major = stx.stx_rdev_major;
+		s->rdev_minor = stx.stx_rdev_minor;
+		s->err = 0;
+	}
+}
+
+// statx() every entry of dl relative to dirfd, spread over a thread per
+// CPU: on NVMe and network filesystems the calls are latency bound, so
+// several in flight at once finish far sooner than one after another.
+LsStat *ls_stat_all(int dirfd, DirList *dl, unsigned mask)
+{
+	LsStat *st = malloc((dl->count ? dl->count : 1) * sizeof(LsStat));
+	LsStatJob job = {dirfd, dl, st, mask};
+
+	if (!st) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	parallel_for(dl->count, LS_STAT_CHUNK, ls_stat_range, &job);
+	return st;
+}
+
+unsigned char mode_to_dtype(uint32_t mode)
+{
+	return (mode & S_IFMT) >> 12; // DT_* values are the S_IF* bits shifted down
+}
+
+typedef struct {
+	int flags;        // DL_* for dirlist_read()
+	int columns;      // lay names out in columns
+	int long_format;
+	int color;
+	int classify;     // -F: append a type indicator
+	int recursive;    // -R
+	OutBuf out;
+} LsOptions;
+
+// Colour of a name: by its d_type alone unless the mode is known, so
+// that plain "ls --color" never has to stat anything
+const char *ls_color(unsigned char type, uint32_t mode)
+{
+	switch (type) {
+	case DT_DIR: return "01;34";
+	case DT_LNK: return "01;36";
+	case DT_FIFO: return "40;33";
+	case DT_SOCK: return "01;35";
+	case DT_BLK:
+	case DT_CHR: return "40;33;01";
+	case DT_REG: return (mode & 0111) ? "01;32" : NULL;
+	}
+	return NULL;
+}
+
+char ls_indicator(unsigned char type, uint32_t mode)
+{
+	switch (type) {
+	case DT_DIR: return '/';
+	case DT_LNK: return '@';
+	case DT_FIFO: return '|';
+	case DT_SOCK: return '=';
+	case DT_REG: return (mode & 0111) ? '*' : 0;
+	}
+	return 0;
+}
+
+// Write one name with its colour and -F indicator; mode is 0 if unknown
+void ls_emit_name(LsOptions *ls, const char *name, unsigned char type, uint32_t mode)
+{
+	const char *color = ls->color ? ls_color(type, mode) : NULL;
+	char ind = ls->classify ? ls_indicator(type, mode) : 0;
+
+	if (color) {
+		outbuf_write(&ls->out, STDOUT_FILENO, "\033[", 2);
+		outbuf_write(&ls->out, STDOUT_FILENO, color, strlen(color));
+		outbuf_write(&ls->out, STDOUT_FILENO, "m", 1);
+	}
+	outbuf_write(&ls->out, STDOUT_FILENO, name, strlen(name));
+	if (color)
+		outbuf_write(&ls->out, STDOUT_FILENO, "\033[0m", 4);
+	if (ind)
+		outbuf_write(&ls->out, STDOUT_FILENO, &ind, 1);
+}
+
+void ls_pad(LsOptions *ls, size_t pad)
+{
+	static const char spaces[] = "                                ";
+
+	while (pad > 0) {
+		size_t k = pad < sizeof(spaces) - 1 ? pad : sizeof(spaces) - 1;
+		outbuf_write(&ls->out, STDOUT_FILENO, spaces, k);
+		pad -= k;
+	}
+}
+
+// Names down then across in as many columns as fit in width, like GNU ls
+void ls_print_columns(LsOptions *ls, DirList *dl, int width)
+{
+	size_t n = dl->count, rows = n, cols;
+	size_t *len = malloc(n * sizeof(size_t));
+	size_t *colw = malloc(n * sizeof(size_t));
+
+	if (n == 0)
+		goto out;
+	if (!len || !colw) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < n; i++)
+		len[i] = strlen(dl->entries[i].name) + (ls->classify && ls_indicator(dl->entries[i].type, 0));
+
+	// Try the widest layout first: each column needs at least one
+	// character plus the gap
+	cols = (size_t)width / (1 + LS_COL_GAP) + 1;
+	if (cols > n)
+		cols = n;
+	for (; cols > 1; cols--) {
+		size_t total = 0;
+		rows = (n + cols - 1) / cols;
+		cols = (n + rows - 1) / rows; // no empty trailing columns
+		for (size_t c = 0; c < cols && total <= (size_t)width; c++) {
+			size_t w = 0;
+			for (size_t i = c * rows; i < n && i < (c + 1) * rows; i++)
+				if (len[i] > w)
+					w = len[i];
+			colw[c] = w;
+			total += w + (c + 1 < cols ? LS_COL_GAP : 0);
+		}
+		if (total <= (size_t)width)
+			break;
+	}
+	if (cols <= 1) {
+		cols = 1;
+		rows = n;
+	}
+
+	for (size_t r = 0; r < rows; r++) {
+		for (size_t c = 0; c < cols; c++) {
+			size_t i = c * rows + r;
+			if (i >= n)
+				break;
+			ls_emit_name(ls, dl->entries[i].name, dl->entries[i].type, 0);
+			if (i + rows >= n)
+				break;
+			ls_pad(ls, colw[c] + LS_COL_GAP - len[i]);
+		}
+		outbuf_write(&ls->out, STDOUT_FILENO, "\n", 1);
+	}
+out:
+	free(colw);
+	free(len);
+}
+
+void ls_mode_string(uint32_t mode, char *s)
+{
+	static const char types[] = "?pc?d?b?-?l?s???";
+	const char *rwx = "rwxrwxrwx";
+
+	s[0] = types[(mode & S_IFMT) >> 12];
+	for (int i = 0; i < 9; i++)
+		s[i + 1] = (mode & (0400 >> i)) ? rwx[i] : '-';
+	if (mode & S_ISUID)
+		s[3] = (mode & S_IXUSR) ? 's' : 'S';
+	if (mode & S_ISGID)
+		s[6] = (mode & S_IXGRP) ? 's' : 'S';
+	if (mode & S_ISVTX)
+		s[9] = (mode & S_IXOTH) ? 't' : 'T';
+	s[10] = '\0';
+}
+
+// The long format: "total", then mode, links, owner, group, size, mtime
+// and name, with every column as wide as its widest value
+void ls_print_long(LsOptions *ls, int dirfd, DirList *dl, int show_total)
+{
+	LsStat *st = ls_stat_all(dirfd, dl, STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID |
+		STATX_SIZE | STATX_BLOCKS | STATX_MTIME);
+	int wlink = 1, wuser = 1, wgroup = 1, wsize = 1;
+	uint64_t blocks = 0;
+	time_t now = time(NULL);
+	char line[512], buf[64];
+
+	for (size_t i = 0; i < dl->count; i++) {
+		LsStat *s = &st[i];
+		if (s->err)
+			continue;
+		blocks += s->blocks;
+		int w = snprintf(buf, sizeof(buf), "%u", s->nlink);
+		if (w > wlink)
+			wlink = w;
+		w = strlen(id_cache_name(&user_names, s->uid));
+		if (w > wuser)
+			wuser = w;
+		w = strlen(id_cache_name(&group_names, s->gid));
+		if (w > wgroup)
+			wgroup = w;
+		if (S_ISCHR(s->mode) || S_ISBLK(s->mode))
+			w = snprintf(buf, sizeof(buf), "%u, %u", s->rdev_major, s->rdev_minor);
+		else
+			w = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)s->size);
+		if (w > wsize)
+			wsize = w;
+	}
+	if (show_total) {
+		int n = snprintf(line, sizeof(line), "total %llu\n", (unsigned long long)(blocks / 2));
+		outbuf_write(&ls->out, STDOUT_FILENO, line, n);
+	}
+
+	for (size_t i = 0; i < dl->count; i++) {
+		LsStat *s = &st[i];
+		const char *name = dl->entries[i].name;
+		char mode[11], size[48], when[32];
+		time_t mtime = s->mtime;
+		struct tm tm;
+
+		if (s->err) {
+			fprintf(stderr, "lsh: ls: %s: %s\n", name, strerror(s->err));
+			continue;
+		}
+		ls_mode_string(s->mode, mode);
+		if (S_ISCHR(s->mode) || S_ISBLK(s->mode))
+			snprintf(size, sizeof(size), "%u, %u", s->rdev_major, s->rdev_minor);
+		else
+			snprintf(size, sizeof(size), "%llu", (unsigned long long)s->size);
+		// Like GNU ls: the year instead of the time for files older than
+		// six months or in the future
+		localtime_r(&mtime, &tm);
+		if (mtime > now || now - mtime > LS_RECENT_SECS)
+			strftime(when, sizeof(when), "%b %e  %Y", &tm);
+		else
+			strftime(when, sizeof(when), "%b %e %H:%M", &tm);
+
+		int n = snprintf(line, sizeof(line), "%s %*u %-*s %-*s %*s %s ", mode, wlink, s->nlink,
+			wuser, id_cache_name(&user_names, s->uid), wgroup, id_cache_name(&group_names, s->gid),
+			wsize, size, when);
+		outbuf_write(&ls->out, STDOUT_FILENO, line, n);
+		ls_emit_name(ls, name, mode_to_dtype(s->mode), s->mode);
+		if (S_ISLNK(s->mode)) {
+			char target[PATH_MAX];
+			ssize_t len = readlinkat(dirfd, name, target, sizeof(target) - 1);
+			if (len >= 0) {
+				outbuf_write(&ls->out, STDOUT_FILENO, " -> ", 4);
+				outbuf_write(&ls->out, STDOUT_FILENO, target, len);
+			}
+		}
+		outbuf_write(&ls->out, STDOUT_FILENO, "\n", 1);
+	}
+	free(st);
+}
+
+// Print the entries of dl, which are relative to dirfd
+void ls_print(LsOptions *ls, int dirfd, DirList *dl, int show_total)
+{
+	if (ls->long_format) {
+		ls_print_long(ls, dirfd, dl, show_total);
+		return;
+	}
+
+	// Colours and indicators come from d_type; only entries whose
+	// filesystem left it out are stat'ed
+	if (ls->color || ls->classify) {
+		for (size_t i = 0; i < dl->count; i++) {
+			struct statx stx;
+			if (dl->entries[i].type == DT_UNKNOWN &&
+			    statx(dirfd, dl->entries[i].name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx) == 0)
+				dl->entries[i].type = mode_to_dtype(stx.stx_mode);
+		}
+	}
+
+	if (ls->columns) {
+		ls_print_columns(ls, dl, output_width());
+		return;
+	}
+	for (size_t i = 0; i < dl->count; i++) {
+		ls_emit_name(ls, dl->entries[i].name, dl->entries[i].type, 0);
+		outbuf_write(&ls->out, STDOUT_FILENO, "\n", 1);
+	}
+}
+
+int ls_recursive(LsOptions *ls, char **paths, int *fds, int npaths, int *shown); // on the walker below
+
+int lsh_ls(char **args)
+{
+	LsOptions ls;
+	int ret = 0, npaths = 0, shown = 0;
+	char **paths;
+	int *fds;
+	DirList files;
+
+	memset(&ls, 0, sizeof(ls));
+	memset(&files, 0, sizeof(files));
+	ls.columns = isatty(STDOUT_FILENO);
+	for (int i = 1; args[i]; i++)
+		npaths++;
+	paths = malloc((npaths + 1) * sizeof(char *));
+	fds = malloc((npaths + 1) * sizeof(int));
+	if (!paths || !fds) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	npaths = 0;
+	for (int i = 1; args[i]; i++) {
+		if (args[i][0] != '-' || !args[i][1]) {
+			paths[npaths++] = args[i];
+			continue;
+		}
+		if (strncmp(args[i], "--color", 7) == 0) {
+			const char *when = args[i][7] == '=' ? args[i] + 8 : "always";
+			if (strcmp(when, "always") == 0)
+				ls.color = 1;
+			else if (strcmp(when, "auto") == 0)
+				ls.color = isatty(STDOUT_FILENO);
+			else if (strcmp(when, "never") == 0)
+				ls.color = 0;
+			else
+				goto usage;
+			continue;
+		}
+		for (const char *f = args[i] + 1; *f; f++) {
+			if (*f == 'a')
+				ls.flags = DL_HIDDEN | DL_DOTS;
+			else if (*f == 'A')
+				ls.flags = DL_HIDDEN;
+			else if (*f == 'l')
+				ls.long_format = 1;
+			else if (*f == 'F')
+				ls.classify = 1;
+			else if (*f == 'R')
+				ls.recursive = 1;
+			else if (*f == '1')
+				ls.columns = 0;
+			else if (*f == 'C')
+				ls.columns = 1;
+			else {
+				fprintf(stderr, "lsh: ls: -%c: invalid option\n", *f);
+				goto usage;
+			}
+		}
+	}
+	if (npaths == 0)
+		paths[npaths++] = ".";
+
+	// Files named on the command line are listed first, then each directory
+	for (int i = 0; i < npaths; i++) {
+		struct stat st;
+		fds[i] = open(paths[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fds[i] >= 0)
+			continue;
+		if (errno == ENOTDIR && lstat(paths[i], &st) == 0) {
+			dirlist_add(&files, paths[i], st.st_ino, mode_to_dtype(st.st_mode));
+		}
+		else {
+			fprintf(stderr, "lsh: ls: %s: %s\n", paths[i], strerror(errno));
+			ret = 2;
+		}
+	}
+
+	fflush(stdout);
+	if (files.count) {
+		dirlist_sort(&files);
+		ls_print(&ls, AT_FDCWD, &files, 0);
+		shown = 1;
+	}
+	if (ls.recursive) {
+		int r = ls_recursive(&ls, paths, fds, npaths, &shown);
+		if (r > ret)
+			ret = r;
+		npaths = 0; // the walk has listed (and closed) the directories
+	}
+	for (int i = 0; i < npaths; i++) {
+		DirList dl;
+
+		if (fds[i] < 0)
+			continue;
+		memset(&dl, 0, sizeof(dl));
+		if (dircache_list(fds[i], &dl, ls.flags) < 0) {
+			fprintf(stderr, "lsh: ls: %s: %s\n", paths[i], strerror(errno));
+			ret = 2;
+			close(fds[i]);
+			dirlist_free(&dl);
+			continue;
+		}
+		if (npaths > 1) {
+			if (shown)
+				outbuf_write(&ls.out, STDOUT_FILENO, "\n", 1);
+			outbuf_write(&ls.out, STDOUT_FILENO, paths[i], strlen(paths[i]));
+			outbuf_write(&ls.out, STDOUT_FILENO, ":\n", 2);
+		}
+		ls_print(&ls, fds[i], &dl, 1);
+		close(fds[i]);
+		shown = 1;
+		dirlist_free(&dl);
+	}
+	outbuf_flush(&ls.out, STDOUT_FILENO);
+	dirlist_free(&files);
+	free(fds);
+	free(paths);
+	return ret;
+
+usage:
+	fprintf(stderr, "lsh: ls: usage: ls [-aAlFR1C] [--color[=always|auto|never]] [path...]\n");
+	free(fds);
+	free(paths);
+	return 2;
+}
+
+
+/* Parallel directory walker, shared by the builtins that work on trees.
+ *
+ * Every directory is opened relative to its parent's fd with openat(), so
+ * the kernel never resolves a full path, and read with dirlist_read().
+ * Entries whose d_type is DT_UNKNOWN get a STATX_TYPE call; everything else
+ * is classified without a stat. Each worker keeps a deque of directories
+ * still to read: it takes the most recently found one itself (depth
+ * first, so it stays near the directories it just read) and idle workers
+ * steal the oldest, shallowest one, which tends to be the biggest
+ * remaining subtree. There are more workers than CPUs because on NVMe and
+ * network filesystems the walk waits on I/O latency, not on the CPU.
+ *
+ * The walk builds a tree of WalkDirs. Callbacks run on the workers:
+ * filter() drops entries before anything descends into them, visit()
+ * sees each directory once its entries are read, and leave() runs once a
+ * directory and everything below it are finished, so results can be
+ * aggregated bottom-up without locks. A directory's fd stays open until
+ * its leave(). With keep set, WalkDirs are left for the caller, who can
+ * walk_wait() for them in any order it likes (that is how ls -R and tree
+ * print deterministically while the workers run ahead) and must
+ * walk_release() each of them.
+ */
+
+#define WALK_MIN_WORKERS 4
+
+// What a filter() does with an entry
+#define WALK_DROP 0     // leave it out of the list
+#define WALK_KEEP 1
+#define WALK_PRUNE 2    // keep it, but don't descend into it
+
+typedef struct WalkDir {
+	struct WalkDir *parent;
+	const char *name;       // within the parent; points into the parent's list
+	char *path;             // the root as given, plus the names below it
+	int depth;              // 0 for a root
+	int fd;                 // open until leave()
+	int err;                // errno if the directory could not be read
+	DirList list;
+	struct WalkDir **sub;   // per entry, the WalkDir walked into, or NULL
+	atomic_int pending;     // this directory plus unfinished subdirectories
+	atomic_int done;        // list and sub are ready
+	atomic_int left;        // leave() has run; a kept WalkDir may be freed
+	int worker;             // the worker that read it, for per-worker state in filter() and visit()
+	void *data;             // for the walk's user
+} WalkDir;
+
+typedef struct {
+	pthread_mutex_t lock;
+	WalkDir **items;        // the owner pushes and pops at tail, thieves take from head
+	size_t head;
+	size_t tail;
+	size_t cap;
+} WalkDeque;
+
+struct Walk;
+
+typedef struct {
+	struct Walk *walk;
+	int id;             // index of this worker's deque
+	pthread_t thread;
+} WalkWorker;
+
+typedef struct Walk {
+	// set before walk_start()
+	int flags;              // DL_* for dirlist_read()
+	int sort;               // sort each directory's entries by name
+	int max_depth;          // read no directory deeper than this; -1 for no limit
+	int keep;               // leave WalkDirs to the caller instead of freeing them
+	int (*filter)(struct Walk *w, WalkDir *d, DirEntry *e); // WALK_*
+	void (*visit)(struct Walk *w, WalkDir *d);
+	void (*leave)(struct Walk *w, WalkDir *d);
+	void *ctx;
+
+	WalkDir **roots;
+	int nroots;
+	int nworkers;
+	int nthreads;            // workers actually started
+	WalkWorker *workers;
+	WalkDeque *deques;
+	atomic_long outstanding; // directories queued or being read
+	atomic_int nidle;        // workers waiting for work
+	WalkDir *_Atomic awaited; // what the caller is blocked on in walk_wait()
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+} Walk;
+
+void walk_init(Walk *w)
+{
+	memset(w, 0, sizeof(*w));
+	w->max_depth = -1;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->work_cond, NULL);
+	pthread_cond_init(&w->done_cond, NULL);
+}
+
+// "a" + "b" -> "a/b", without doubling a trailing slash
+char *path_join(const char *dir, const char *name)
+{
+	size_t len = strlen(dir);
+	char *path = malloc(len + strlen(name) + 2);
+
+	if (!path) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(path, dir, len);
+	if (len > 0 && dir[len - 1] != '/')
+		path[len++] = '/';
+	strcpy(path + len, name);
+	return path;
+}
+
+WalkDir *walk_dir_new(WalkDir *parent, const char *name, char *path, int fd)
+{
+	WalkDir *d = calloc(1, sizeof(WalkDir));
+
+	if (!d) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	d->parent = parent;
+	d->name = name;
+	d->path = path;
+	d->depth = parent ? parent->depth + 1 : 0;
+	d->fd = fd;
+	atomic_init(&d->pending, 1);
+	return d;
+}
+
+void walk_dir_free(WalkDir *d)
+{
+	dirlist_free(&d->list);
+	free(d->sub);
+	free(d->path);
+	free(d);
+}
+
+// Add a root, either already open as fd or opened here if fd is -1. A
+// root that can't be opened is reported through its err.
+WalkDir *walk_add(Walk *w, const char *path, int fd)
+{
+	WalkDir *d;
+
+	if (fd < 0)
+		fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	d = walk_dir_new(NULL, NULL, strdup(path), fd);
+	if (fd < 0) {
+		d->err = errno;
+		atomic_store(&d->done, 1);
+		atomic_store(&d->left, 1);
+	}
+	w->roots = realloc(w->roots, (w->nroots + 1) * sizeof(WalkDir *));
+	if (!w->roots) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	w->roots[w->nroots++] = d;
+	return d;
+}
+
+void walk_push(Walk *w, int id, WalkDir *d)
+{
+	WalkDeque *q = &w->deques[id];
+
+	pthread_mutex_lock(&q->lock);
+	if (q->tail == q->cap) {
+		if (q->head > 0) {
+			memmove(q->items, q->items + q->head, (q->tail - q->head) * sizeof(WalkDir *));
+			q->tail -= q->head;
+			q->head = 0;
+		}
+		else {
+			q->cap = q->cap ? q->cap * 2 : 64;
+			q->items = realloc(q->items, q->cap * sizeof(WalkDir *));
+			if (!q->items) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	q->items[q->tail++] = d;
+	pthread_mutex_unlock(&q->lock);
+
+	if (atomic_load(&w->nidle) > 0) {
+		pthread_mutex_lock(&w->lock);
+		pthread_cond_signal(&w->work_cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+// Pop from our own deque, or steal from someone else's
+WalkDir *walk_take(Walk *w, int id)
+{
+	WalkDir *d = NULL;
+
+	for (int k = 0; k < w->nworkers && !d; k++) {
+		WalkDeque *q = &w->deques[(id + k) % w->nworkers];
+		pthread_mutex_lock(&q->lock);
+		if (q->head < q->tail)
+			d = k == 0 ? q->items[--q->tail] : q->items[q->head++];
+		if (q->head == q->tail)
+			q->head = q->tail = 0;
+		pthread_mutex_unlock(&q->lock);
+	}
+	return d;
+}
+
+// Wake the caller if it is blocked in walk_wait() on d
+void walk_notify(Walk *w, WalkDir *d)
+{
+	if (atomic_load(&w->awaited) == d) {
+		pthread_mutex_lock(&w->lock);
+		pthread_cond_broadcast(&w->done_cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+// d and everything below it are done: run leave() and pass the news up
+void walk_finish_dir(Walk *w, WalkDir *d)
+{
+	while (d && atomic_fetch_sub(&d->pending, 1) == 1) {
+		WalkDir *parent = d->parent;
+
+		if (w->leave)
+			w->leave(w, d);
+		if (d->fd >= 0)
+			close(d->fd);
+		d->fd = -1;
+		if (w->keep) {
+			atomic_store(&d->left, 1);
+			walk_notify(w, d);
+		}
+		else if (parent) {
+			walk_dir_free(d); // roots are freed by walk_end()
+		}
+		else {
+			atomic_store(&d->left, 1);
+			walk_notify(w, d);
+		}
+		d = parent;
+	}
+}
+
+// Read one directory and queue its subdirectories
+void walk_read_dir(Walk *w, int id, WalkDir *d)
+{
+	size_t n, kept = 0, nsub = 0;
+
+	d->worker = id;
+	if (d->fd < 0) {
+		d->fd = openat(d->parent->fd, d->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (d->fd < 0)
+			d->err = errno;
+	}
+	if (d->fd >= 0 && dirlist_read(d->fd, &d->list, w->flags) < 0)
+		d->err = errno;
+	if (w->sort)
+		dirlist_sort(&d->list);
+
+	n = d->list.count;
+	d->sub = calloc(n ? n : 1, sizeof(WalkDir *));
+	if (!d->sub) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < n; i++) {
+		DirEntry *e = &d->list.entries[i];
+		struct statx stx;
+
+		if (e->type == DT_UNKNOWN && statx(d->fd, e->name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, STATX_TYPE, &stx) == 0)
+			e->type = mode_to_dtype(stx.stx_mode);
+		int keep = w->filter ? w->filter(w, d, e) : WALK_KEEP;
+		if (keep == WALK_DROP)
+			continue;
+		// "." and ".." are listed with DL_DOTS but never descended into
+		int dots = e->name[0] == '.' && (e->name[1] == '\0' || (e->name[1] == '.' && e->name[2] == '\0'));
+		if (keep == WALK_KEEP && e->type == DT_DIR && !dots && (w->max_depth < 0 || d->depth < w->max_depth)) {
+			d->sub[kept] = walk_dir_new(d, e->name, path_join(d->path, e->name), -1);
+			nsub++;
+		}
+		d->list.entries[kept++] = *e;
+	}
+	d->list.count = kept;
+	atomic_fetch_add(&d->pending, nsub);
+
+	if (w->visit)
+		w->visit(w, d);
+	atomic_store(&d->done, 1);
+	if (w->keep)
+		walk_notify(w, d);
+
+	// Pushed last to first, so the owner goes on with the first one
+	atomic_fetch_add(&w->outstanding, nsub);
+	for (size_t i = kept; i-- > 0; )
+		if (d->sub[i])
+			walk_push(w, id, d->sub[i]);
+	walk_finish_dir(w, d);
+}
+
+void *walk_worker(void *arg)
+{
+	WalkWorker *ww = arg;
+	Walk *w = ww->walk;
+
+	for (;;) {
+		WalkDir *d = walk_take(w, ww->id);
+		if (!d) {
+			// Announce we are idle before the last look, so that a
+			// push after it is sure to signal us
+			pthread_mutex_lock(&w->lock);
+			atomic_fetch_add(&w->nidle, 1);
+			while (atomic_load(&w->outstanding) > 0 && !(d = walk_take(w, ww->id)))
+				pthread_cond_wait(&w->work_cond, &w->lock);
+			atomic_fetch_sub(&w->nidle, 1);
+			pthread_mutex_unlock(&w->lock);
+			if (!d)
+				return NULL;
+		}
+		walk_read_dir(w, ww->id, d);
+		if (atomic_fetch_sub(&w->outstanding, 1) == 1) {
+			pthread_mutex_lock(&w->lock);
+			pthread_cond_broadcast(&w->work_cond);
+			pthread_mutex_unlock(&w->lock);
+		}
+	}
+}
+
+// Start the workers on the roots added so far
+void walk_start(Walk *w)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	w->nworkers = ncpu * 2 > WALK_MIN_WORKERS ? ncpu * 2 : WALK_MIN_WORKERS;
+	if (w->nworkers > PARALLEL_MAX_THREADS)
+		w->nworkers = PARALLEL_MAX_THREADS;
+	w->deques = calloc(w->nworkers, sizeof(WalkDeque));
+	w->workers = calloc(w->nworkers, sizeof(WalkWorker));
+	if (!w->deques || !w->workers) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < w->nworkers; i++) {
+		pthread_mutex_init(&w->deques[i].lock, NULL);
+		w->workers[i].walk = w;
+		w->workers[i].id = i;
+	}
+	for (int i = 0; i < w->nroots; i++) {
+		if (w->roots[i]->fd < 0)
+			continue;
+		atomic_fetch_add(&w->outstanding, 1);
+		walk_push(w, i % w->nworkers, w->roots[i]);
+	}
+	for (int i = 0; i < w->nworkers; i++) {
+		if (pthread_create(&w->workers[i].thread, NULL, walk_worker, &w->workers[i]) != 0)
+			break; // the workers we have can steal the rest
+		w->nthreads++;
+	}
+	if (w->nthreads == 0)
+		walk_worker(&w->workers[0]); // no threads at all: walk right here
+}
+
+// Block until d (with keep set) is read, or with left set, finished;
+// without keep, only a root can be waited for. Only one thread may wait
+// at a time.
+void walk_wait(Walk *w, WalkDir *d, int left)
+{
+	atomic_int *flag = left ? &d->left : &d->done;
+
+	if (atomic_load(flag))
+		return;
+	pthread_mutex_lock(&w->lock);
+	atomic_store(&w->awaited, d);
+	while (!atomic_load(flag))
+		pthread_cond_wait(&w->done_cond, &w->lock);
+	atomic_store(&w->awaited, NULL);
+	pthread_mutex_unlock(&w->lock);
+}
+
+// Free a kept WalkDir, once the workers are through with it. Its
+// subdirectories must have been released first.
+void walk_release(Walk *w, WalkDir *d)
+{
+	walk_wait(w, d, 1);
+	walk_dir_free(d);
+}
+
+// Wait for the walk to finish and free what is left of it
+void walk_end(Walk *w)
+{
+	for (int i = 0; i < w->nthreads; i++)
+		pthread_join(w->workers[i].thread, NULL);
+	if (!w->keep)
+		for (int i = 0; i < w->nroots; i++)
+			walk_dir_free(w->roots[i]);
+	for (int i = 0; i < w->nworkers; i++) {
+		pthread_mutex_destroy(&w->deques[i].lock);
+		free(w->deques[i].items);
+	}
+	free(w->deques);
+	free(w->workers);
+	free(w->roots);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->work_cond);
+	pthread_cond_destroy(&w->done_cond);
+}
+
+
+// ls -R: each directory's listing under a "path:" header, in sorted
+// depth-first order, printed as soon as the walk has read that far
+int ls_print_tree(LsOptions *ls, Walk *w, WalkDir *d, int *shown)
+{
+	int ret = 0;
+
+	walk_wait(w, d, 0);
+	if (*shown)
+		outbuf_write(&ls->out, STDOUT_FILENO, "\n", 1);
+	outbuf_write(&ls->out, STDOUT_FILENO, d->path, strlen(d->path));
+	outbuf_write(&ls->out, STDOUT_FILENO, ":\n", 2);
+	*shown = 1;
+	if (d->err) {
+		outbuf_flush(&ls->out, STDOUT_FILENO);
+		fprintf(stderr, "lsh: ls: cannot open directory %s: %s\n", d->path, strerror(d->err));
+		ret = d->parent ? 1 : 2;
+	}
+	else if (ls->long_format || ls->color || ls->classify) {
+		// The walk may have closed d's fd already; these need one
+		int fd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		ls_print(ls, fd >= 0 ? fd : AT_FDCWD, &d->list, 1);
+		if (fd >= 0)
+			close(fd);
+	}
+	else {
+		ls_print(ls, AT_FDCWD, &d->list, 1);
+	}
+
+	for (size_t i = 0; i < d->list.count; i++) {
+		if (d->sub[i]) {
+			int r = ls_print_tree(ls, w, d->sub[i], shown);
+			if (r > ret)
+				ret = r;
+		}
+	}
+	walk_release(w, d);
+	return ret;
+}
+
+int ls_recursive(LsOptions *ls, char **paths, int *fds, int npaths, int *shown)
+{
+	Walk w;
+	int ret = 0;
+
+	walk_init(&w);
+	w.flags = ls->flags;
+	w.sort = 1;
+	w.keep = 1;
+	for (int i = 0; i < npaths; i++)
+		if (fds[i] >= 0)
+			walk_add(&w, paths[i], fds[i]);
+	walk_start(&w);
+	for (int i = 0; i < w.nroots; i++) {
+		int r = ls_print_tree(ls, &w, w.roots[i], shown);
+		if (r > ret)
+			ret = r;
+	}
+	walk_end(&w);
+	return ret;
+}
+
+
+/* tree [-a] [-d] [-L level] [-P pattern] [-I pattern] [dir...]
+ *
+ * Draws directory trees like tree(1), on the parallel walker. The filters
+ * run on the workers while they read: -I drops matching names (and so
+ * never descends into matching directories), -P keeps only files whose
+ * names match, -d keeps only directories, and -L stops the walk itself
+ * at the given depth instead of reading everything and hiding the rest.
+ */
+
+typedef struct {
+	const char *include;  // -P
+	const char *exclude;  // -I
+	int dirs_only;        // -d
+	long ndirs;
+	long nfiles;
+	OutBuf out;
+} Tree;
+
+int tree_filter(Walk *w, WalkDir *d, DirEntry *e)
+{
+	Tree *t = w->ctx;
+
+	(void)d;
+	if (t->exclude && fnmatch(t->exclude, e->name, 0) == 0)
+		return WALK_DROP;
+	if (e->type == DT_DIR)
+		return WALK_KEEP;
+	if (t->dirs_only)
+		return WALK_DROP;
+	return !t->include || fnmatch(t->include, e->name, 0) == 0 ? WALK_KEEP : WALK_DROP;
+}
+
+void tree_print_dir(Tree *t, Walk *w, WalkDir *d, char *prefix, size_t plen)
+{
+	walk_wait(w, d, 0);
+	for (size_t i = 0; i < d->list.count; i++) {
+		DirEntry *e = &d->list.entries[i];
+		int last = i + 1 == d->list.count;
+
+		outbuf_write(&t->out, STDOUT_FILENO, prefix, plen);
+		outbuf_write(&t->out, STDOUT_FILENO, last ? "└── " : "├── ", strlen("├── "));
+		outbuf_write(&t->out, STDOUT_FILENO, e->name, strlen(e->name));
+		if (e->type == DT_DIR)
+			t->ndirs++;
+		else
+			t->nfiles++;
+		if (e->type == DT_LNK) {
+			char target[PATH_MAX];
+			char *path = path_join(d->path, e->name);
+			ssize_t len = readlink(path, target, sizeof(target) - 1);
+			if (len >= 0) {
+				outbuf_write(&t->out, STDOUT_FILENO, " -> ", 4);
+				outbuf_write(&t->out, STDOUT_FILENO, target, len);
+			}
+			free(path);
+		}
+		if (d->sub[i] && (walk_wait(w, d->sub[i], 0), d->sub[i]->err)) {
+			const char *msg = "  [error opening dir]";
+			outbuf_write(&t->out, STDOUT_FILENO, msg, strlen(msg));
+		}
+		outbuf_write(&t->out, STDOUT_FILENO, "\n", 1);
+
+		if (d->sub[i]) {
+			// Children are drawn under "│   ", or blank after the last entry
+			const char *more = last ? "    " : "│   ";
+			char *sub = malloc(plen + strlen(more) + 1);
+			if (!sub) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+			memcpy(sub, prefix, plen);
+			strcpy(sub + plen, more);
+			tree_print_dir(t, w, d->sub[i], sub, plen + strlen(more));
+			free(sub);
+		}
+	}
+	walk_release(w, d);
+}
+
+int lsh_tree(char **args)
+{
+	Tree t;
+	Walk w;
+	int ret = 0, argc = 0, ndirs = 0;
+	char line[128];
+	char **dirs;
+
+	while (args[argc])
+		argc++;
+	// Operands are only added once all the options are known to be good
+	if (!(dirs = malloc(argc * sizeof(char *)))) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(&t, 0, sizeof(t));
+	walk_init(&w);
+	w.sort = 1;
+	w.keep = 1;
+	w.filter = tree_filter;
+	w.ctx = &t;
+	for (int i = 1; args[i]; i++) {
+		if (strcmp(args[i], "-a") == 0)
+			w.flags = DL_HIDDEN;
+		else if (strcmp(args[i], "-d") == 0)
+			t.dirs_only = 1;
+		else if (strcmp(args[i], "-L") == 0 && args[i + 1] && atoi(args[i + 1]) > 0)
+			w.max_depth = atoi(args[++i]) - 1; // the root's entries are level 1
+		else if (strcmp(args[i], "-P") == 0 && args[i + 1])
+			t.include = args[++i];
+		else if (strcmp(args[i], "-I") == 0 && args[i + 1])
+			t.exclude = args[++i];
+		else if (args[i][0] == '-' && args[i][1]) {
+			fprintf(stderr, "lsh: tree: usage: tree [-a] [-d] [-L level] [-P pattern] [-I pattern] [dir...]\n");
+			free(dirs);
+			walk_end(&w);
+			return 2;
+		}
+		else
+			dirs[ndirs++] = args[i];
+	}
+	for (int i = 0; i < ndirs; i++)
+		walk_add(&w, dirs[i], -1);
+	free(dirs);
+	if (w.nroots == 0)
+		walk_add(&w, ".", -1);
+
+	fflush(stdout);
+	walk_start(&w);
+	for (int i = 0; i < w.nroots; i++) {
+		WalkDir *root = w.roots[i];
+		outbuf_write(&t.out, STDOUT_FILENO, root->path, strlen(root->path));
+		if (root->err) {
+			const char *msg = "  [error opening dir]";
+			outbuf_write(&t.out, STDOUT_FILENO, msg, strlen(msg));
+			ret = 2;
+		}
+		outbuf_write(&t.out, STDOUT_FILENO, "\n", 1);
+		tree_print_dir(&t, &w, root, "", 0);
+	}
+	walk_end(&w);
+
+	int n = snprintf(line, sizeof(line), "\n%ld director%s", t.ndirs, t.ndirs == 1 ? "y" : "ies");
+	if (!t.dirs_only)
+		n += snprintf(line + n, sizeof(line) - n, ", %ld file%s", t.nfiles, t.nfiles == 1 ? "" : "s");
+	line[n++] = '\n';
+	outbuf_write(&t.out, STDOUT_FILENO, line, n);
+	outbuf_flush(&t.out, STDOUT_FILENO);
+	return ret;
+}
+
+
+/* Pathname expansion. expand_word() keeps, next to the expanded word, a
+ * pattern in which every quoted character is escaped with a backslash,
+ * so only unquoted "*", "?" and "[" match anything. The pattern is
+ * matched one component at a time against directory listings from the
+ * cache, with fnmatch(); components without wildcards are taken as they
+ * are, and only checked for at the end. Names starting with "." only
+ * match a pattern that starts with one, and "." and ".." never. A
+ * pattern that matches nothing is left as it was, as in sh.
+ */
+
+// Does component (up to len) have an unescaped wildcard?
+int glob_has_magic(const char *s, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] == '\\' && i + 1 < len)
+			i++;
+		else if (s[i] == '*' || s[i] == '?' || s[i] == '[')
+			return 1;
+	}
+	return 0;
+}
+
+// The first len bytes of s with the escaping backslashes taken out
+char *glob_unescape(const char *s, size_t len)
+{
+	char *out = malloc(len + 1), *o = out;
+
+	if (!out) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] == '\\' && i + 1 < len)
+			i++;
+		*o++ = s[i];
+	}
+	*o = '\0';
+	return out;
+}
+
+void words_push(char ***words, size_t *n, size_t *cap, char *w)
+{
+	if (*n + 1 >= *cap) {
+		*cap = *cap ? *cap * 2 : 16;
+		*words = realloc(*words, *cap * sizeof(char *));
+		if (!*words) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	(*words)[(*n)++] = w;
+}
+
+int glob_compare(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Is dir/name, of d_type type, a directory (following symbolic links)?
+int glob_is_dir(const char *path, unsigned char type)
+{
+	struct stat st;
+
+	if (type == DT_DIR)
+		return 1;
+	if (type != DT_LNK && type != DT_UNKNOWN)
+		return 0;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Append the paths pattern matches to *words, sorted; returns how many
+size_t glob_expand(const char *pattern, char ***words, size_t *n, size_t *cap)
+{
+	char **paths = NULL, **next;
+	size_t npaths = 0, pcap = 0, nnext, ncap;
+	const char *p = pattern;
+	int trailing_slash = 0;
+
+	words_push(&paths, &npaths, &pcap, path_join(*p == '/' ? "/" : "", ""));
+	while (*p == '/')
+		p++;
+	while (*p && npaths > 0) {
+		size_t len = strcspn(p, "/");
+		const char *rest = p + len;
+		int last;
+
+		while (*rest == '/')
+			rest++;
+		last = *rest == '\0';
+		trailing_slash = last && p[len] == '/';
+		next = NULL;
+		nnext = ncap = 0;
+
+		if (!glob_has_magic(p, len)) {
+			char *name = glob_unescape(p, len);
+			for (size_t i = 0; i < npaths; i++)
+				words_push(&next, &nnext, &ncap, path_join(paths[i], name));
+			free(name);
+		}
+		else {
+			char *comp = strndup(p, len);
+			if (!comp) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+			for (size_t i = 0; i < npaths; i++) {
+				int fd = open(paths[i][0] ? paths[i] : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+				DirList dl;
+
+				if (fd < 0)
+					continue;
+				memset(&dl, 0, sizeof(dl));
+				if (dircache_list(fd, &dl, DL_HIDDEN) == 0) {
+					for (size_t j = 0; j < dl.count; j++) {
+						DirEntry *e = &dl.entries[j];
+						char *path;
+
+						if (fnmatch(comp, e->name, FNM_PERIOD) != 0)
+							continue;
+						path = path_join(paths[i], e->name);
+						if ((!last || trailing_slash) && !glob_is_dir(path, e->type))
+							free(path);
+						else
+							words_push(&next, &nnext, &ncap, path);
+					}
+				}
+				dirlist_free(&dl);
+				close(fd);
+			}
+			free(comp);
+		}
+		for (size_t i = 0; i < npaths; i++)
+			free(paths[i]);
+		free(paths);
+		paths = next;
+		npaths = nnext;
+		pcap = ncap;
+		p = rest;
+	}
+
+	// Literal components were taken on trust: keep what exists
+	nnext = 0;
+	for (size_t i = 0; i < npaths; i++) {
+		struct stat st;
+		if (lstat(paths[i], &st) == 0)
+			paths[nnext++] = paths[i];
+		else
+			free(paths[i]);
+	}
+	npaths = nnext;
+	if (npaths > 1)
+		qsort(paths, npaths, sizeof(char *), glob_compare);
+	for (size_t i = 0; i < npaths; i++) {
+		if (trailing_slash) {
+			char *dir = path_join(paths[i], "");
+			free(paths[i]);
+			paths[i] = dir;
+		}
+		words_push(words, n, cap, paths[i]);
+	}
+	free(paths);
+	return npaths;
+}
+
+// Expand word onto *words: one word, or for an unquoted pattern that
+// matches, the paths it matches
+void expand_word_list(const char *word, char ***words, size_t *n, size_t *cap)
+{
+	char *pattern;
+	char *s = expand_word(word, &pattern);
+
+	if (pattern && glob_expand(pattern, words, n, cap) > 0)
+		free(s);
+	else
+		words_push(words, n, cap, s);
+	free(pattern);
+}
+
+
+/* find [path...] [expression]
+ *
+ * A find(1) for the common cases: -name, -iname, -path, -type, -size,
+ * -mtime, -newer, -mindepth, -maxdepth, -prune, -print, -print0, -true,
+ * -false and -exec ... ; or -exec ... {} +, joined with !, -a, -o and
+ * parentheses. With no action, matches are printed.
+ *
+ * The expression is parsed into a tree and then compiled into a flat
+ * program in which each test names the instruction to go on with when it
+ * is true and when it is false, so an entry is evaluated by a loop rather
+ * than a recursion. Before compiling, the operands of each -a and -o chain
+ * are reordered so that tests answered from the name and d_type run before
+ * those that need a statx(); nothing moves across an action. The statx is
+ * then done at most once per entry, and only if a test gets that far.
+ *
+ * Entries are evaluated on the walker's workers as each directory is read,
+ * so stat calls run in parallel too, into per-directory buffers that the
+ * caller writes out in the order find(1) would. -exec ... ; is the
+ * exception: its commands must run one at a time and in order, so with it
+ * the workers only read and the caller evaluates.
+ */
+
+enum { FIND_NODE_TEST, FIND_NODE_AND, FIND_NODE_OR, FIND_NODE_NOT };
+
+enum {
+	FIND_TRUE, FIND_FALSE, FIND_NAME, FIND_INAME, FIND_PATH, FIND_TYPE,
+	FIND_SIZE, FIND_MTIME, FIND_NEWER,                // need statx
+	FIND_PRUNE, FIND_PRINT, FIND_PRINT0, FIND_EXEC, FIND_EXEC_PLUS
+};
+
+// How expensive a test is, for reordering
+#define FIND_COST_NAME 0
+#define FIND_COST_STAT 1
+#define FIND_COST_ACTION 2
+
+#define FIND_END_FALSE -1
+#define FIND_END_TRUE -2
+
+// Buffer record kinds; -exec ... + records carry the index of their test
+#define FIND_OUT -1
+#define FIND_ERR -2
+
+#define FIND_STATX_MASK (STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME)
+#define FIND_BATCH_ARGS 4096          // -exec ... + paths per command at most
+#define FIND_BATCH_BYTES (128 * 1024)
+
+typedef struct {
+	int op;
+	int next[2];            // instruction to go on with when false, when true
+	const char *arg;        // -name, -iname, -path pattern
+	unsigned char type;     // -type, as a DT_* value
+	int cmp;                // -1, 0 or 1 for -N, N or +N
+	long long n;            // -size in units, -mtime in days
+	long long unit;         // -size unit in bytes
+	struct timespec newer;  // -newer reference mtime
+	char **argv;            // -exec command, not including the ; or {} +
+	int argc;
+	char **batch;           // -exec ... + paths waiting to run
+	int nbatch;
+	size_t batch_bytes;
+} FindTest;
+
+typedef struct FindNode {
+	int kind;
+	struct FindNode *a;
+	struct FindNode *b;
+	FindTest test;
+} FindNode;
+
+typedef struct {
+	char **args;            // the command line, while parsing
+	int pos;
+	FindTest *prog;
+	int nprog;
+	int start;              // the program's first instruction
+	int mindepth;
+	int maxdepth;           // -1 for no limit
+	int serial;             // -exec ... ; present: the caller evaluates
+	time_t now;
+	int status;
+	OutBuf out;
+} Find;
+
+// An entry being evaluated
+typedef struct {
+	int dirfd;              // what name is relative to
+	const char *name;       // a root's name is its whole path
+	const char *base;       // for -name
+	const char *dir;        // path of the directory it is in, NULL for a root
+	char *path;             // dir + name, built on first use
+	int depth;
+	unsigned char type;
+	int statted;            // 1 once stx is filled in, -1 if statx failed
+	struct statx stx;
+	int prune;
+} FindEntry;
+
+// Output and -exec ... + paths from evaluating a directory's entries,
+// as FindRecords, and where each kept entry's records end
+typedef struct {
+	OutBuf buf;
+	size_t *ends;
+	size_t nends;
+	size_t cap_ends;
+} FindBuf;
+
+typedef struct {
+	int kind;               // FIND_OUT, FIND_ERR, or an -exec ... + test
+	size_t len;
+} FindRecord;
+
+FindNode *find_node(int kind, FindNode *a, FindNode *b)
+{
+	FindNode *n = calloc(1, sizeof(FindNode));
+
+	if (!n) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	n->kind = kind;
+	n->a = a;
+	n->b = b;
+	return n;
+}
+
+void find_node_free(FindNode *n)
+{
+	if (!n)
+		return;
+	find_node_free(n->a);
+	find_node_free(n->b);
+	free(n);
+}
+
+// The argument of opt, or NULL after complaining that there is none
+const char *find_arg(Find *f, const char *opt)
+{
+	const char *arg = f->args[f->pos];
+
+	if (!arg)
+		fprintf(stderr, "lsh: find: missing argument to `%s'\n", opt);
+	else
+		f->pos++;
+	return arg;
+}
+
+// [+-]N, leaving *end at what follows the digits
+int find_number(const char *s, int *cmp, long long *n, char **end)
+{
+	*cmp = *s == '+' ? 1 : *s == '-' ? -1 : 0;
+	if (*cmp)
+		s++;
+	if (!isdigit((unsigned char)*s))
+		return -1;
+	*n = strtoll(s, end, 10);
+	return 0;
+}
+
+FindNode *find_parse_primary(Find *f)
+{
+	const char *opt = f->args[f->pos++];
+	const char *arg;
+	char *end;
+	FindNode *n = find_node(FIND_NODE_TEST, NULL, NULL);
+	FindTest *t = &n->test;
+
+	if (strcmp(opt, "-print") == 0)
+		t->op = FIND_PRINT;
+	else if (strcmp(opt, "-print0") == 0)
+		t->op = FIND_PRINT0;
+	else if (strcmp(opt, "-prune") == 0)
+		t->op = FIND_PRUNE;
+	else if (strcmp(opt, "-true") == 0)
+		t->op = FIND_TRUE;
+	else if (strcmp(opt, "-false") == 0)
+		t->op = FIND_FALSE;
+	else if (strcmp(opt, "-name") == 0 || strcmp(opt, "-iname") == 0 || strcmp(opt, "-path") == 0 || strcmp(opt, "-wholename") == 0) {
+		if (!(t->arg = find_arg(f, opt)))
+			goto fail;
+		t->op = opt[1] == 'n' ? FIND_NAME : opt[1] == 'i' ? FIND_INAME : FIND_PATH;
+	}
+	else if (strcmp(opt, "-type") == 0) {
+		static const char types[] = "fdlpsbc";
+		static const unsigned char dtypes[] = {DT_REG, DT_DIR, DT_LNK, DT_FIFO, DT_SOCK, DT_BLK, DT_CHR};
+		const char *c;
+
+		if (!(arg = find_arg(f, opt)))
+			goto fail;
+		if (!arg[0] || arg[1] || !(c = strchr(types, arg[0]))) {
+			fprintf(stderr, "lsh: find: unknown argument to -type: %s\n", arg);
+			goto fail;
+		}
+		t->op = FIND_TYPE;
+		t->type = dtypes[c - types];
+	}
+	else if (strcmp(opt, "-size") == 0) {
+		if (!(arg = find_arg(f, opt)))
+			goto fail;
+		t->op = FIND_SIZE;
+		if (find_number(arg, &t->cmp, &t->n, &end) < 0 || (*end && end[1]) || !strchr("cwbkMG", *end)) {
+			fprintf(stderr, "lsh: find: invalid -size argument `%s'\n", arg);
+			goto fail;
+		}
+		switch (*end) {
+		case 'c': t->unit = 1; break;
+		case 'w': t->unit = 2; break;
+		case 'k': t->unit = 1024; break;
+		case 'M': t->unit = 1024 * 1024; break;
+		case 'G': t->unit = 1024 * 1024 * 1024; break;
+		default:  t->unit = 512; break;
+		}
+	}
+	else if (strcmp(opt, "-mtime") == 0) {
+		if (!(arg = find_arg(f, opt)))
+			goto fail;
+		t->op = FIND_MTIME;
+		if (find_number(arg, &t->cmp, &t->n, &end) < 0 || *end) {
+			fprintf(stderr, "lsh: find: invalid -mtime argument `%s'\n", arg);
+			goto fail;
+		}
+	}
+	else if (strcmp(opt, "-newer") == 0) {
+		struct stat st;
+
+		if (!(arg = find_arg(f, opt)))
+			goto fail;
+		if (lstat(arg, &st) < 0) {
+			fprintf(stderr, "lsh: find: %s: %s\n", arg, strerror(errno));
+			goto fail;
+		}
+		t->op = FIND_NEWER;
+		t->newer = st.st_mtim;
+	}
+	else if (strcmp(opt, "-mindepth") == 0 || strcmp(opt, "-maxdepth") == 0) {
+		if (!(arg = find_arg(f, opt)))
+			goto fail;
+		if (!isdigit((unsigned char)arg[0])) {
+			fprintf(stderr, "lsh: find: invalid argument `%s' to `%s'\n", arg, opt);
+			goto fail;
+		}
+		if (opt[2] == 'i')
+			f->mindepth = atoi(arg);
+		else
+			f->maxdepth = atoi(arg);
+		t->op = FIND_TRUE; // an option, not a test
+	}
+	else if (strcmp(opt, "-exec") == 0) {
+		int first = f->pos;
+
+		// Up to ";", or "+" right after "{}"
+		while (f->args[f->pos] && strcmp(f->args[f->pos], ";") != 0 &&
+		       !(strcmp(f->args[f->pos], "+") == 0 && f->pos > first && strcmp(f->args[f->pos - 1], "{}") == 0))
+			f->pos++;
+		t->argv = &f->args[first];
+		t->argc = f->pos - first;
+		if (f->args[f->pos] && f->args[f->pos][0] == '+') {
+			t->op = FIND_EXEC_PLUS;
+			t->argc--; // the "{}" is where the paths go
+		}
+		else {
+			t->op = FIND_EXEC;
+		}
+		if (!f->args[f->pos] || t->argc == 0) {
+			fprintf(stderr, "lsh: find: missing argument to `-exec'\n");
+			goto fail;
+		}
+		f->pos++;
+	}
+	else {
+		fprintf(stderr, "lsh: find: unknown predicate `%s'\n", opt);
+		goto fail;
+	}
+	return n;
+
+fail:
+	free(n);
+	return NULL;
+}
+
+FindNode *find_parse_or(Find *f);
+
+FindNode *find_parse_unary(Find *f)
+{
+	const char *tok = f->args[f->pos];
+	FindNode *n;
+
+	if (!tok || strcmp(tok, ")") == 0) {
+		fprintf(stderr, "lsh: find: expected an expression%s%s\n", tok ? " before " : "", tok ? tok : "");
+		return NULL;
+	}
+	if (strcmp(tok, "!") == 0 || strcmp(tok, "-not") == 0) {
+		f->pos++;
+		n = find_parse_unary(f);
+		return n ? find_node(FIND_NODE_NOT, n, NULL) : NULL;
+	}
+	if (strcmp(tok, "(") == 0) {
+		f->pos++;
+		n = find_parse_or(f);
+		if (n && (!f->args[f->pos] || strcmp(f->args[f->pos], ")") != 0)) {
+			fprintf(stderr, "lsh: find: missing `)'\n");
+			find_node_free(n);
+			return NULL;
+		}
+		f->pos++;
+		return n;
+	}
+	return find_parse_primary(f);
+}
+
+FindNode *find_parse_and(Find *f)
+{
+	FindNode *n = find_parse_unary(f);
+
+	while (n && f->args[f->pos] && strcmp(f->args[f->pos], ")") != 0 &&
+	       strcmp(f->args[f->pos], "-o") != 0 && strcmp(f->args[f->pos], "-or") != 0) {
+		FindNode *b;
+
+		if (strcmp(f->args[f->pos], "-a") == 0 || strcmp(f->args[f->pos], "-and") == 0)
+			f->pos++;
+		if (!(b = find_parse_unary(f))) {
+			find_node_free(n);
+			return NULL;
+		}
+		n = find_node(FIND_NODE_AND, n, b);
+	}
+	return n;
+}
+
+FindNode *find_parse_or(Find *f)
+{
+	FindNode *n = find_parse_and(f);
+
+	while (n && f->args[f->pos] && (strcmp(f->args[f->pos], "-o") == 0 || strcmp(f->args[f->pos], "-or") == 0)) {
+		FindNode *b;
+
+		f->pos++;
+		if (!(b = find_parse_and(f))) {
+			find_node_free(n);
+			return NULL;
+		}
+		n = find_node(FIND_NODE_OR, n, b);
+	}
+	return n;
+}
+
+int find_cost(FindNode *n)
+{
+	int a, b;
+
+	if (n->kind == FIND_NODE_TEST)
+		return n->test.op >= FIND_PRUNE ? FIND_COST_ACTION : n->test.op >= FIND_SIZE ? FIND_COST_STAT : FIND_COST_NAME;
+	a = find_cost(n->a);
+	b = n->b ? find_cost(n->b) : FIND_COST_NAME;
+	return a > b ? a : b;
+}
+
+// Does the expression print or run anything?
+int find_has_action(FindNode *n)
+{
+	if (n->kind == FIND_NODE_TEST)
+		return n->test.op >= FIND_PRINT;
+	return find_has_action(n->a) || (n->b && find_has_action(n->b));
+}
+
+// Collect the operands of a chain of one operator, left to right
+void find_flatten(FindNode *n, int kind, FindNode ***ops, int *nops)
+{
+	if (n->kind != kind) {
+		*ops = realloc(*ops, (*nops + 1) * sizeof(FindNode *));
+		if (!*ops) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		(*ops)[(*nops)++] = n;
+		return;
+	}
+	find_flatten(n->a, kind, ops, nops);
+	find_flatten(n->b, kind, ops, nops);
+	free(n);
+}
+
+// Move the name tests in each -a and -o chain ahead of the stat tests.
+// Only a stable sort within runs free of actions: an action must still
+// see exactly the entries it saw before.
+FindNode *find_optimize(FindNode *n)
+{
+	FindNode **ops = NULL;
+	int nops = 0;
+	int kind = n->kind;
+
+	if (kind == FIND_NODE_TEST)
+		return n;
+	if (kind == FIND_NODE_NOT) {
+		n->a = find_optimize(n->a);
+		return n;
+	}
+	find_flatten(n, kind, &ops, &nops);
+	for (int i = 0; i < nops; i++)
+		ops[i] = find_optimize(ops[i]);
+	for (int i = 1; i < nops; i++) {
+		FindNode *op = ops[i];
+		int j = i;
+
+		if (find_cost(op) != FIND_COST_NAME)
+			continue;
+		for (; j > 0 && find_cost(ops[j - 1]) == FIND_COST_STAT; j--)
+			ops[j] = ops[j - 1];
+		ops[j] = op;
+	}
+	n = ops[0];
+	for (int i = 1; i < nops; i++)
+		n = find_node(kind, n, ops[i]);
+	free(ops);
+	return n;
+}
+
+// Emit n to go on at t when true and at fl when false; returns where n
+// starts. Built back to front, so each jump target already exists.
+int find_compile(Find *f, FindNode *n, int t, int fl)
+{
+	switch (n->kind) {
+	case FIND_NODE_AND:
+		return find_compile(f, n->a, find_compile(f, n->b, t, fl), fl);
+	case FIND_NODE_OR:
+		return find_compile(f, n->a, t, find_compile(f, n->b, t, fl));
+	case FIND_NODE_NOT:
+		return find_compile(f, n->a, fl, t);
+	}
+	f->prog = realloc(f->prog, (f->nprog + 1) * sizeof(FindTest));
+	if (!f->prog) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	f->prog[f->nprog] = n->test;
+	f->prog[f->nprog].next[0] = fl;
+	f->prog[f->nprog].next[1] = t;
+	return f->nprog++;
+}
+
+void find_emit(FindBuf *b, int kind, const char *s, char end)
+{
+	FindRecord r = {kind, strlen(s) + 1};
+
+	outbuf_append(&b->buf, (const char *)&r, sizeof(r));
+	outbuf_append(&b->buf, s, r.len - 1);
+	outbuf_append(&b->buf, &end, 1);
+}
+
+// The records so far belong before the entry just kept
+void find_mark(FindBuf *b)
+{
+	if (b->nends == b->cap_ends) {
+		b->cap_ends = b->cap_ends ? b->cap_ends * 2 : 16;
+		b->ends = realloc(b->ends, b->cap_ends * sizeof(size_t));
+		if (!b->ends) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	b->ends[b->nends++] = b->buf.len;
+}
+
+void find_buf_free(FindBuf *b)
+{
+	if (!b)
+		return;
+	free(b->buf.data);
+	free(b->ends);
+	free(b);
+}
+
+const char *find_path(FindEntry *fe)
+{
+	if (!fe->dir)
+		return fe->name;
+	if (!fe->path)
+		fe->path = path_join(fe->dir, fe->name);
+	return fe->path;
+}
+
+int find_stat(FindEntry *fe, FindBuf *b)
+{
+	if (!fe->statted) {
+		if (statx(fe->dirfd, fe->name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, FIND_STATX_MASK, &fe->stx) == 0) {
+			fe->statted = 1;
+		}
+		else {
+			char msg[PATH_MAX + 128];
+			int err = errno;
+
+			snprintf(msg, sizeof(msg), "lsh: find: %s: %s", find_path(fe), strerror(err));
+			find_emit(b, FIND_ERR, msg, '\n');
+			fe->statted = -1;
+		}
+	}
+	return fe->statted > 0;
+}
+
+int find_compare(long long v, int cmp, long long n)
+{
+	return cmp > 0 ? v > n : cmp < 0 ? v < n : v == n;
+}
+
+// Run a command to completion, after everything printed so far
+int find_run(Find *f, char **argv)
+{
+	pid_t pid;
+	int status;
+	struct rusage ru;
+
+	outbuf_flush(&f->out, STDOUT_FILENO);
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		prepare_child();
+		lsh_exec_child(argv);
+	}
+	if (pid < 0) {
+		perror("lsh: find");
+		return 1;
+	}
+	wait_child_event_loop(pid, &status, &ru);
+	return wait_status_code(status);
+}
+
+// -exec ... ;, with every "{}" in the command replaced by path
+int find_exec(Find *f, FindTest *t, const char *path)
+{
+	char **argv = malloc((t->argc + 1) * sizeof(char *));
+	int status;
+
+	if (!argv) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < t->argc; i++) {
+		const char *s = t->argv[i], *p;
+		size_t len = 0, cap = 0;
+
+		argv[i] = NULL;
+		while ((p = strstr(s, "{}"))) {
+			str_append(&argv[i], &len, &cap, s, p - s);
+			str_append(&argv[i], &len, &cap, path, strlen(path));
+			s = p + 2;
+		}
+		str_append(&argv[i], &len, &cap, s, strlen(s));
+	}
+	argv[t->argc] = NULL;
+	status = find_run(f, argv);
+	for (int i = 0; i < t->argc; i++)
+		free(argv[i]);
+	free(argv);
+	return status;
+}
+
+// Run an -exec ... + command on the paths collected for it
+void find_batch_run(Find *f, FindTest *t)
+{
+	char **argv = malloc((t->argc + t->nbatch + 1) * sizeof(char *));
+
+	if (!argv) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(argv, t->argv, t->argc * sizeof(char *));
+	memcpy(argv + t->argc, t->batch, t->nbatch * sizeof(char *));
+	argv[t->argc + t->nbatch] = NULL;
+	if (find_run(f, argv) != 0)
+		f->status = 1;
+	for (int i = 0; i < t->nbatch; i++)
+		free(t->batch[i]);
+	free(argv);
+	free(t->batch);
+	t->batch = NULL;
+	t->nbatch = 0;
+	t->batch_bytes = 0;
+}
+
+// Write out, collect or run the records in b between from and to
+void find_drain(Find *f, FindBuf *b, size_t from, size_t to)
+{
+	while (from < to) {
+		FindRecord r;
+		const char *s = b->buf.data + from + sizeof(r);
+
+		memcpy(&r, b->buf.data + from, sizeof(r));
+		from += sizeof(r) + r.len;
+		if (r.kind == FIND_OUT) {
+			outbuf_write(&f->out, STDOUT_FILENO, s, r.len);
+		}
+		else if (r.kind == FIND_ERR) {
+			outbuf_flush(&f->out, STDOUT_FILENO);
+			fwrite(s, 1, r.len, stderr);
+			f->status = 1;
+		}
+		else {
+			FindTest *t = &f->prog[r.kind];
+
+			t->batch = realloc(t->batch, (t->nbatch + 1) * sizeof(char *));
+			if (!t->batch || !(t->batch[t->nbatch] = strdup(s))) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+			t->nbatch++;
+			t->batch_bytes += r.len + sizeof(char *);
+			if (t->nbatch >= FIND_BATCH_ARGS || t->batch_bytes >= FIND_BATCH_BYTES)
+				find_batch_run(f, t);
+		}
+	}
+}
+
+// Run the program on one entry. Output goes to b, except that -exec ... ;
+// (only ever evaluated by the caller) writes out b and runs right away.
+int find_eval(Find *f, FindEntry *fe, FindBuf *b)
+{
+	int pc = f->start;
+
+	while (pc >= 0) {
+		FindTest *t = &f->prog[pc];
+		int r = 0;
+
+		switch (t->op) {
+		case FIND_TRUE:
+			r = 1;
+			break;
+		case FIND_FALSE:
+			break;
+		case FIND_NAME:
+		case FIND_INAME:
+			r = fnmatch(t->arg, fe->base, t->op == FIND_INAME ? FNM_CASEFOLD : 0) == 0;
+			break;
+		case FIND_PATH:
+			r = fnmatch(t->arg, find_path(fe), 0) == 0;
+			break;
+		case FIND_TYPE:
+			if (fe->type == DT_UNKNOWN && find_stat(fe, b))
+				fe->type = mode_to_dtype(fe->stx.stx_mode);
+			r = fe->type == t->type;
+			break;
+		case FIND_SIZE:
+			// In whole units, rounded up, as find(1) counts them
+			if (find_stat(fe, b))
+				r = find_compare((fe->stx.stx_size + t->unit - 1) / t->unit, t->cmp, t->n);
+			break;
+		case FIND_MTIME:
+			if (find_stat(fe, b))
+				r = find_compare((f->now - fe->stx.stx_mtime.tv_sec) / 86400, t->cmp, t->n);
+			break;
+		case FIND_NEWER:
+			if (find_stat(fe, b))
+				r = fe->stx.stx_mtime.tv_sec > t->newer.tv_sec ||
+				    (fe->stx.stx_mtime.tv_sec == t->newer.tv_sec && fe->stx.stx_mtime.tv_nsec > t->newer.tv_nsec);
+			break;
+		case FIND_PRUNE:
+			fe->prune = 1;
+			r = 1;
+			break;
+		case FIND_PRINT:
+		case FIND_PRINT0:
+			find_emit(b, FIND_OUT, find_path(fe), t->op == FIND_PRINT ? '\n' : '\0');
+			r = 1;
+			break;
+		case FIND_EXEC_PLUS:
+			find_emit(b, pc, find_path(fe), '\0');
+			r = 1;
+			break;
+		case FIND_EXEC:
+			find_drain(f, b, 0, b->buf.len);
+			b->buf.len = 0;
+			r = find_exec(f, t, find_path(fe)) == 0;
+			break;
+		}
+		pc = t->next[r];
+	}
+	return pc == FIND_END_TRUE;
+}
+
+// Evaluate an entry as its directory is read. Only subdirectories are
+// kept in the list, each ending the stretch of records printed with it.
+int find_filter(Walk *w, WalkDir *d, DirEntry *e)
+{
+	Find *f = w->ctx;
+	FindBuf *b = d->data;
+	FindEntry fe = {.dirfd = d->fd, .name = e->name, .base = e->name, .dir = d->path, .depth = d->depth + 1, .type = e->type};
+
+	if (!b && !(b = d->data = calloc(1, sizeof(FindBuf)))) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	if (fe.depth >= f->mindepth)
+		find_eval(f, &fe, b);
+	free(fe.path);
+	if (e->type != DT_DIR)
+		return WALK_DROP;
+	find_mark(b);
+	return fe.prune ? WALK_PRUNE : WALK_KEEP;
+}
+
+void find_dir_error(Find *f, WalkDir *d)
+{
+	outbuf_flush(&f->out, STDOUT_FILENO);
+	fprintf(stderr, "lsh: find: %s: %s\n", d->path, strerror(d->err));
+	f->status = 1;
+}
+
+// Write out what the workers found, depth first
+void find_print_dir(Find *f, Walk *w, WalkDir *d)
+{
+	FindBuf *b;
+	size_t from = 0;
+
+	walk_wait(w, d, 0);
+	b = d->data;
+	if (d->err)
+		find_dir_error(f, d);
+	for (size_t i = 0; i < d->list.count; i++) {
+		find_drain(f, b, from, b->ends[i]);
+		from = b->ends[i];
+		if (d->sub[i])
+			find_print_dir(f, w, d->sub[i]);
+	}
+	if (b)
+		find_drain(f, b, from, b->buf.len);
+	find_buf_free(b);
+	walk_release(w, d);
+}
+
+// Release a directory that was read but turned out to be pruned
+void find_skip(Walk *w, WalkDir *d)
+{
+	walk_wait(w, d, 0);
+	for (size_t i = 0; i < d->list.count; i++)
+		if (d->sub[i])
+			find_skip(w, d->sub[i]);
+	find_buf_free(d->data);
+	walk_release(w, d);
+}
+
+// Evaluate on the caller, in order, for -exec ... ;
+void find_serial_dir(Find *f, Walk *w, WalkDir *d, FindBuf *b)
+{
+	int fd;
+
+	walk_wait(w, d, 0);
+	if (d->err)
+		find_dir_error(f, d);
+	fd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC); // d's own may be closed by now
+	for (size_t i = 0; i < d->list.count; i++) {
+		DirEntry *e = &d->list.entries[i];
+		FindEntry fe = {.dirfd = fd, .name = e->name, .base = e->name, .dir = d->path, .depth = d->depth + 1, .type = e->type};
+
+		if (fe.depth >= f->mindepth)
+			find_eval(f, &fe, b);
+		free(fe.path);
+		find_drain(f, b, 0, b->buf.len);
+		b->buf.len = 0;
+		if (d->sub[i] && fe.prune)
+			find_skip(w, d->sub[i]);
+		else if (d->sub[i])
+			find_serial_dir(f, w, d->sub[i], b);
+	}
+	if (fd >= 0)
+		close(fd);
+	walk_release(w, d);
+}
+
+int lsh_find(char **args)
+{
+	static char *dot[] = {".", NULL};
+	Find f;
+	Walk w;
+	FindNode *expr = NULL;
+	FindBuf scratch;
+	char **paths = args + 1;
+	int npaths;
+	struct {
+		WalkDir *dir;
+		int err;
+		struct statx stx;
+	} *roots;
+
+	memset(&f, 0, sizeof(f));
+	memset(&scratch, 0, sizeof(scratch));
+	f.maxdepth = -1;
+	f.now = time(NULL);
+	f.args = args;
+	for (f.pos = 1; args[f.pos]; f.pos++)
+		if ((args[f.pos][0] == '-' && args[f.pos][1]) || strcmp(args[f.pos], "!") == 0 || strcmp(args[f.pos], "(") == 0)
+			break;
+	npaths = f.pos - 1;
+	if (args[f.pos]) {
+		expr = find_parse_or(&f);
+		if (expr && args[f.pos]) {
+			fprintf(stderr, "lsh: find: unexpected `%s'\n", args[f.pos]);
+			find_node_free(expr);
+			expr = NULL;
+		}
+		if (!expr)
+			return 1;
+	}
+	if (!expr || !find_has_action(expr)) {
+		FindNode *print = find_node(FIND_NODE_TEST, NULL, NULL);
+		print->test.op = FIND_PRINT;
+		expr = expr ? find_node(FIND_NODE_AND, expr, print) : print;
+	}
+	expr = find_optimize(expr);
+	f.start = find_compile(&f, expr, FIND_END_TRUE, FIND_END_FALSE);
+	find_node_free(expr);
+	for (int i = 0; i < f.nprog; i++)
+		if (f.prog[i].op == FIND_EXEC)
+			f.serial = 1;
+	if (npaths == 0) {
+		paths = dot;
+		npaths = 1;
+	}
+
+	walk_init(&w);
+	w.flags = DL_HIDDEN;
+	w.keep = 1;
+	w.ctx = &f;
+	if (!f.serial)
+		w.filter = find_filter;
+	if (f.maxdepth > 0)
+		w.max_depth = f.maxdepth - 1; // the roots' entries are depth 1
+	roots = calloc(npaths, sizeof(*roots));
+	if (!roots) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	// Roots are not followed if they are symlinks, as with find -P
+	for (int i = 0; i < npaths; i++) {
+		if (statx(AT_FDCWD, paths[i], AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, FIND_STATX_MASK, &roots[i].stx) < 0)
+			roots[i].err = errno;
+		else if (S_ISDIR(roots[i].stx.stx_mode) && f.maxdepth != 0)
+			roots[i].dir = walk_add(&w, paths[i], -1);
+	}
+
+	fflush(stdout);
+	walk_start(&w);
+	for (int i = 0; i < npaths; i++) {
+		char *base, *slash;
+		FindEntry fe = {.dirfd = AT_FDCWD, .name = paths[i], .type = mode_to_dtype(roots[i].stx.stx_mode), .statted = 1, .stx = roots[i].stx};
+
+		if (roots[i].err) {
+			outbuf_flush(&f.out, STDOUT_FILENO);
+			fprintf(stderr, "lsh: find: %s: %s\n", paths[i], strerror(roots[i].err));
+			f.status = 1;
+			continue;
+		}
+		// -name sees the last component, without trailing slashes
+		base = strdup(paths[i]);
+		for (size_t len = strlen(base); len > 1 && base[len - 1] == '/'; len--)
+			base[len - 1] = '\0';
+		slash = strrchr(base, '/');
+		fe.base = slash && slash[1] ? slash + 1 : base;
+		if (f.mindepth == 0)
+			find_eval(&f, &fe, &scratch);
+		find_drain(&f, &scratch, 0, scratch.buf.len);
+		scratch.buf.len = 0;
+		free(base);
+
+		if (roots[i].dir && fe.prune)
+			find_skip(&w, roots[i].dir);
+		else if (roots[i].dir && f.serial)
+			find_serial_dir(&f, &w, roots[i].dir, &scratch);
+		else if (roots[i].dir)
+			find_print_dir(&f, &w, roots[i].dir);
+	}
+	walk_end(&w);
+
+	for (int i = 0; i < f.nprog; i++)
+		if (f.prog[i].nbatch > 0)
+			find_batch_run(&f, &f.prog[i]);
+	outbuf_flush(&f.out, STDOUT_FILENO);
+	free(scratch.buf.data);
+	free(scratch.ends);
+	free(roots);
+	free(f.prog);
+	return f.status;
+}
+
+
+/* du [-sahcbk] [-d depth] [path...]
+ *
+ * Disk usage on the parallel walker. Each worker statx()es the files of
+ * the directory it is reading, asking only for the blocks or the size and
+ * the link count; subdirectories are not statted from their parent, since
+ * d_type already says what they are, but by themselves through their own
+ * fd. Totals are aggregated bottom-up in leave(), which runs once a
+ * directory and everything below it are done: a directory's total is then
+ * final and is added atomically to its parent's, with no locks. Its output
+ * is put together there too, from its own lines and its subdirectories'
+ * output, and handed up the same way, so each WalkDir is freed as soon as
+ * it is counted and the caller only writes out what reaches the roots.
+ *
+ * Files with more than one link are counted once, through a set of
+ * (dev, ino) pairs split into independently locked shards, so threads
+ * rarely contend for it. Which of the links is counted depends on which
+ * thread gets there first, so with -a the one listed may differ from
+ * du(1)'s; the totals don't.
+ */
+
+#define DU_SHARDS 64
+#define DU_COUNTED UINT64_MAX
+
+typedef struct {
+	uint64_t dev;
+	uint64_t ino;           // 0 marks an empty slot
+} DuInode;
+
+typedef struct {
+	pthread_mutex_t lock;
+	DuInode *slots;
+	size_t cap;             // a power of two
+	size_t count;
+} DuShard;
+
+typedef struct {
+	int summarize;          // -s
+	int all;                // -a
+	int human;              // -h
+	int bytes;              // -b: apparent size in bytes instead of blocks
+	int max_depth;          // -d; -1 for no limit
+	unsigned mask;
+	atomic_int failed;
+	DuShard shards[DU_SHARDS];
+	OutBuf out;
+} Du;
+
+// A run of output lines. A directory's output is a list of them, so its
+// parent can take it over whole, without copying.
+typedef struct DuText {
+	struct DuText *next;
+	size_t len;
+	char data[];
+} DuText;
+
+typedef struct {
+	DuText *head;
+	DuText *tail;
+} DuTextList;
+
+typedef struct {
+	atomic_ullong total;    // the directory and everything below it
+	size_t index;           // of its entry in the parent's list
+	uint64_t *sizes;        // with -a, per kept entry; DU_COUNTED for a link already counted
+	size_t nsizes;
+	size_t cap;
+	DuTextList *subs;       // per kept entry, the output of the subdirectory there
+	DuTextList text;        // a root's output, once it is left
+} DuDir;
+
+DuInode *du_slot(DuInode *slots, size_t cap, uint64_t hash, uint64_t dev, uint64_t ino)
+{
+	size_t i = hash & (cap - 1);
+	while (slots[i].ino && (slots[i].ino != ino || slots[i].dev != dev))
+		i = (i + 1) & (cap - 1);
+	return &slots[i];
+}
+
+// Has this inode been counted already? Marks it counted if not.
+int du_seen(Du *du, uint64_t dev, uint64_t ino)
+{
+	uint64_t hash = (ino ^ (dev << 32 | dev >> 32)) * 0x9e3779b97f4a7c15ull;
+	DuShard *s = &du->shards[hash >> 58]; // top bits pick the shard, low bits the slot
+	DuInode *slot;
+	int seen;
+
+	pthread_mutex_lock(&s->lock);
+	// Keep each shard at most half full
+	if ((s->count + 1) * 2 > s->cap) {
+		size_t cap = s->cap ? s->cap * 2 : 64;
+		DuInode *slots = calloc(cap, sizeof(DuInode));
+		if (!slots) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		for (size_t i = 0; i < s->cap; i++) {
+			DuInode *old = &s->slots[i];
+			if (old->ino)
+				*du_slot(slots, cap, (old->ino ^ (old->dev << 32 | old->dev >> 32)) * 0x9e3779b97f4a7c15ull, old->dev, old->ino) = *old;
+		}
+		free(s->slots);
+		s->slots = slots;
+		s->cap = cap;
+	}
+	slot = du_slot(s->slots, s->cap, hash, dev, ino);
+	seen = slot->ino != 0;
+	if (!seen) {
+		slot->dev = dev;
+		slot->ino = ino;
+		s->count++;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return seen;
+}
+
+// What stx adds to a total, or DU_COUNTED for a hard link already counted
+uint64_t du_size(Du *du, struct statx *stx, int dir)
+{
+	if (!dir && stx->stx_nlink > 1 &&
+	    du_seen(du, (uint64_t)stx->stx_dev_major << 32 | stx->stx_dev_minor, stx->stx_ino))
+		return DU_COUNTED;
+	return du->bytes ? stx->stx_size : stx->stx_blocks * 512;
+}
+
+DuDir *du_dir(WalkDir *d)
+{
+	if (!d->data && !(d->data = calloc(1, sizeof(DuDir)))) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	return d->data;
+}
+
+void du_error(Du *du, const char *what, const char *path, int err)
+{
+	fprintf(stderr, "lsh: du: cannot %s '%s': %s\n", what, path, strerror(err));
+	atomic_store(&du->failed, 1);
+}
+
+int du_filter(Walk *w, WalkDir *d, DirEntry *e)
+{
+	Du *du = w->ctx;
+	DuDir *dd = du_dir(d);
+	struct statx stx;
+	uint64_t size = 0;
+
+	if (e->type != DT_DIR) {
+		if (statx(d->fd, e->name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, du->mask, &stx) == 0) {
+			size = du_size(du, &stx, 0);
+			if (size != DU_COUNTED)
+				atomic_fetch_add_explicit(&dd->total, size, memory_order_relaxed);
+		}
+		else {
+			char *path = path_join(d->path, e->name);
+			du_error(du, "access", path, errno);
+			free(path);
+		}
+		if (!du->all || du->summarize)
+			return WALK_DROP;
+	}
+	if (du->all && !du->summarize) {
+		if (dd->nsizes == dd->cap) {
+			dd->cap = dd->cap ? dd->cap * 2 : 16;
+			dd->sizes = realloc(dd->sizes, dd->cap * sizeof(uint64_t));
+			if (!dd->sizes) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		dd->sizes[dd->nsizes++] = size;
+	}
+	return WALK_KEEP;
+}
+
+// A directory counts itself, through its own fd when it could be opened,
+// and tells its subdirectories where their output goes
+void du_visit(Walk *w, WalkDir *d)
+{
+	Du *du = w->ctx;
+	DuDir *dd = du_dir(d);
+	struct statx stx;
+	int r;
+
+	if (d->fd >= 0)
+		r = statx(d->fd, "", AT_EMPTY_PATH, du->mask, &stx);
+	else if (d->parent)
+		r = statx(d->parent->fd, d->name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, du->mask, &stx);
+	else
+		r = statx(AT_FDCWD, d->path, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, du->mask, &stx);
+	if (r == 0)
+		atomic_fetch_add_explicit(&dd->total, du_size(du, &stx, 1), memory_order_relaxed);
+	if (d->err)
+		du_error(du, "read directory", d->path, d->err);
+	if (du->summarize)
+		return;
+	dd->subs = calloc(d->list.count ? d->list.count : 1, sizeof(DuTextList));
+	if (!dd->subs) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < d->list.count; i++)
+		if (d->sub[i])
+			du_dir(d->sub[i])->index = i;
+}
+
+// Move what is in run to the end of l as one piece
+void du_text_add(DuTextList *l, OutBuf *run)
+{
+	DuText *t;
+
+	if (run->len == 0)
+		return;
+	t = malloc(sizeof(DuText) + run->len);
+	if (!t) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	t->next = NULL;
+	t->len = run->len;
+	memcpy(t->data, run->data, run->len);
+	run->len = 0;
+	if (l->tail)
+		l->tail->next = t;
+	else
+		l->head = t;
+	l->tail = t;
+}
+
+void du_text_splice(DuTextList *l, DuTextList *more)
+{
+	if (!more->head)
+		return;
+	if (l->tail)
+		l->tail->next = more->head;
+	else
+		l->head = more->head;
+	l->tail = more->tail;
+}
+
+void du_format(Du *du, uint64_t bytes, const char *path, OutBuf *b);
+
+// Everything below d is counted: its total is final, and so is its
+// output, depth first and in directory order as du(1) prints it. Both go
+// to the parent, and d's own WalkDir is freed after this.
+void du_leave(Walk *w, WalkDir *d)
+{
+	Du *du = w->ctx;
+	DuDir *dd = d->data;
+	DuTextList text = {NULL, NULL};
+	uint64_t total = atomic_load(&dd->total);
+
+	if (!du->summarize) {
+		OutBuf run = {NULL, 0, 0};
+
+		for (size_t i = 0; i < d->list.count; i++) {
+			if (d->sub[i]) { // long since freed; only its output is left
+				du_text_add(&text, &run);
+				du_text_splice(&text, &dd->subs[i]);
+			}
+			else if (du->all && dd->sizes[i] != DU_COUNTED && (du->max_depth < 0 || d->depth < du->max_depth)) {
+				char *path = path_join(d->path, d->list.entries[i].name);
+				du_format(du, dd->sizes[i], path, &run);
+				free(path);
+			}
+		}
+		if (du->max_depth < 0 || d->depth <= du->max_depth)
+			du_format(du, total, d->path, &run);
+		du_text_add(&text, &run);
+		free(run.data);
+	}
+	free(dd->sizes);
+	free(dd->subs);
+	dd->sizes = NULL;
+	dd->subs = NULL;
+	if (d->parent) {
+		DuDir *pd = d->parent->data;
+		if (pd->subs)
+			pd->subs[dd->index] = text;
+		atomic_fetch_add(&pd->total, total);
+		free(dd);
+	}
+	else {
+		dd->text = text; // for the caller
+	}
+}
+
+// du -h: three significant figures at most, rounded up, as du(1) does
+void du_human(char *buf, size_t size, uint64_t bytes)
+{
+	const char *units = "KMGTPE";
+	double v = bytes;
+	int u = -1;
+
+	if (bytes < 1024) {
+		snprintf(buf, size, "%llu", (unsigned long long)bytes);
+		return;
+	}
+	while (v >= 1024 && u < 5) {
+		v /= 1024;
+		u++;
+	}
+	if (v < 10 && ceil(v * 10) < 100) {
+		snprintf(buf, size, "%.1f%c", ceil(v * 10) / 10, units[u]);
+		return;
+	}
+	v = ceil(v);
+	if (v >= 1024 && u < 5) {
+		snprintf(buf, size, "1.0%c", units[u + 1]);
+		return;
+	}
+	snprintf(buf, size, "%.0f%c", v, units[u]);
+}
+
+void du_format(Du *du, uint64_t bytes, const char *path, OutBuf *b)
+{
+	char num[32];
+
+	if (du->human)
+		du_human(num, sizeof(num), bytes);
+	else if (du->bytes)
+		snprintf(num, sizeof(num), "%llu", (unsigned long long)bytes);
+	else
+		snprintf(num, sizeof(num), "%llu", (unsigned long long)((bytes + 1023) / 1024));
+	outbuf_append(b, num, strlen(num));
+	outbuf_append(b, "\t", 1);
+	outbuf_append(b, path, strlen(path));
+	outbuf_append(b, "\n", 1);
+}
+
+int lsh_du(char **args)
+{
+	static char *dot[] = {".", NULL};
+	Du du;
+	Walk w;
+	char **paths = NULL;
+	int npaths = 0, total = 0;
+	uint64_t grand = 0;
+	struct {
+		WalkDir *dir;
+		DuDir *data;
+		uint64_t size;  // for a root that is not a directory
+		int ok;
+	} *roots;
+
+	memset(&du, 0, sizeof(du));
+	du.max_depth = -1;
+	for (int i = 1; args[i]; i++) {
+		if (args[i][0] != '-' || !args[i][1]) {
+			paths = realloc(paths, (npaths + 1) * sizeof(char *));
+			if (!paths) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+			paths[npaths++] = args[i];
+			continue;
+		}
+		for (const char *c = args[i] + 1; *c; c++) {
+			if (*c == 's')
+				du.summarize = 1;
+			else if (*c == 'a')
+				du.all = 1;
+			else if (*c == 'h')
+				du.human = 1;
+			else if (*c == 'c')
+				total = 1;
+			else if (*c == 'b')
+				du.bytes = 1;
+			else if (*c == 'k')
+				du.bytes = du.human = 0;
+			else if (*c == 'd' && !c[1] && args[i + 1] && isdigit((unsigned char)args[i + 1][0]))
+				du.max_depth = atoi(args[++i]);
+			else {
+				fprintf(stderr, "lsh: du: usage: du [-sahcbk] [-d depth] [path...]\n");
+				free(paths);
+				return 2;
+			}
+		}
+	}
+	if (du.summarize && du.all) {
+		fprintf(stderr, "lsh: du: cannot both summarize and show all entries\n");
+		free(paths);
+		return 2;
+	}
+	if (du.summarize)
+		du.max_depth = 0;
+	du.mask = (du.bytes ? STATX_SIZE : STATX_BLOCKS) | STATX_NLINK | STATX_INO;
+	for (int i = 0; i < DU_SHARDS; i++)
+		pthread_mutex_init(&du.shards[i].lock, NULL);
+	if (npaths == 0) {
+		free(paths);
+		paths = dot;
+		npaths = 1;
+	}
+
+	walk_init(&w);
+	w.flags = DL_HIDDEN;
+	w.filter = du_filter;
+	w.visit = du_visit;
+	w.leave = du_leave;
+	w.ctx = &du;
+	roots = calloc(npaths, sizeof(*roots));
+	if (!roots) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	// Roots that are symlinks are counted as links, not followed
+	for (int i = 0; i < npaths; i++) {
+		struct statx stx;
+
+		if (statx(AT_FDCWD, paths[i], AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, du.mask | STATX_TYPE, &stx) < 0) {
+			du_error(&du, "access", paths[i], errno);
+			continue;
+		}
+		roots[i].ok = 1;
+		if (S_ISDIR(stx.stx_mode)) {
+			roots[i].dir = walk_add(&w, paths[i], -1);
+			roots[i].data = du_dir(roots[i].dir);
+			if (roots[i].dir->err) { // never walked, so count it here
+				du_visit(&w, roots[i].dir);
+				du_leave(&w, roots[i].dir);
+			}
+		}
+		else {
+			roots[i].size = du_size(&du, &stx, 0);
+		}
+	}
+
+	fflush(stdout);
+	walk_start(&w);
+	for (int i = 0; i < npaths; i++) {
+		if (!roots[i].ok)
+			continue;
+		if (!roots[i].dir) {
+			if (roots[i].size == DU_COUNTED)
+				continue;
+			du_format(&du, roots[i].size, paths[i], &du.out);
+			grand += roots[i].size;
+			continue;
+		}
+		walk_wait(&w, roots[i].dir, 1);
+		grand += atomic_load(&roots[i].data->total);
+		if (du.summarize)
+			du_format(&du, atomic_load(&roots[i].data->total), paths[i], &du.out);
+		for (DuText *t = roots[i].data->text.head, *next; t; t = next) {
+			next = t->next;
+			outbuf_write(&du.out, STDOUT_FILENO, t->data, t->len);
+			free(t);
+		}
+		free(roots[i].data);
+	}
+	walk_end(&w);
+	if (total)
+		du_format(&du, grand, "total", &du.out);
+	outbuf_flush(&du.out, STDOUT_FILENO);
+
+	for (int i = 0; i < DU_SHARDS; i++) {
+		pthread_mutex_destroy(&du.shards[i].lock);
+		free(du.shards[i].slots);
+	}
+	free(roots);
+	if (paths != dot)
+		free(paths);
+	return atomic_load(&du.failed) ? 1 : 0;
+}
+
+
+/* io_uring, set up by hand rather than through liburing: just enough to
+ * batch path operations whose results are only looked at once the whole
+ * batch is done. A ring belongs to one thread. uring_init() fails cleanly
+ * where io_uring is missing or disabled, and callers then fall back to
+ * plain system calls.
+ */
+
+typedef struct {
+	int fd;
+	unsigned entries;
+	unsigned tail;          // our copy of the submission tail
+	unsigned queued;        // filled in, not yet submitted
+	unsigned inflight;      // submitted, not yet completed
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *ring;
+	size_t ring_size;
+	size_t sqes_size;
+} Uring;
+
+int uring_init(Uring *u, unsigned entries)
+{
+	struct io_uring_params p;
+	char *ring;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(SYS_io_uring_setup, entries, &p);
+	if (u->fd < 0)
+		return -1;
+	// One mapping for both rings: Linux 5.4 and later
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		close(u->fd);
+		return -1;
+	}
+	u->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > u->ring_size)
+		u->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+		if (u->ring != MAP_FAILED)
+			munmap(u->ring, u->ring_size);
+		if (u->sqes != MAP_FAILED)
+			munmap(u->sqes, u->sqes_size);
+		close(u->fd);
+		return -1;
+	}
+	ring = u->ring;
+	u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(ring + p.sq_off.array);
+	u->cq_head = (unsigned *)(ring + p.cq_off.head);
+	u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+	u->entries = p.sq_entries;
+	u->tail = *u->sq_tail;
+	return 0;
+}
+
+void uring_free(Uring *u)
+{
+	munmap(u->ring, u->ring_size);
+	munmap(u->sqes, u->sqes_size);
+	close(u->fd);
+}
+
+// The next submission to fill in, or NULL when the ring is full and
+// uring_run() has to make room first
+struct io_uring_sqe *uring_sqe(Uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned i;
+
+	if (u->queued + u->inflight == u->entries)
+		return NULL;
+	i = u->tail & *u->sq_mask;
+	sqe = &u->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[i] = i;
+	u->tail++;
+	u->queued++;
+	return sqe;
+}
+
+// Submit what is queued and wait for all of it, passing each completion
+// to done(). A completion queue twice the size of the submission queue
+// (the kernel's default) can't overflow, as no more than entries are ever
+// in flight.
+int uring_run(Uring *u, void (*done)(void *arg, uint64_t data, int res), void *arg)
+{
+	__atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+	while (u->queued + u->inflight > 0) {
+		long n = syscall(SYS_io_uring_enter, u->fd, u->queued, u->queued + u->inflight, IORING_ENTER_GETEVENTS, NULL, 0);
+		unsigned head, tail;
+
+		if (n < 0 && errno != EINTR)
+			return -1;
+		if (n > 0) {
+			u->queued -= n;
+			u->inflight += n;
+		}
+		head = *u->cq_head;
+		tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+			done(arg, cqe->user_data, cqe->res);
+			u->inflight--;
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+
+/* rm [-rRf] [--io-uring] path...
+ *
+ * Without -r, one unlinkat() per path. With -r, directories are removed
+ * on the parallel walker, so separate subtrees are emptied at once. The
+ * worker reading a directory unlinks its files relative to the
+ * directory's fd as it goes, with no path lookups, and the directory
+ * itself goes in leave(), once everything below it is gone, relative to
+ * its parent's fd.
+ *
+ * With --io-uring, each worker queues a directory's unlinks on a ring of
+ * its own and submits them RM_BATCH at a time: one system call for the
+ * batch instead of one per file. It is not the default because the kernel
+ * runs unlinkat requests on its io-wq threads rather than inline, and the
+ * hand-off costs more than the system calls saved unless there are cores
+ * to spare for those threads.
+ */
+
+#define RM_BATCH 256
+
+typedef struct {
+	const char *cmd;                     // for messages: "rm", or "mv" removing what it copied
+	int force;
+	int uring;                           // batch unlinks on io_uring
+	atomic_int failed;
+	Uring *rings[PARALLEL_MAX_THREADS];  // per worker, set up on first use
+	char no_ring[PARALLEL_MAX_THREADS];  // and not tried again if that failed
+} Rm;
+
+// Report that dir/name (or just name) could not be removed
+void rm_error(Rm *rm, const char *dir, const char *name, int err)
+{
+	char *path = dir ? path_join(dir, name) : NULL;
+
+	if (!rm->force || err != ENOENT) {
+		fprintf(stderr, "lsh: %s: cannot remove '%s': %s\n", rm->cmd, path ? path : name, strerror(err));
+		atomic_store(&rm->failed, 1);
+	}
+	free(path);
+}
+
+typedef struct {
+	Rm *rm;
+	WalkDir *d;
+} RmBatch;
+
+// An unlink queued by rm_filter() is done; data is the name within d
+void rm_done(void *arg, uint64_t data, int res)
+{
+	RmBatch *b = arg;
+
+	if (res < 0)
+		rm_error(b->rm, b->d->path, (const char *)(uintptr_t)data, -res);
+}
+
+Uring *rm_ring(Rm *rm, int worker)
+{
+	if (rm->uring && !rm->rings[worker] && !rm->no_ring[worker]) {
+		Uring *u = malloc(sizeof(Uring));
+		if (u && uring_init(u, RM_BATCH) == 0) {
+			rm->rings[worker] = u;
+		}
+		else {
+			free(u);
+			rm->no_ring[worker] = 1;
+		}
+	}
+	return rm->rings[worker];
+}
+
+// Submit d's queued unlinks and wait for them. If the ring itself fails,
+// whatever is left over surfaces when d's rmdir finds it not empty.
+void rm_flush(Rm *rm, Uring *u, WalkDir *d)
+{
+	RmBatch b = {rm, d};
+
+	if (uring_run(u, rm_done, &b) < 0) {
+		fprintf(stderr, "lsh: %s: io_uring: %s\n", rm->cmd, strerror(errno));
+		atomic_store(&rm->failed, 1);
+	}
+}
+
+int rm_filter(Walk *w, WalkDir *d, DirEntry *e)
+{
+	Rm *rm = w->ctx;
+	Uring *u;
+	struct io_uring_sqe *sqe;
+
+	if (e->type == DT_DIR)
+		return WALK_KEEP;
+	if (!(u = rm_ring(rm, d->worker))) {
+		if (unlinkat(d->fd, e->name, 0) < 0)
+			rm_error(rm, d->path, e->name, errno);
+		return WALK_DROP;
+	}
+	if (!(sqe = uring_sqe(u))) {
+		rm_flush(rm, u, d);
+		sqe = uring_sqe(u);
+	}
+	sqe->opcode = IORING_OP_UNLINKAT;
+	sqe->fd = d->fd;
+	sqe->addr = (uintptr_t)e->name; // dropped entries' names live as long as d
+	sqe->user_data = (uintptr_t)e->name;
+	return WALK_DROP;
+}
+
+void rm_visit(Walk *w, WalkDir *d)
+{
+	Rm *rm = w->ctx;
+
+	if (rm->rings[d->worker])
+		rm_flush(rm, rm->rings[d->worker], d);
+	if (d->err) {
+		fprintf(stderr, "lsh: %s: cannot read directory '%s': %s\n", rm->cmd, d->path, strerror(d->err));
+		atomic_store(&rm->failed, 1);
+	}
+}
+
+// Everything below d is gone, so d can go
+void rm_leave(Walk *w, WalkDir *d)
+{
+	Rm *rm = w->ctx;
+
+	if (unlinkat(d->parent ? d->parent->fd : AT_FDCWD, d->parent ? d->name : d->path, AT_REMOVEDIR) < 0) {
+		// Not empty because something below failed: that is reported already
+		if (errno != ENOTEMPTY || !atomic_load(&rm->failed))
+			rm_error(rm, NULL, d->path, errno);
+	}
+}
+
+int lsh_rm(char **args)
+{
+	Rm rm;
+	Walk w;
+	int recursive = 0, i;
+	struct stat root;
+
+	memset(&rm, 0, sizeof(rm));
+	rm.cmd = "rm";
+	for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		if (strcmp(args[i], "--io-uring") == 0) {
+			rm.uring = 1;
+			continue;
+		}
+		for (const char *c = args[i] + 1; *c; c++) {
+			if (*c == 'r' || *c == 'R') {
+				recursive = 1;
+			}
+			else if (*c == 'f') {
+				rm.force = 1;
+			}
+			else {
+				fprintf(stderr, "lsh: rm: usage: rm [-rRf] [--io-uring] path...\n");
+				return 2;
+			}
+		}
+	}
+	if (!args[i]) {
+		if (rm.force)
+			return 0;
+		fprintf(stderr, "lsh: rm: missing operand\n");
+		return 1;
+	}
+
+	walk_init(&w);
+	w.flags = DL_HIDDEN;
+	w.filter = rm_filter;
+	w.visit = rm_visit;
+	w.leave = rm_leave;
+	w.ctx = &rm;
+	if (lstat("/", &root) < 0)
+		memset(&root, 0, sizeof(root));
+	for (; args[i]; i++) {
+		const char *path = args[i];
+		size_t len = strlen(path);
+		struct stat st;
+
+		while (len > 1 && path[len - 1] == '/')
+			len--;
+		// The last component, as with rm(1), ignoring trailing slashes
+		const char *base = path + len;
+		while (base > path && base[-1] != '/')
+			base--;
+		if ((path + len - base == 1 && base[0] == '.') || (path + len - base == 2 && base[0] == '.' && base[1] == '.')) {
+			fprintf(stderr, "lsh: rm: refusing to remove '.' or '..' directory: skipping '%s'\n", path);
+			atomic_store(&rm.failed, 1);
+			continue;
+		}
+		if (!recursive || lstat(path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+			if (unlinkat(AT_FDCWD, path, 0) < 0)
+				rm_error(&rm, NULL, path, errno);
+			continue;
+		}
+		if (st.st_dev == root.st_dev && st.st_ino == root.st_ino) {
+			fprintf(stderr, "lsh: rm: it is dangerous to operate recursively on '%s'\n", path);
+			atomic_store(&rm.failed, 1);
+			continue;
+		}
+		WalkDir *d = walk_add(&w, path, -1);
+		if (d->err)
+			rm_error(&rm, NULL, path, d->err);
+	}
+	walk_start(&w);
+	walk_end(&w);
+
+	for (i = 0; i < PARALLEL_MAX_THREADS; i++) {
+		if (rm.rings[i]) {
+			uring_free(rm.rings[i]);
+			free(rm.rings[i]);
+		}
+	}
+	return atomic_load(&rm.failed) ? 1 : 0;
+}
+
+
+/* touch [-acm] [-d date] [-r file] [--io-uring] file...
+ *
+ * Sets times with a single utimensat() per file: no open, no stdio. Only
+ * the files that turn out not to exist are then created, with
+ * openat(O_CREAT), which gives them the current time, or the requested
+ * one through futimens(). -d takes "@seconds", "now", or a local
+ * "YYYY-MM-DD[ HH:MM[:SS]]" (a "T" may replace the space).
+ *
+ * With --io-uring the creations go through io_uring instead, TOUCH_BATCH
+ * at a time: all the opens in one submission, then all the closes in
+ * another. There is no io_uring operation for utimensat() itself.
+ */
+
+#define TOUCH_BATCH 256
+
+typedef struct {
+	struct timespec times[2];   // atime, mtime: UTIME_NOW, UTIME_OMIT or a time
+	int explicit_time;          // -d or -r: new files need futimens() too
+	int failed;
+	char **files;
+	int *fds;
+} Touch;
+
+int touch_parse_date(const char *s, struct timespec *ts)
+{
+	static const char *formats[] = {"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M", "%Y-%m-%d"};
+	char *end;
+
+	if (strcmp(s, "now") == 0)
+		return clock_gettime(CLOCK_REALTIME, ts);
+	if (s[0] == '@') {
+		double secs = strtod(s + 1, &end);
+		if (end == s + 1 || *end)
+			return -1;
+		ts->tv_sec = (time_t)floor(secs);
+		ts->tv_nsec = (long)((secs - floor(secs)) * 1e9);
+		return 0;
+	}
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		struct tm tm;
+
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(s, formats[i], &tm);
+		if (end && !*end) {
+			tm.tm_isdst = -1;
+			ts->tv_sec = mktime(&tm);
+			ts->tv_nsec = 0;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+void touch_error(Touch *t, const char *file, int err)
+{
+	fprintf(stderr, "lsh: touch: cannot touch '%s': %s\n", file, strerror(err));
+	t->failed = 1;
+}
+
+// A new file's fd, still open: give it the requested times
+void touch_created(Touch *t, const char *file, int fd)
+{
+	if (t->explicit_time && futimens(fd, t->times) < 0)
+		touch_error(t, file, errno);
+}
+
+void touch_opened(void *arg, uint64_t data, int res)
+{
+	Touch *t = arg;
+
+	t->fds[data] = res;
+	if (res < 0)
+		touch_error(t, t->files[data], -res);
+	else
+		touch_created(t, t->files[data], res);
+}
+
+void touch_closed(void *arg, uint64_t data, int res)
+{
+	Touch *t = arg;
+
+	if (res < 0)
+		touch_error(t, t->files[data], -res);
+}
+
+// Create files[0..n) on the ring: the opens, then the closes
+int touch_create_uring(Touch *t, Uring *u, int n)
+{
+	for (int i = 0; i < n; i++) {
+		struct io_uring_sqe *sqe = uring_sqe(u);
+
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)t->files[i];
+		sqe->len = 0666; // the mode
+		sqe->open_flags = O_WRONLY | O_CREAT | O_NOCTTY | O_NONBLOCK | O_CLOEXEC;
+		sqe->user_data = i;
+	}
+	if (uring_run(u, touch_opened, t) < 0)
+		return -1;
+	for (int i = 0; i < n; i++) {
+		struct io_uring_sqe *sqe;
+
+		if (t->fds[i] < 0)
+			continue;
+		sqe = uring_sqe(u);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = t->fds[i];
+		sqe->user_data = i;
+	}
+	return uring_run(u, touch_closed, t);
+}
+
+int lsh_touch(char **args)
+{
+	Touch t;
+	Uring ring;
+	int use_uring = 0, no_create = 0, only_a = 0, only_m = 0;
+	int i, nmissing = 0;
+	char **missing;
+	const char *date = NULL, *ref = NULL;
+
+	memset(&t, 0, sizeof(t));
+	for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		if (strcmp(args[i], "--io-uring") == 0) {
+			use_uring = 1;
+			continue;
+		}
+		for (const char *c = args[i] + 1; *c; c++) {
+			if (*c == 'a')
+				only_a = 1;
+			else if (*c == 'm')
+				only_m = 1;
+			else if (*c == 'c')
+				no_create = 1;
+			else if ((*c == 'd' || *c == 'r') && !c[1] && args[i + 1])
+				*(*c == 'd' ? &date : &ref) = args[++i];
+			else {
+				fprintf(stderr, "lsh: touch: usage: touch [-acm] [-d date] [-r file] [--io-uring] file...\n");
+				return 2;
+			}
+		}
+	}
+	if (!args[i]) {
+		fprintf(stderr, "lsh: touch: missing file operand\n");
+		return 1;
+	}
+
+	t.times[0].tv_nsec = t.times[1].tv_nsec = UTIME_NOW;
+	if (ref) {
+		struct stat st;
+		if (stat(ref, &st) < 0) {
+			fprintf(stderr, "lsh: touch: failed to get attributes of '%s': %s\n", ref, strerror(errno));
+			return 1;
+		}
+		t.times[0] = st.st_atim;
+		t.times[1] = st.st_mtim;
+		t.explicit_time = 1;
+	}
+	if (date) {
+		if (touch_parse_date(date, &t.times[0]) < 0) {
+			fprintf(stderr, "lsh: touch: invalid date format '%s'\n", date);
+			return 1;
+		}
+		t.times[1] = t.times[0];
+		t.explicit_time = 1;
+	}
+	// -a alone leaves mtime, -m alone atime
+	if (only_a && !only_m)
+		t.times[1].tv_nsec = UTIME_OMIT;
+	if (only_m && !only_a)
+		t.times[0].tv_nsec = UTIME_OMIT;
+
+	// Existing files: one system call each. The rest are gathered to be
+	// created below.
+	for (nmissing = 0; args[i + nmissing]; nmissing++)
+		;
+	missing = malloc((nmissing + 1) * sizeof(char *));
+	if (!missing) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (nmissing = 0; args[i]; i++) {
+		if (utimensat(AT_FDCWD, args[i], t.times, 0) == 0)
+			continue;
+		if (errno != ENOENT)
+			touch_error(&t, args[i], errno);
+		else if (!no_create)
+			missing[nmissing++] = args[i];
+	}
+
+	if (nmissing > 0 && use_uring && uring_init(&ring, TOUCH_BATCH) == 0) {
+		t.fds = malloc(TOUCH_BATCH * sizeof(int));
+		if (!t.fds) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		for (int done = 0; done < nmissing; done += TOUCH_BATCH) {
+			int n = nmissing - done < TOUCH_BATCH ? nmissing - done : TOUCH_BATCH;
+			t.files = missing + done;
+			if (touch_create_uring(&t, &ring, n) < 0) {
+				fprintf(stderr, "lsh: touch: io_uring: %s\n", strerror(errno));
+				t.failed = 1;
+				break;
+			}
+		}
+		free(t.fds);
+		uring_free(&ring);
+		nmissing = 0;
+	}
+	for (i = 0; i < nmissing; i++) {
+		int fd = openat(AT_FDCWD, missing[i], O_WRONLY | O_CREAT | O_NOCTTY | O_NONBLOCK | O_CLOEXEC, 0666);
+		if (fd < 0) {
+			touch_error(&t, missing[i], errno);
+			continue;
+		}
+		touch_created(&t, missing[i], fd);
+		close(fd);
+	}
+	free(missing);
+	return t.failed;
+}
+
+
+/* cp [-rRpn] source... dest
+ *
+ * A file's data is copied the cheapest way its filesystems allow: an
+ * FICLONE reflink first (btrfs, XFS: the copy shares the extents and no
+ * data moves), then copy_file_range(), which keeps the data in the kernel
+ * and may hand the copy to the storage, and last pread()/pwrite() through
+ * a buffer of up to CP_BUFSIZE. A file with fewer blocks than its size
+ * is copied one data extent at a time, found with SEEK_DATA and
+ * SEEK_HOLE, so the copy stays sparse. Extents of CP_PARALLEL_MIN or more
+ * are split into CP_CHUNK pieces for parallel_for(); every piece is
+ * copied at explicit offsets, so the threads share the two fds.
+ *
+ * With -r, directories are copied on the parallel walker. The worker
+ * reading a source directory creates its copy and copies the files in it
+ * relative to the two directory fds as it goes; leave() gives the copy
+ * its final mode (and with -p, owner and times) once everything below it
+ * is written. Symbolic links found on the way are copied as links.
+ */
+
+#define CP_BUFSIZE (1024 * 1024)
+#define CP_CHUNK (16 * 1024 * 1024)
+#define CP_PARALLEL_MIN (64 * 1024 * 1024)
+
+typedef struct {
+	int recursive;      // -r
+	int preserve;       // -p: mode, owner and times
+	int no_clobber;     // -n
+	mode_t umask;
+	atomic_int failed;
+} Cp;
+
+// Something to copy from or to: name relative to dir, which is only
+// there for messages when dir_path is set
+typedef struct {
+	int dir;
+	const char *dir_path;
+	const char *name;
+} CpPath;
+
+// The copy of a directory, as WalkDir.data
+typedef struct {
+	int fd;
+	char *path;
+	struct stat st;     // the source's
+	int created;        // not there before: set its mode in leave()
+} CpDir;
+
+typedef struct {
+	int in;
+	int out;
+	off_t off;
+	atomic_int err;
+} CpRange;
+
+void cp_error(Cp *cp, const char *what, CpPath *p, int err)
+{
+	char *path = p->dir_path ? path_join(p->dir_path, p->name) : NULL;
+
+	fprintf(stderr, "lsh: cp: %s '%s': %s\n", what, path ? path : p->name, strerror(err));
+	atomic_store(&cp->failed, 1);
+	free(path);
+}
+
+// Copy [off, off + len) of in to the same offsets of out; 0 or an errno
+int cp_range(int in, int out, off_t off, off_t len)
+{
+	loff_t in_off = off, out_off = off;
+	char *buf;
+
+	while (len > 0) {
+		ssize_t n = copy_file_range(in, &in_off, out, &out_off, len < (1 << 30) ? len : (1 << 30), 0);
+		if (n == 0)
+			return 0; // the file shrank
+		if (n > 0) {
+			len -= n;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		// Not between these two files: copy through user space
+		if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+			return errno;
+		break;
+	}
+	if (len <= 0)
+		return 0;
+
+	size_t size = len < (off_t)CP_BUFSIZE ? (size_t)len : CP_BUFSIZE;
+	buf = malloc(size);
+	if (!buf) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	while (len > 0) {
+		ssize_t n = pread(in, buf, len < (off_t)size ? (size_t)len : size, in_off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			free(buf);
+			return n < 0 ? errno : 0;
+		}
+		for (ssize_t w = 0; w < n; ) {
+			ssize_t m = pwrite(out, buf + w, n - w, out_off + w);
+			if (m < 0 && errno != EINTR) {
+				free(buf);
+				return errno;
+			}
+			if (m > 0)
+				w += m;
+		}
+		in_off += n;
+		out_off += n;
+		len -= n;
+	}
+	free(buf);
+	return 0;
+}
+
+void cp_chunk(void *ctx, size_t begin, size_t end)
+{
+	CpRange *r = ctx;
+	int err = cp_range(r->in, r->out, r->off + begin, end - begin);
+
+	if (err)
+		atomic_store(&r->err, err);
+}
+
+// cp_range(), split over threads when the range is big enough to pay
+int cp_extent(int in, int out, off_t off, off_t len)
+{
+	CpRange r;
+
+	if (len < CP_PARALLEL_MIN)
+		return cp_range(in, out, off, len);
+	r.in = in;
+	r.out = out;
+	r.off = off;
+	atomic_init(&r.err, 0);
+	parallel_for(len, CP_CHUNK, cp_chunk, &r);
+	return atomic_load(&r.err);
+}
+
+// Copy the data of in, described by st, into the empty file out
+int cp_data(int in, int out, struct stat *st)
+{
+	off_t data, hole;
+	int err;
+
+	if (st->st_size == 0 || ioctl(out, FICLONE, in) == 0)
+		return 0;
+	if ((off_t)st->st_blocks * 512 >= st->st_size)
+		return cp_extent(in, out, 0, st->st_size);
+
+	// Sparse: only the data extents, then the size for a trailing hole
+	for (data = 0; data < st->st_size; data = hole) {
+		data = lseek(in, data, SEEK_DATA);
+		if (data < 0 && errno == ENXIO)
+			break;
+		if (data < 0 && errno == EINVAL) // no SEEK_DATA here
+			return cp_extent(in, out, 0, st->st_size);
+		if (data < 0 || (hole = lseek(in, data, SEEK_HOLE)) < 0)
+			return errno;
+		if ((err = cp_extent(in, out, data, hole - data)) != 0)
+			return err;
+	}
+	return ftruncate(out, st->st_size) < 0 ? errno : 0;
+}
+
+// -p for a file already open as fd
+void cp_preserve(Cp *cp, int fd, struct stat *st, CpPath *dst)
+{
+	struct timespec times[2] = {st->st_atim, st->st_mtim};
+	mode_t mode = st->st_mode & 07777;
+
+	// Without the owner, set-id bits would be granted to someone else
+	if (fchown(fd, st->st_uid, st->st_gid) < 0)
+		mode &= ~(S_ISUID | S_ISGID);
+	if (fchmod(fd, mode) < 0)
+		cp_error(cp, "preserving permissions for", dst, errno);
+	if (futimens(fd, times) < 0)
+		cp_error(cp, "preserving times for", dst, errno);
+}
+
+void cp_file(Cp *cp, CpPath *src, CpPath *dst)
+{
+	struct stat st, dst_st;
+	int in, out, err;
+
+	in = openat(src->dir, src->name, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+	if (in < 0 || fstat(in, &st) < 0) {
+		cp_error(cp, "cannot open", src, errno);
+		if (in >= 0)
+			close(in);
+		return;
+	}
+	// A new file needs no truncating and can't be the source
+	out = openat(dst->dir, dst->name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+	if (out < 0 && errno == EEXIST) {
+		if (cp->no_clobber) {
+			close(in);
+			return;
+		}
+		out = openat(dst->dir, dst->name, O_WRONLY | O_NOCTTY | O_CLOEXEC);
+		if (out >= 0 && fstat(out, &dst_st) == 0 && dst_st.st_dev == st.st_dev && dst_st.st_ino == st.st_ino) {
+			char *path = src->dir_path ? path_join(src->dir_path, src->name) : NULL;
+			fprintf(stderr, "lsh: cp: '%s' and '%s' are the same file\n", path ? path : src->name, dst->name);
+			atomic_store(&cp->failed, 1);
+			free(path);
+			close(out);
+			close(in);
+			return;
+		}
+		if (out >= 0 && ftruncate(out, 0) < 0) {
+			close(out);
+			out = -1;
+		}
+	}
+	if (out < 0) {
+		cp_error(cp, "cannot create regular file", dst, errno);
+		close(in);
+		return;
+	}
+
+	if ((err = cp_data(in, out, &st)) != 0)
+		cp_error(cp, "error copying to", dst, err);
+	if (cp->preserve)
+		cp_preserve(cp, out, &st, dst);
+	if (close(out) < 0)
+		cp_error(cp, "error writing", dst, errno);
+	close(in);
+}
+
+// Symbolic links are copied as links, other special files remade with
+// mknodat(); either replaces whatever non-directory is in the way
+void cp_special(Cp *cp, CpPath *src, CpPath *dst, unsigned char type)
+{
+	struct stat st;
+	char target[PATH_MAX];
+	ssize_t len = 0;
+	int r;
+
+	if (fstatat(src->dir, src->name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+		cp_error(cp, "cannot stat", src, errno);
+		return;
+	}
+	if (type == DT_LNK) {
+		if ((len = readlinkat(src->dir, src->name, target, sizeof(target) - 1)) < 0) {
+			cp_error(cp, "cannot read symbolic link", src, errno);
+			return;
+		}
+		target[len] = '\0';
+	}
+	for (int tries = 0; tries < 2; tries++) {
+		if (type == DT_LNK)
+			r = symlinkat(target, dst->dir, dst->name);
+		else
+			r = mknodat(dst->dir, dst->name, st.st_mode & (S_IFMT | 07777), st.st_rdev);
+		if (r == 0 || errno != EEXIST || cp->no_clobber || unlinkat(dst->dir, dst->name, 0) < 0)
+			break;
+	}
+	if (r < 0) {
+		if (errno != EEXIST || !cp->no_clobber)
+			cp_error(cp, type == DT_LNK ? "cannot create symbolic link" : "cannot create special file", dst, errno);
+		return;
+	}
+	if (cp->preserve) {
+		struct timespec times[2] = {st.st_atim, st.st_mtim};
+		if (fchownat(dst->dir, dst->name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) < 0 && type != DT_LNK)
+			fchmodat(dst->dir, dst->name, st.st_mode & 0777, 0);
+		if (utimensat(dst->dir, dst->name, times, AT_SYMLINK_NOFOLLOW) < 0)
+			cp_error(cp, "preserving times for", dst, errno);
+	}
+}
+
+// Make the copy of a directory, or take the one already there
+void cp_mkdir(Cp *cp, int dir, const char *name, CpDir *cd)
+{
+	CpPath p = {AT_FDCWD, NULL, cd->path};
+
+	// Writable for us until leave() sets the real mode
+	if (mkdirat(dir, name, (cd->st.st_mode & 07777) | S_IRWXU) == 0)
+		cd->created = 1;
+	else if (errno != EEXIST) {
+		cp_error(cp, "cannot create directory", &p, errno);
+		return;
+	}
+	cd->fd = openat(dir, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (cd->fd < 0)
+		cp_error(cp, "cannot open directory", &p, errno);
+}
+
+// d's copy, made on the first entry (or in visit(), if there is none)
+CpDir *cp_dir(Walk *w, WalkDir *d)
+{
+	Cp *cp = w->ctx;
+	CpDir *parent, *cd;
+
+	if (d->data)
+		return d->data;
+	parent = d->parent->data;
+	cd = calloc(1, sizeof(CpDir));
+	if (!cd) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	cd->fd = -1;
+	cd->path = path_join(parent->path, d->name);
+	d->data = cd;
+	if (parent->fd < 0 || d->fd < 0)
+		return cd;
+	if (fstat(d->fd, &cd->st) < 0) {
+		CpPath p = {AT_FDCWD, NULL, d->path};
+		cp_error(cp, "cannot stat", &p, errno);
+		return cd;
+	}
+	cp_mkdir(cp, parent->fd, d->name, cd);
+	return cd;
+}
+
+int cp_filter(Walk *w, WalkDir *d, DirEntry *e)
+{
+	Cp *cp = w->ctx;
+	CpDir *cd = cp_dir(w, d);
+	CpPath src = {d->fd, d->path, e->name};
+	CpPath dst = {cd->fd, cd->path, e->name};
+
+	if (cd->fd < 0)
+		return WALK_DROP;
+	if (e->type == DT_DIR)
+		return WALK_KEEP;
+	if (e->type == DT_REG)
+		cp_file(cp, &src, &dst);
+	else
+		cp_special(cp, &src, &dst, e->type);
+	return WALK_DROP;
+}
+
+void cp_visit(Walk *w, WalkDir *d)
+{
+	Cp *cp = w->ctx;
+
+	cp_dir(w, d);
+	if (d->err) {
+		fprintf(stderr, "lsh: cp: cannot access '%s': %s\n", d->path, strerror(d->err));
+		atomic_store(&cp->failed, 1);
+	}
+}
+
+void cp_leave(Walk *w, WalkDir *d)
+{
+	Cp *cp = w->ctx;
+	CpDir *cd = d->data;
+	CpPath p;
+
+	if (!cd)
+		return;
+	p.dir = AT_FDCWD;
+	p.dir_path = NULL;
+	p.name = cd->path;
+	// Without -p, a directory we made gets the source's mode less the
+	// umask, which only differs from mkdirat()'s if it lacked u+rwx
+	if (cd->fd >= 0 && cp->preserve)
+		cp_preserve(cp, cd->fd, &cd->st, &p);
+	else if (cd->fd >= 0 && cd->created && (cd->st.st_mode & S_IRWXU) != S_IRWXU
+	         && fchmod(cd->fd, cd->st.st_mode & 07777 & ~cp->umask) < 0)
+		cp_error(cp, "setting permissions for", &p, errno);
+	if (cd->fd >= 0)
+		close(cd->fd);
+	free(cd->path);
+	free(cd);
+	d->data = NULL;
+}
+
+// The last component of path, ignoring trailing slashes
+char *cp_basename(const char *path)
+{
+	size_t len = strlen(path);
+	const char *base;
+	char *s;
+
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+	for (base = path + len; base > path && base[-1] != '/'; base--)
+		;
+	s = strndup(base, path + len - base);
+	if (!s) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	return s;
+}
+
+// Would copying directory src to dst put the copy inside src?
+int cp_into_itself(const char *src, const char *dst)
+{
+	char src_real[PATH_MAX], dst_real[PATH_MAX];
+	char *parent = strdup(dst);
+	size_t len;
+	int ok;
+
+	if (!parent) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	// realpath() of dst's directory, as dst itself need not exist yet
+	len = strlen(parent);
+	while (len > 1 && parent[len - 1] == '/')
+		len--;
+	while (len > 0 && parent[len - 1] != '/')
+		len--;
+	parent[len] = '\0';
+	ok = realpath(src, src_real) && realpath(len ? parent : ".", dst_real);
+	free(parent);
+	if (!ok)
+		return 0;
+	len = strlen(src_real);
+	return strncmp(src_real, dst_real, len) == 0 && (dst_real[len] == '/' || dst_real[len] == '\0' || len == 1);
+}
+
+// Copy src to exactly dst: files right away, directories by adding
+// them to the walk
+void cp_path(Cp *cp, Walk *w, const char *src, const char *dst)
+{
+	CpPath s = {AT_FDCWD, NULL, src};
+	CpPath t = {AT_FDCWD, NULL, dst};
+	struct stat st;
+	CpDir *cd;
+	WalkDir *d;
+
+	// -r copies symbolic links as links, even on the command line
+	if ((cp->recursive ? lstat(src, &st) : stat(src, &st)) < 0) {
+		cp_error(cp, "cannot stat", &s, errno);
+		return;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		if (S_ISREG(st.st_mode) || !cp->recursive)
+			cp_file(cp, &s, &t);
+		else
+			cp_special(cp, &s, &t, mode_to_dtype(st.st_mode));
+		return;
+	}
+	if (!cp->recursive) {
+		fprintf(stderr, "lsh: cp: -r not specified; omitting directory '%s'\n", src);
+		atomic_store(&cp->failed, 1);
+		return;
+	}
+	if (cp_into_itself(src, dst)) {
+		fprintf(stderr, "lsh: cp: cannot copy a directory, '%s', into itself, '%s'\n", src, dst);
+		atomic_store(&cp->failed, 1);
+		return;
+	}
+
+	cd = calloc(1, sizeof(CpDir));
+	if (!cd) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	cd->fd = -1;
+	cd->path = strdup(dst);
+	cd->st = st;
+	cp_mkdir(cp, AT_FDCWD, dst, cd);
+	d = cd->fd >= 0 ? walk_add(w, src, -1) : NULL;
+	if (d && !d->err) {
+		d->data = cd;
+		return;
+	}
+	if (d)
+		cp_error(cp, "cannot access", &s, d->err);
+	if (cd->fd >= 0)
+		close(cd->fd);
+	free(cd->path);
+	free(cd);
+}
+
+int lsh_cp(char **args)
+{
+	Cp cp;
+	Walk w;
+	struct stat st;
+	int i, n, into_dir;
+	const char *dest;
+
+	memset(&cp, 0, sizeof(cp));
+	for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		for (const char *c = args[i] + 1; *c; c++) {
+			if (*c == 'r' || *c == 'R')
+				cp.recursive = 1;
+			else if (*c == 'p')
+				cp.preserve = 1;
+			else if (*c == 'n')
+				cp.no_clobber = 1;
+			else {
+				fprintf(stderr, "lsh: cp: usage: cp [-rRpn] source... dest\n");
+				return 2;
+			}
+		}
+	}
+	for (n = 0; args[i + n]; n++)
+		;
+	if (n < 2) {
+		if (n == 0)
+			fprintf(stderr, "lsh: cp: missing file operand\n");
+		else
+			fprintf(stderr, "lsh: cp: missing destination file operand after '%s'\n", args[i]);
+		return 1;
+	}
+	dest = args[i + n - 1];
+	into_dir = stat(dest, &st) == 0 && S_ISDIR(st.st_mode);
+	if (n > 2 && !into_dir) {
+		fprintf(stderr, "lsh: cp: target '%s' is not a directory\n", dest);
+		return 1;
+	}
+
+	cp.umask = umask(0);
+	umask(cp.umask);
+	walk_init(&w);
+	w.flags = DL_HIDDEN;
+	w.filter = cp_filter;
+	w.visit = cp_visit;
+	w.leave = cp_leave;
+	w.ctx = &cp;
+	for (; args[i + 1]; i++) {
+		if (into_dir) {
+			char *base = cp_basename(args[i]);
+			char *target = path_join(dest, base);
+			cp_path(&cp, &w, args[i], target);
+			free(target);
+			free(base);
+		}
+		else {
+			cp_path(&cp, &w, args[i], dest);
+		}
+	}
+	walk_start(&w);
+	walk_end(&w);
+	return atomic_load(&cp.failed) ? 1 : 0;
+}
+
+
+/* mkdir [-p] [-m mode] dir...
+ *
+ * With -p, a path is made one component at a time: mkdirat() relative to
+ * an O_PATH fd on the component before it, so no prefix is looked up
+ * twice. The fds of the last path's components are kept for the next
+ * operand, which starts from the deepest one they share: "mkdir -p a/b/c a/b/d" opens a/b once and makes
+ * d right in it. Nothing is kept between commands, where another process
+ * may have moved things.
+ */
+
+typedef struct {
+	mode_t mode;        // for the last component
+	int explicit_mode;  // -m: set it even where the umask would not
+	int failed;
+	char **names;       // the components made or found for the last path
+	int *fds;
+	int depth;
+	int cap;
+} Mkdir;
+
+// Make the last component of name in dir with m's mode
+int mkdir_last(Mkdir *m, int dir, const char *name)
+{
+	if (mkdirat(dir, name, m->mode) < 0)
+		return -1;
+	if (m->explicit_mode && fchmodat(dir, name, m->mode, 0) < 0)
+		return -1;
+	return 0;
+}
+
+// The fd on component j of the last path, opened when first needed: the
+// last component is only opened if the next path goes on below it
+int mkdir_fd(Mkdir *m, int j)
+{
+	if (m->fds[j] < 0)
+		m->fds[j] = openat(j > 0 ? m->fds[j - 1] : AT_FDCWD, m->names[j], O_PATH | O_DIRECTORY | O_CLOEXEC);
+	return m->fds[j];
+}
+
+void mkdir_error(Mkdir *m, const char *path, int len, int err)
+{
+	fprintf(stderr, "lsh: mkdir: cannot create directory '%.*s': %s\n", len, path, strerror(err));
+	m->failed = 1;
+}
+
+void mkdir_parents(Mkdir *m, const char *path)
+{
+	char *copy = strdup(path);
+	char **comps;
+	int *ends;      // where each component ends in path, for messages
+	int n = 0, k;
+	char *c;
+
+	comps = malloc((strlen(path) / 2 + 2) * sizeof(char *));
+	ends = malloc((strlen(path) / 2 + 2) * sizeof(int));
+	if (!copy || !comps || !ends) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	// "/" is a component of its own, made (or rather, found) from AT_FDCWD
+	if (path[0] == '/') {
+		comps[n] = "/";
+		ends[n++] = 1;
+	}
+	for (c = strtok(copy, "/"); c; c = strtok(NULL, "/")) {
+		comps[n] = c;
+		ends[n++] = c - copy + strlen(c);
+	}
+
+	for (k = 0; k < m->depth && k < n && strcmp(m->names[k], comps[k]) == 0; k++)
+		;
+	for (int j = k; j < m->depth; j++) {
+		if (m->fds[j] >= 0)
+			close(m->fds[j]);
+		free(m->names[j]);
+	}
+	m->depth = k;
+	if (n > m->cap) {
+		m->cap = n;
+		m->names = realloc(m->names, n * sizeof(char *));
+		m->fds = realloc(m->fds, n * sizeof(int));
+		if (!m->names || !m->fds) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (; k < n; k++) {
+		int dir = k > 0 ? mkdir_fd(m, k - 1) : AT_FDCWD;
+		int r;
+
+		if (dir == -1) {
+			mkdir_error(m, path, ends[k - 1], errno == ENOTDIR ? EEXIST : errno);
+			break;
+		}
+		r = k == n - 1 ? mkdir_last(m, dir, comps[k]) : mkdirat(dir, comps[k], 0777);
+		if (r < 0 && errno != EEXIST) {
+			mkdir_error(m, path, ends[k], errno);
+			break;
+		}
+		// An existing non-directory in the middle shows up as ENOTDIR
+		// from mkdir_fd(); the last component has to be checked here
+		if (r < 0 && k == n - 1) {
+			struct stat st;
+
+			if (fstatat(dir, comps[k], &st, 0) < 0 || !S_ISDIR(st.st_mode)) {
+				mkdir_error(m, path, ends[k], EEXIST);
+				break;
+			}
+		}
+		if (!(m->names[m->depth] = strdup(comps[k]))) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		m->fds[m->depth++] = -1;
+	}
+	free(ends);
+	free(comps);
+	free(copy);
+}
+
+int lsh_mkdir(char **args)
+{
+	Mkdir m;
+	int parents = 0, i;
+
+	memset(&m, 0, sizeof(m));
+	m.mode = 0777;
+	for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		for (const char *c = args[i] + 1; *c; c++) {
+			char *end;
+
+			if (*c == 'p') {
+				parents = 1;
+			}
+			else if (*c == 'm' && !c[1] && args[i + 1]) {
+				m.mode = strtol(args[++i], &end, 8) & 07777;
+				m.explicit_mode = 1;
+				if (*end || end == args[i]) {
+					fprintf(stderr, "lsh: mkdir: invalid mode '%s'\n", args[i]);
+					return 1;
+				}
+				break;
+			}
+			else {
+				fprintf(stderr, "lsh: mkdir: usage: mkdir [-p] [-m mode] dir...\n");
+				return 2;
+			}
+		}
+	}
+	if (!args[i]) {
+		fprintf(stderr, "lsh: mkdir: missing operand\n");
+		return 1;
+	}
+	for (; args[i]; i++) {
+		if (parents)
+			mkdir_parents(&m, args[i]);
+		else if (mkdir_last(&m, AT_FDCWD, args[i]) < 0)
+			mkdir_error(&m, args[i], strlen(args[i]), errno);
+	}
+	for (i = 0; i < m.depth; i++) {
+		if (m.fds[i] >= 0)
+			close(m.fds[i]);
+		free(m.names[i]);
+	}
+	free(m.names);
+	free(m.fds);
+	return m.failed;
+}
+
+
+/* mv [-fn] source... dest
+ *
+ * One renameat2() per source. -n passes RENAME_NOREPLACE, so an existing
+ * target is left alone without a stat() beforehand that could race with
+ * its creation. When the source is on another filesystem (EXDEV), it is
+ * copied with the cp engine as cp -rp would, and only if everything
+ * copied is it then removed, directories on the walker as rm -r does.
+ */
+
+// Remove src after it was copied elsewhere
+void mv_remove(const char *src, int *failed)
+{
+	struct stat st;
+	Rm rm;
+	Walk w;
+
+	if (lstat(src, &st) == 0 && !S_ISDIR(st.st_mode)) {
+		if (unlink(src) < 0) {
+			fprintf(stderr, "lsh: mv: cannot remove '%s': %s\n", src, strerror(errno));
+			*failed = 1;
+		}
+		return;
+	}
+	memset(&rm, 0, sizeof(rm));
+	rm.cmd = "mv";
+	walk_init(&w);
+	w.flags = DL_HIDDEN;
+	w.filter = rm_filter;
+	w.visit = rm_visit;
+	w.leave = rm_leave;
+	w.ctx = &rm;
+	if (walk_add(&w, src, -1)->err)
+		rm_error(&rm, NULL, src, w.roots[0]->err);
+	walk_start(&w);
+	walk_end(&w);
+	if (atomic_load(&rm.failed))
+		*failed = 1;
+}
+
+// Copy src to dst and remove it, for a rename across filesystems
+void mv_copy(const char *src, const char *dst, int no_clobber, int *failed)
+{
+	Cp cp;
+	Walk w;
+
+	memset(&cp, 0, sizeof(cp));
+	cp.recursive = 1;
+	cp.preserve = 1;
+	cp.no_clobber = no_clobber;
+	walk_init(&w);
+	w.flags = DL_HIDDEN;
+	w.filter = cp_filter;
+	w.visit = cp_visit;
+	w.leave = cp_leave;
+	w.ctx = &cp;
+	cp_path(&cp, &w, src, dst);
+	walk_start(&w);
+	walk_end(&w);
+	if (atomic_load(&cp.failed))
+		*failed = 1;
+	else
+		mv_remove(src, failed);
+}
+
+void mv_one(const char *src, const char *dst, int no_clobber, int *failed)
+{
+	int r = renameat2(AT_FDCWD, src, AT_FDCWD, dst, no_clobber ? RENAME_NOREPLACE : 0);
+
+	// Filesystems without RENAME_NOREPLACE: check, then rename
+	if (r < 0 && errno == EINVAL && no_clobber) {
+		if (faccessat(AT_FDCWD, dst, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+			return;
+		r = renameat(AT_FDCWD, src, AT_FDCWD, dst);
+	}
+	if (r == 0 || (errno == EEXIST && no_clobber))
+		return;
+	if (errno == EXDEV) {
+		// renameat2() reports EXDEV before it looks at dst, and the
+		// copy would skip an existing dst and then remove src anyway
+		if (no_clobber && faccessat(AT_FDCWD, dst, F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+			return;
+		mv_copy(src, dst, no_clobber, failed);
+		return;
+	}
+	if (errno == EINVAL)
+		fprintf(stderr, "lsh: mv: cannot move '%s' to a subdirectory of itself, '%s'\n", src, dst);
+	else
+		fprintf(stderr, "lsh: mv: cannot move '%s' to '%s': %s\n", src, dst, strerror(errno));
+	*failed = 1;
+}
+
+int lsh_mv(char **args)
+{
+	struct stat st;
+	int no_clobber = 0, failed = 0, i, n, into_dir;
+	const char *dest;
+
+	for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		for (const char *c = args[i] + 1; *c; c++) {
+			if (*c == 'n') {
+				no_clobber = 1;
+			}
+			else if (*c == 'f') {
+				no_clobber = 0; // there are no prompts to skip
+			}
+			else {
+				fprintf(stderr, "lsh: mv: usage: mv [-fn] source... dest\n");
+				return 2;
+			}
+		}
+	}
+	for (n = 0; args[i + n]; n++)
+		;
+	if (n < 2) {
+		if (n == 0)
+			fprintf(stderr, "lsh: mv: missing file operand\n");
+		else
+			fprintf(stderr, "lsh: mv: missing destination file operand after '%s'\n", args[i]);
+		return 1;
+	}
+	dest = args[i + n - 1];
+	into_dir = stat(dest, &st) == 0 && S_ISDIR(st.st_mode);
+	if (n > 2 && !into_dir) {
+		fprintf(stderr, "lsh: mv: target '%s' is not a directory\n", dest);
+		return 1;
+	}
+	for (; args[i + 1]; i++) {
+		if (into_dir) {
+			char *base = cp_basename(args[i]);
+			char *target = path_join(dest, base);
+			mv_one(args[i], target, no_clobber, &failed);
+			free(target);
+			free(base);
+		}
+		else {
+			mv_one(args[i], dest, no_clobber, &failed);
+		}
+	}
+	return failed;
+}
+
+
+/* ln [-sf] target... [dest]
+ *
+ * A linkat(), or with -s a symlinkat(), per target, named as cp names
+ * its copies: inside dest when that is a directory (or in the current
+ * directory when there is no dest), else dest itself. -f first removes
+ * whatever already has the name.
+ */
+
+void ln_one(const char *target, const char *name, int symbolic, int force, int *failed)
+{
+	for (int tries = 0; tries < 2; tries++) {
+		int r = symbolic ? symlinkat(target, AT_FDCWD, name) : linkat(AT_FDCWD, target, AT_FDCWD, name, 0);
+		if (r == 0)
+			return;
+		if (errno != EEXIST || !force || tries > 0 || unlink(name) < 0)
+			break;
+	}
+	if (symbolic)
+		fprintf(stderr, "lsh: ln: failed to create symbolic link '%s': %s\n", name, strerror(errno));
+	else
+		fprintf(stderr, "lsh: ln: failed to create hard link '%s' => '%s': %s\n", name, target, strerror(errno));
+	*failed = 1;
+}
+
+int lsh_ln(char **args)
+{
+	struct stat st;
+	int symbolic = 0, force = 0, failed = 0, i, n;
+	const char *dest;
+
+	for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		for (const char *c = args[i] + 1; *c; c++) {
+			if (*c == 's') {
+				symbolic = 1;
+			}
+			else if (*c == 'f') {
+				force = 1;
+			}
+			else {
+				fprintf(stderr, "lsh: ln: usage: ln [-sf] target... [dest]\n");
+				return 2;
+			}
+		}
+	}
+	for (n = 0; args[i + n]; n++)
+		;
+	if (n == 0) {
+		fprintf(stderr, "lsh: ln: missing file operand\n");
+		return 1;
+	}
+	if (n == 1) {
+		dest = ".";
+	}
+	else {
+		dest = args[i + n - 1];
+		n--;
+	}
+	if (!(stat(dest, &st) == 0 && S_ISDIR(st.st_mode))) {
+		if (n > 1) {
+			fprintf(stderr, "lsh: ln: target '%s' is not a directory\n", dest);
+			return 1;
+		}
+		ln_one(args[i], dest, symbolic, force, &failed);
+		return failed;
+	}
+	for (; n > 0; n--, i++) {
+		char *base = cp_basename(args[i]);
+		char *name = path_join(dest, base);
+		ln_one(args[i], name, symbolic, force, &failed);
+		free(name);
+		free(base);
+	}
+	return failed;
+}
+
+
+/* Byte scanning for the text builtins. memcount() counts one byte value
+ * 32 bytes at a time with AVX2 where the CPU has it, else 16 at a time
+ * with SSE2 (always there on x86-64), else a byte at a time: a compare
+ * gives a bit per matching byte through movemask, and a popcount adds
+ * them up. The AVX2 code is compiled with a target attribute and chosen
+ * at run time, so the binary still runs on CPUs without it.
+ */
+
+#ifdef __x86_64__
+__attribute__((target("avx2,popcnt")))
+size_t memcount_avx2(const unsigned char *p, size_t n, unsigned char c, size_t *done)
+{
+	const __m256i needle = _mm256_set1_epi8((char)c);
+	size_t count = 0, i = 0;
+
+	for (; i + 128 <= n; i += 128) {
+		uint64_t a = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), needle));
+		uint64_t b = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 32)), needle));
+		uint64_t d = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 64)), needle));
+		uint64_t e = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 96)), needle));
+		count += __builtin_popcountll(a | b << 32) + __builtin_popcountll(d | e << 32);
+	}
+	for (; i + 32 <= n; i += 32)
+		count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), needle)));
+	*done = i;
+	return count;
+}
+
+size_t memcount_sse2(const unsigned char *p, size_t n, unsigned char c, size_t *done)
+{
+	const __m128i needle = _mm_set1_epi8((char)c);
+	size_t count = 0, i = 0;
+
+	for (; i + 16 <= n; i += 16)
+		count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), needle)));
+	*done = i;
+	return count;
+}
+#endif
+
+// How many bytes of p[0..n) are c
+size_t memcount(const void *s, size_t n, int c)
+{
+	const unsigned char *p = s;
+	size_t count = 0, i = 0;
+
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("avx2"))
+		count = memcount_avx2(p, n, c, &i);
+	else
+		count = memcount_sse2(p, n, c, &i);
+#endif
+	for (; i < n; i++)
+		count += p[i] == (unsigned char)c;
+	return count;
+}
+
+
+/* wc [-lwcm] [file...]
+ *
+ * Lines are counted with memcount(). Words are counted from a whitespace
+ * mask built the same way, a bit per byte: a word starts at every
+ * non-space byte whose predecessor is a space, that is ~ws & (ws << 1),
+ * with the last bit of one block carried into the next. -m counts UTF-8
+ * characters, the bytes that are not continuation bytes. Whitespace is
+ * the C locale's (space and \t\n\v\f\r), as everywhere in the shell.
+ *
+ * Files are read WC_BUFSIZE at a time. -c alone on a regular file is
+ * answered by fstat() without reading anything. A regular file of
+ * WC_PARALLEL_MIN or more is split into WC_CHUNK pieces counted on
+ * parallel_for()'s threads with pread(); a word that straddles two pieces
+ * is counted by both, and taken off again when the pieces are added up.
+ */
+
+#define WC_BUFSIZE (256 * 1024)
+#define WC_CHUNK (16 * 1024 * 1024)
+#define WC_PARALLEL_MIN (64 * 1024 * 1024)
+
+#define WC_LINES 1
+#define WC_WORDS 2
+#define WC_CHARS 4
+#define WC_BYTES 8
+
+typedef struct {
+	uint64_t lines;
+	uint64_t words;
+	uint64_t chars;
+	uint64_t bytes;
+	int in_word;        // the last byte counted was not whitespace
+	int starts_in_word; // the first one was not, for joining chunks
+	int err;
+} WcCounts;
+
+typedef struct {
+	int fd;
+	off_t start;
+	int want;
+	WcCounts *chunks;   // one per WC_CHUNK
+} WcParallel;
+
+static inline int wc_space(unsigned char b)
+{
+	return b == ' ' || (unsigned char)(b - '\t') <= '\r' - '\t';
+}
+
+#ifdef __x86_64__
+// Words and characters over whole 32-byte blocks; returns the bytes done
+__attribute__((target("avx2,popcnt")))
+size_t wc_words_avx2(WcCounts *c, const unsigned char *p, size_t n, int want)
+{
+	const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+	const __m256i range = _mm256_set1_epi8('\r' - '\t'), top = _mm256_set1_epi8((char)0xc0), cont = _mm256_set1_epi8((char)0x80);
+	uint32_t carry = !c->in_word;   // was the byte before a space?
+	uint64_t words = 0, chars = 0;
+	size_t i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		if (want & WC_WORDS) {
+			__m256i t = _mm256_sub_epi8(v, tab);
+			__m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(_mm256_min_epu8(t, range), t));
+			uint32_t m = _mm256_movemask_epi8(ws);
+			words += __builtin_popcount(~m & (m << 1 | carry));
+			carry = m >> 31;
+		}
+		if (want & WC_CHARS)
+			chars += 32 - __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v, top), cont)));
+	}
+	if (want & WC_WORDS)
+		c->in_word = !carry;
+	c->words += words;
+	c->chars += chars;
+	return i;
+}
+
+size_t wc_words_sse2(WcCounts *c, const unsigned char *p, size_t n, int want)
+{
+	const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+	const __m128i range = _mm_set1_epi8('\r' - '\t'), top = _mm_set1_epi8((char)0xc0), cont = _mm_set1_epi8((char)0x80);
+	uint32_t carry = !c->in_word;
+	uint64_t words = 0, chars = 0;
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		if (want & WC_WORDS) {
+			__m128i t = _mm_sub_epi8(v, tab);
+			__m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(_mm_min_epu8(t, range), t));
+			uint32_t m = _mm_movemask_epi8(ws);
+			words += __builtin_popcount(~m & (m << 1 | carry) & 0xffff);
+			carry = m >> 15;
+		}
+		if (want & WC_CHARS)
+			chars += 16 - __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, top), cont)));
+	}
+	if (want & WC_WORDS)
+		c->in_word = !carry;
+	c->words += words;
+	c->chars += chars;
+	return i;
+}
+#endif
+
+void wc_count(WcCounts *c, const unsigned char *p, size_t n, int want)
+{
+	size_t i = 0;
+
+	c->bytes += n;
+	if (want & WC_LINES)
+		c->lines += memcount(p, n, '\n');
+	if (!(want & (WC_WORDS | WC_CHARS)))
+		return;
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("avx2"))
+		i = wc_words_avx2(c, p, n, want);
+	else
+		i = wc_words_sse2(c, p, n, want);
+#endif
+	for (; i < n; i++) {
+		int space = wc_space(p[i]);
+		c->words += !space && !c->in_word;
+		c->in_word = !space;
+		c->chars += (p[i] & 0xc0) != 0x80;
+	}
+}
+
+// Count [start + begin, start + end) of the file, as one chunk
+void wc_chunk(void *ctx, size_t begin, size_t end)
+{
+	WcParallel *wp = ctx;
+	WcCounts *c = &wp->chunks[begin / WC_CHUNK];
+	unsigned char *buf = malloc(WC_BUFSIZE);
+
+	if (!buf) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t off = begin; off < end; ) {
+		size_t want = end - off < WC_BUFSIZE ? end - off : WC_BUFSIZE;
+		ssize_t n = pread(wp->fd, buf, want, wp->start + off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			c->err = n < 0 ? errno : 0;
+			break;
+		}
+		if (off == begin)
+			c->starts_in_word = !wc_space(buf[0]);
+		wc_count(c, buf, n, wp->want);
+		off += n;
+	}
+	free(buf);
+}
+
+// Count what is left of fd from its offset on
+int wc_fd(int fd, WcCounts *c, int want)
+{
+	struct stat st;
+	off_t pos = -1;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+		pos = lseek(fd, 0, SEEK_CUR);
+	if (pos >= 0 && st.st_size - pos >= 0 && !(want & ~WC_BYTES)) {
+		c->bytes = st.st_size - pos;
+		return 0;
+	}
+
+	if (pos >= 0 && st.st_size - pos >= WC_PARALLEL_MIN) {
+		size_t len = st.st_size - pos, n = (len + WC_CHUNK - 1) / WC_CHUNK;
+		WcParallel wp = {fd, pos, want, calloc(n, sizeof(WcCounts))};
+
+		if (!wp.chunks) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		parallel_for(len, WC_CHUNK, wc_chunk, &wp);
+		for (size_t i = 0; i < n; i++) {
+			WcCounts *k = &wp.chunks[i];
+			if (k->err && !c->err)
+				c->err = k->err;
+			c->lines += k->lines;
+			c->words += k->words - (c->in_word && k->starts_in_word);
+			c->chars += k->chars;
+			c->bytes += k->bytes;
+			if (k->bytes)
+				c->in_word = k->in_word;
+		}
+		free(wp.chunks);
+		if (c->err)
+			return -1;
+		// The file may have grown while we counted: read the rest as a stream
+		lseek(fd, pos + c->bytes, SEEK_SET);
+	}
+
+	unsigned char *buf = malloc(WC_BUFSIZE);
+	if (!buf) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (;;) {
+		ssize_t n = read(fd, buf, WC_BUFSIZE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n < 0)
+				c->err = errno;
+			break;
+		}
+		wc_count(c, buf, n, want);
+	}
+	free(buf);
+	return c->err ? -1 : 0;
+}
+
+void wc_print(WcCounts *c, int want, int width, const char *name)
+{
+	uint64_t values[] = {c->lines, c->words, c->chars, c->bytes};
+	int first = 1;
+
+	for (int i = 0; i < 4; i++) {
+		if (!(want & (1 << i)))
+			continue;
+		printf(first ? "%*llu" : " %*llu", width, (unsigned long long)values[i]);
+		first = 0;
+	}
+	if (name)
+		printf(" %s", name);
+	printf("\n");
+}
+
+int lsh_wc(char **args)
+{
+	WcCounts total;
+	int want = 0, i, nfiles, width = 1, min_width = 1, ret = 0, ncounters = 0;
+	uint64_t regular = 0;
+
+	for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		for (const char *c = args[i] + 1; *c; c++) {
+			if (*c == 'l')
+				want |= WC_LINES;
+			else if (*c == 'w')
+				want |= WC_WORDS;
+			else if (*c == 'm')
+				want |= WC_CHARS;
+			else if (*c == 'c')
+				want |= WC_BYTES;
+			else {
+				fprintf(stderr, "lsh: wc: usage: wc [-lwcm] [file...]\n");
+				return 2;
+			}
+		}
+	}
+	if (!want)
+		want = WC_LINES | WC_WORDS | WC_BYTES;
+	for (int k = 0; k < 4; k++)
+		ncounters += !!(want & (1 << k));
+	for (nfiles = 0; args[i + nfiles]; nfiles++)
+		;
+
+	// Columns as wide as the total size of the regular files, like GNU
+	// wc, or 7 with anything else among them; a lone count is not padded
+	if (nfiles > 1 || ncounters > 1) {
+		for (int k = 0; k < (nfiles ? nfiles : 1); k++) {
+			struct stat st;
+			int r = nfiles ? stat(args[i + k], &st) : fstat(STDIN_FILENO, &st);
+			if (r == 0 && S_ISREG(st.st_mode))
+				regular += st.st_size;
+			else if (r == 0)
+				min_width = 7;
+		}
+		for (; regular >= 10; regular /= 10)
+			width++;
+		if (width < min_width)
+			width = min_width;
+	}
+
+	fflush(stdout);
+	memset(&total, 0, sizeof(total));
+	if (nfiles == 0) {
+		WcCounts c;
+		memset(&c, 0, sizeof(c));
+		if (wc_fd(STDIN_FILENO, &c, want) < 0) {
+			fprintf(stderr, "lsh: wc: standard input: %s\n", strerror(c.err));
+			ret = 1;
+		}
+		wc_print(&c, want, width, NULL);
+		return ret;
+	}
+	for (; args[i]; i++) {
+		WcCounts c;
+		int fd = open(args[i], O_RDONLY | O_CLOEXEC);
+
+		memset(&c, 0, sizeof(c));
+		if (fd < 0) {
+			fprintf(stderr, "lsh: wc: %s: %s\n", args[i], strerror(errno));
+			ret = 1;
+			continue;
+		}
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		if (wc_fd(fd, &c, want) < 0) {
+			fprintf(stderr, "lsh: wc: %s: %s\n", args[i], strerror(c.err));
+			ret = 1;
+		}
+		close(fd);
+		wc_print(&c, want, width, args[i]);
+		total.lines += c.lines;
+		total.words += c.words;
+		total.chars += c.chars;
+		total.bytes += c.bytes;
+	}
+	if (nfiles > 1)
+		wc_print(&total, want, width, "total");
+	return ret;
+}
+
+
+/* sort [-nru] [-t char] [-k key]... [-S size] [file...]
+ *
+ * An external merge sort. Input is read into a run buffer until the
+ * memory budget (-S, SORT_DEFAULT_MEM by default) is used up. Each line
+ * then gets a SortLine saying where its first key is, along with the
+ * key's first eight bytes, or for -n its value as an order-preserving
+ * integer: most comparisons are one integer compare on a compact array
+ * and never touch the text. A run is cut into a slice per CPU whose keys
+ * are extracted and sorted on parallel_for()'s threads, and a loser tree
+ * merges the slices. When all the input fit in one run the merge writes
+ * straight to stdout; otherwise every run is written to an unlinked temp
+ * file under $TMPDIR, and the runs are merged by the same loser tree,
+ * SORT_MERGE_MAX at a time.
+ *
+ * Keys are POSIX ones, -k F[.C][,F[.C]][nr], on fields split at each -t
+ * character or else where blanks end (leading blanks are part of the
+ * field). Lines whose keys are equal are ordered by their bytes, except
+ * with -u, which prints only the first line of each run of equal keys.
+ */
+
+#define SORT_DEFAULT_MEM ((size_t)256 * 1024 * 1024)
+#define SORT_MIN_MEM ((size_t)1024 * 1024)
+#define SORT_MERGE_MAX 64
+#define SORT_SLICE_MIN 4096       // lines worth a thread of their own
+#define SORT_READ_MIN (64 * 1024) // smallest buffer per run being merged
+#define SORT_INSERTION 16
+
+typedef struct {
+	size_t sfield, schar; // start at character schar of field sfield
+	size_t efield, echar; // end after character echar of field efield; efield 0 for the end of the line, echar 0 for the end of the field
+	int numeric;
+	int reverse;
+	int flags;            // n or r given on the key, so -n/-r don't apply
+} SortKey;
+
+typedef struct {
+	uint64_t prefix;      // first key's leading bytes, or its value for -n
+	const char *line;
+	uint32_t len;         // without the newline
+	uint32_t koff;        // first key is line[koff, koff + klen)
+	uint32_t klen;
+} SortLine;
+
+typedef struct {
+	SortKey *keys;
+	int nkeys;
+	int tab;              // -t, or -1 for blank-separated fields
+	int unique;
+	int numeric;
+	int reverse;
+	size_t mem;
+	const char *tmpdir;
+} Sort;
+
+typedef struct {
+	Sort *s;
+	SortLine *lines;
+	SortLine *tmp;        // as many again, for merging
+} SortRun;
+
+// Where merged lines come from: a sorted slice in memory or a run file
+typedef struct {
+	SortLine cur;
+	int done;
+	SortLine *lines;
+	size_t pos, n;
+	int fd;               // -1 for a slice
+	char *buf;
+	size_t cap, start, end;
+	int eof;
+	int err;
+} SortSource;
+
+typedef struct {
+	Sort *s;
+	SortSource *src;
+	int k;
+	int *tree;            // tree[0] is the winner, tree[1..k) the losers
+} SortMerge;
+
+typedef struct {
+	int neg;
+	const char *i;        // integer digits, leading zeros dropped
+	size_t ilen;
+	const char *f;        // fraction digits, trailing zeros dropped
+	size_t flen;
+} SortNum;
+
+static inline int sort_blank(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+void sort_parse_number(const char *p, size_t n, SortNum *num)
+{
+	const char *end = p + n;
+
+	memset(num, 0, sizeof(*num));
+	while (p < end && sort_blank(*p))
+		p++;
+	if (p < end && *p == '-') {
+		num->neg = 1;
+		p++;
+	}
+	while (p < end && *p == '0')
+		p++;
+	num->i = p;
+	while (p < end && isdigit((unsigned char)*p))
+		p++;
+	num->ilen = p - num->i;
+	if (p < end && *p == '.') {
+		num->f = ++p;
+		while (p < end && isdigit((unsigned char)*p))
+			p++;
+		num->flen = p - num->f;
+		while (num->flen > 0 && num->f[num->flen - 1] == '0')
+			num->flen--;
+	}
+	if (num->ilen == 0 && num->flen == 0)
+		num->neg = 0; // -0 is 0
+}
+
+// Compare two -n keys exactly, digit by digit
+int sort_numcmp(const char *a, size_t an, const char *b, size_t bn)
+{
+	SortNum x, y;
+	int r;
+
+	sort_parse_number(a, an, &x);
+	sort_parse_number(b, bn, &y);
+	if (x.neg != y.neg)
+		return x.neg ? -1 : 1;
+	if (x.ilen != y.ilen)
+		r = x.ilen < y.ilen ? -1 : 1;
+	else if ((r = memcmp(x.i, y.i, x.ilen)) == 0) {
+		size_t n = x.flen < y.flen ? x.flen : y.flen;
+		if ((r = memcmp(x.f, y.f, n)) == 0)
+			r = (x.flen > y.flen) - (x.flen < y.flen);
+	}
+	return x.neg ? -r : r;
+}
+
+// An integer that orders like the key: its value for -n, else its first
+// 8 bytes. Equal prefixes need the full comparison.
+uint64_t sort_prefix(SortKey *k, const char *p, size_t n)
+{
+	uint64_t v = 0;
+
+	if (k->numeric) {
+		SortNum num;
+		char text[64];
+		double d;
+		size_t len = 0;
+
+		sort_parse_number(p, n, &num);
+		if (num.ilen > 40) {
+			d = num.neg ? -HUGE_VAL : HUGE_VAL;
+		}
+		else {
+			// Dropping fraction digits keeps the order (strtod() rounds
+			// monotonically), so a prefix never contradicts sort_numcmp()
+			size_t flen = num.flen < 20 ? num.flen : 20;
+			if (num.neg)
+				text[len++] = '-';
+			memcpy(text + len, num.i, num.ilen);
+			len += num.ilen;
+			text[len++] = '.';
+			memcpy(text + len, num.f, flen);
+			len += flen;
+			text[len] = '\0';
+			d = num.ilen || flen ? strtod(text, NULL) : 0;
+		}
+		if (d == 0)
+			d = 0; // not -0
+		memcpy(&v, &d, sizeof(v));
+		return v >> 63 ? ~v : v | 1ULL << 63;
+	}
+	for (size_t i = 0; i < 8; i++)
+		v = v << 8 | (i < n ? (unsigned char)p[i] : 0);
+	return v;
+}
+
+// Start of field f (1-based) of [p, end), or end when there are fewer
+const char *sort_field(Sort *s, const char *p, const char *end, size_t f)
+{
+	while (--f > 0 && p < end) {
+		if (s->tab >= 0) {
+			const char *t = memchr(p, s->tab, end - p);
+			p = t ? t + 1 : end;
+		}
+		else {
+			while (p < end && sort_blank(*p))
+				p++;
+			while (p < end && !sort_blank(*p))
+				p++;
+		}
+	}
+	return p;
+}
+
+void sort_key(Sort *s, SortKey *k, const char *line, size_t len, const char **key, size_t *klen)
+{
+	const char *end = line + len;
+	const char *b = sort_field(s, line, end, k->sfield), *e = end;
+
+	b = (size_t)(end - b) > k->schar - 1 ? b + k->schar - 1 : end;
+	if (k->efield) {
+		e = sort_field(s, line, end, k->efield);
+		if (k->echar) {
+			e = (size_t)(end - e) > k->echar ? e + k->echar : end;
+		}
+		else if (s->tab >= 0) {
+			const char *t = memchr(e, s->tab, end - e);
+			e = t ? t : end;
+		}
+		else {
+			while (e < end && sort_blank(*e))
+				e++;
+			while (e < end && !sort_blank(*e))
+				e++;
+		}
+	}
+	*key = b;
+	*klen = e > b ? e - b : 0;
+}
+
+void sort_fill(Sort *s, SortLine *l, const char *line, size_t len)
+{
+	const char *key;
+	size_t klen;
+
+	sort_key(s, &s->keys[0], line, len, &key, &klen);
+	l->line = line;
+	l->len = len;
+	l->koff = key - line;
+	l->klen = klen;
+	l->prefix = sort_prefix(&s->keys[0], key, klen);
+}
+
+int sort_compare_key(SortKey *k, const char *a, size_t an, const char *b, size_t bn)
+{
+	int r;
+
+	if (k->numeric) {
+		r = sort_numcmp(a, an, b, bn);
+	}
+	else {
+		r = memcmp(a, b, an < bn ? an : bn);
+		if (r == 0)
+			r = (an > bn) - (an < bn);
+	}
+	return k->reverse ? -r : r;
+}
+
+int sort_compare(Sort *s, const SortLine *a, const SortLine *b)
+{
+	int r;
+
+	if (a->prefix != b->prefix) {
+		r = a->prefix < b->prefix ? -1 : 1;
+		r = s->keys[0].reverse ? -r : r;
+	}
+	else {
+		r = sort_compare_key(&s->keys[0], a->line + a->koff, a->klen, b->line + b->koff, b->klen);
+	}
+	for (int i = 1; r == 0 && i < s->nkeys; i++) {
+		const char *ka, *kb;
+		size_t la, lb;
+		sort_key(s, &s->keys[i], a->line, a->len, &ka, &la);
+		sort_key(s, &s->keys[i], b->line, b->len, &kb, &lb);
+		r = sort_compare_key(&s->keys[i], ka, la, kb, lb);
+	}
+	if (r != 0 || s->unique)
+		return r;
+	// Last resort: the whole lines
+	r = memcmp(a->line, b->line, a->len < b->len ? a->len : b->len);
+	if (r == 0)
+		r = (a->len > b->len) - (a->len < b->len);
+	return s->reverse ? -r : r;
+}
+
+static inline int sort_before(Sort *s, const SortLine *a, const SortLine *b)
+{
+	// The prefix settles most comparisons without a call
+	if (a->prefix != b->prefix)
+		return (a->prefix < b->prefix) != s->keys[0].reverse;
+	return sort_compare(s, a, b) < 0;
+}
+
+// Stable merge sort of a[0, n) through tmp[0, n): insertion sort on
+// SORT_INSERTION lines at a time, then merges back and forth. SortLines
+// are copied by value, unlike qsort_r(), which moves them bytewise.
+void sort_lines(Sort *s, SortLine *a, SortLine *tmp, size_t n)
+{
+	SortLine *from = a, *to = tmp;
+
+	for (size_t b = 0; b < n; b += SORT_INSERTION) {
+		size_t e = b + SORT_INSERTION < n ? b + SORT_INSERTION : n;
+		for (size_t i = b + 1; i < e; i++) {
+			SortLine x = a[i];
+			size_t j = i;
+			for (; j > b && sort_before(s, &x, &a[j - 1]); j--)
+				a[j] = a[j - 1];
+			a[j] = x;
+		}
+	}
+	for (size_t width = SORT_INSERTION; width < n; width *= 2) {
+		for (size_t b = 0; b < n; b += 2 * width) {
+			size_t mid = b + width < n ? b + width : n;
+			size_t e = b + 2 * width < n ? b + 2 * width : n;
+			size_t i = b, j = mid, k = b;
+			while (i < mid && j < e)
+				to[k++] = sort_before(s, &from[j], &from[i]) ? from[j++] : from[i++];
+			while (i < mid)
+				to[k++] = from[i++];
+			while (j < e)
+				to[k++] = from[j++];
+		}
+		SortLine *t = from;
+		from = to;
+		to = t;
+	}
+	if (from != a)
+		memcpy(a, from, n * sizeof(SortLine));
+}
+
+// Extract keys and sort lines [begin, end), one slice of a run
+void sort_slice(void *ctx, size_t begin, size_t end)
+{
+	SortRun *run = ctx;
+
+	for (size_t i = begin; i < end; i++)
+		sort_fill(run->s, &run->lines[i], run->lines[i].line, run->lines[i].len);
+	sort_lines(run->s, run->lines + begin, run->tmp + begin, end - begin);
+}
+
+void sort_next(Sort *s, SortSource *src)
+{
+	if (src->fd < 0) {
+		if (src->pos < src->n)
+			src->cur = src->lines[src->pos++];
+		else
+			src->done = 1;
+		return;
+	}
+	for (;;) {
+		char *line = src->buf + src->start;
+		char *nl = memchr(line, '\n', src->end - src->start);
+		if (nl) {
+			sort_fill(s, &src->cur, line, nl - line);
+			src->start += nl - line + 1;
+			return;
+		}
+		if (src->eof) {
+			src->done = 1; // runs always end in a newline
+			return;
+		}
+		memmove(src->buf, line, src->end - src->start);
+		src->end -= src->start;
+		src->start = 0;
+		if (src->end == src->cap) {
+			src->cap *= 2;
+			src->buf = realloc(src->buf, src->cap);
+			if (!src->buf) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		ssize_t n = read(src->fd, src->buf + src->end, src->cap - src->end);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			src->err = errno;
+		if (n <= 0)
+			src->eof = 1;
+		else
+			src->end += n;
+	}
+}
+
+// Does source a come first? k is a source ahead of all others, used to
+// build the tree; finished sources come after everything.
+int sort_beats(SortMerge *m, int a, int b)
+{
+	int r;
+
+	if (a == m->k || b == m->k)
+		return a == m->k;
+	if (m->src[a].done)
+		return 0;
+	if (m->src[b].done)
+		return 1;
+	r = sort_compare(m->s, &m->src[a].cur, &m->src[b].cur);
+	return r < 0 || (r == 0 && a < b); // earlier sources hold earlier input
+}
+
+// Play source i's new line from its leaf up to the root: the winner of
+// each match goes on, the loser stays in the node
+void sort_adjust(SortMerge *m, int i)
+{
+	for (int t = (i + m->k) / 2; t > 0; t /= 2) {
+		if (sort_beats(m, m->tree[t], i)) {
+			int loser = i;
+			i = m->tree[t];
+			m->tree[t] = loser;
+		}
+	}
+	m->tree[0] = i;
+}
+
+// Merge k sorted sources into fd, dropping repeats for -u; -1 with errno
+// set when writing or reading a run fails
+int sort_merge(Sort *s, SortSource *src, int k, int fd)
+{
+	SortMerge m = {s, src, k, NULL};
+	OutBuf out = {0};
+	SortLine last;
+	char *last_buf = NULL;
+	size_t last_cap = 0;
+	int have_last = 0, ret = 0;
+
+	if (k == 0)
+		return 0;
+	m.tree = malloc(k * sizeof(int));
+	if (!m.tree) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < k; i++) {
+		m.tree[i] = k;
+		sort_next(s, &src[i]);
+	}
+	for (int i = k - 1; i >= 0; i--)
+		sort_adjust(&m, i);
+
+	while (!src[m.tree[0]].done) {
+		SortSource *w = &src[m.tree[0]];
+
+		if (!s->unique || !have_last || sort_compare(s, &last, &w->cur) != 0) {
+			outbuf_append(&out, w->cur.line, w->cur.len);
+			outbuf_append(&out, "\n", 1);
+			if (out.len >= OUTBUF_BLOCK) {
+				if (write_all(fd, out.data, out.len) < 0) {
+					ret = -1;
+					break;
+				}
+				out.len = 0;
+			}
+			if (s->unique) {
+				// The source may reuse its buffer; keep a copy to compare with
+				if (w->cur.len > last_cap) {
+					last_cap = w->cur.len * 2;
+					free(last_buf);
+					last_buf = malloc(last_cap);
+					if (!last_buf) {
+						fprintf(stderr, "lsh: allocation error\n");
+						exit(EXIT_FAILURE);
+					}
+				}
+				memcpy(last_buf, w->cur.line, w->cur.len);
+				last = w->cur;
+				last.line = last_buf;
+				have_last = 1;
+			}
+		}
+		sort_next(s, w);
+		sort_adjust(&m, m.tree[0]);
+	}
+	if (ret == 0 && write_all(fd, out.data, out.len) < 0)
+		ret = -1;
+	for (int i = 0; ret == 0 && i < k; i++) {
+		if (src[i].err) {
+			errno = src[i].err;
+			ret = -1;
+		}
+	}
+	free(out.data);
+	free(last_buf);
+	free(m.tree);
+	return ret;
+}
+
+// An unnamed file for a run, gone as soon as it is closed
+int sort_tempfile(Sort *s)
+{
+	int fd = open(s->tmpdir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+
+	if (fd < 0) {
+		// Filesystems without O_TMPFILE: create a name and unlink it
+		char *path = path_join(s->tmpdir, "lsh-sortXXXXXX");
+		fd = mkostemp(path, O_CLOEXEC);
+		if (fd >= 0)
+			unlink(path);
+		free(path);
+	}
+	if (fd < 0)
+		fprintf(stderr, "lsh: sort: cannot create temporary file in %s: %s\n", s->tmpdir, strerror(errno));
+	return fd;
+}
+
+// Sort one run of lines and merge its slices into fd
+int sort_run(Sort *s, SortLine *lines, size_t n, int fd)
+{
+	SortRun run = {s, lines, malloc((n ? n : 1) * sizeof(SortLine))};
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t chunk, nslices;
+	SortSource *src;
+	int ret;
+
+	if (!run.tmp) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	if (ncpu < 1)
+		ncpu = 1;
+	chunk = (n + ncpu - 1) / ncpu;
+	if (chunk < SORT_SLICE_MIN)
+		chunk = SORT_SLICE_MIN;
+	parallel_for(n, chunk, sort_slice, &run);
+	free(run.tmp);
+
+	nslices = (n + chunk - 1) / chunk;
+	src = calloc(nslices ? nslices : 1, sizeof(SortSource));
+	if (!src) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < nslices; i++) {
+		src[i].fd = -1;
+		src[i].lines = lines + i * chunk;
+		src[i].n = i + 1 < nslices ? chunk : n - i * chunk;
+	}
+	ret = sort_merge(s, src, nslices, fd);
+	free(src);
+	return ret;
+}
+
+// Merge the run files, SORT_MERGE_MAX at a time, until one is left to
+// merge to stdout. Runs are kept in input order so equal lines stay so.
+int sort_merge_runs(Sort *s, int *runs, int nruns)
+{
+	while (nruns > 0) {
+		int k = nruns < SORT_MERGE_MAX ? nruns : SORT_MERGE_MAX;
+		int out = k == nruns ? STDOUT_FILENO : sort_tempfile(s);
+		SortSource *src = calloc(k, sizeof(SortSource));
+		size_t cap = s->mem / (k + 1);
+		int ret;
+
+		if (!src) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		if (out < 0) {
+			for (int i = 0; i < nruns; i++)
+				close(runs[i]);
+			free(src);
+			return -1;
+		}
+		if (cap < SORT_READ_MIN)
+			cap = SORT_READ_MIN;
+		for (int i = 0; i < k; i++) {
+			src[i].fd = runs[i];
+			src[i].cap = cap;
+			src[i].buf = malloc(cap);
+			if (!src[i].buf) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+			lseek(runs[i], 0, SEEK_SET);
+			posix_fadvise(runs[i], 0, 0, POSIX_FADV_SEQUENTIAL);
+		}
+		ret = sort_merge(s, src, k, out);
+		if (ret < 0)
+			fprintf(stderr, "lsh: sort: %s: %s\n", out == STDOUT_FILENO ? "write error" : "temporary file", strerror(errno));
+		for (int i = 0; i < k; i++) {
+			free(src[i].buf);
+			close(runs[i]);
+		}
+		free(src);
+		if (out == STDOUT_FILENO || ret < 0) {
+			if (out != STDOUT_FILENO)
+				close(out);
+			for (int i = k; i < nruns; i++)
+				close(runs[i]);
+			return ret;
+		}
+		// The merged run stands where the first k were
+		runs[0] = out;
+		memmove(runs + 1, runs + k, (nruns - k) * sizeof(int));
+		nruns -= k - 1;
+	}
+	return 0;
+}
+
+// Parse -k F[.C][nr][,F[.C][nr]]
+int sort_parse_key(const char *spec, SortKey *k)
+{
+	char *end;
+
+	memset(k, 0, sizeof(*k));
+	k->sfield = strtoul(spec, &end, 10);
+	k->schar = 1;
+	if (k->sfield == 0 || !isdigit((unsigned char)*spec))
+		return -1;
+	if (*end == '.') {
+		k->schar = strtoul(end + 1, &end, 10);
+		if (k->schar == 0)
+			return -1;
+	}
+	for (int part = 0; ; part++) {
+		for (; *end == 'n' || *end == 'r'; end++) {
+			if (*end == 'n')
+				k->numeric = 1;
+			else
+				k->reverse = 1;
+			k->flags = 1;
+		}
+		if (part == 1 || *end != ',')
+			break;
+		k->efield = strtoul(end + 1, &end, 10);
+		if (k->efield == 0)
+			return -1;
+		if (*end == '.')
+			k->echar = strtoul(end + 1, &end, 10);
+	}
+	return *end ? -1 : 0;
+}
+
+// -S: bytes, with an optional K, M or G suffix
+int sort_parse_size(const char *arg, size_t *size)
+{
+	char *end;
+	unsigned long long n = strtoull(arg, &end, 10);
+
+	if (end == arg)
+		return -1;
+	switch (*end) {
+	case 'G': case 'g': n <<= 10; // fall through
+	case 'M': case 'm': n <<= 10; // fall through
+	case 'K': case 'k': n <<= 10; end++; break;
+	case 'b': case '\0': if (*end) end++; break;
+	}
+	if (*end)
+		return -1;
+	*size = n < SORT_MIN_MEM ? SORT_MIN_MEM : n;
+	return 0;
+}
+
+int lsh_sort(char **args)
+{
+	Sort s;
+	SortKey whole = {1, 1, 0, 0, 0, 0, 0};
+	char **files, *stdin_only[] = {"-", NULL};
+	char *buf = NULL;
+	SortLine *lines = NULL;
+	int *runs = NULL, nruns = 0, runs_cap = 0, in = -1, partial = 0, ret = 0, i;
+	size_t cap, used = 0, max_lines, lines_cap = 0, file = 0;
+	const char *usage = "lsh: sort: usage: sort [-nru] [-t char] [-k key]... [-S size] [file...]\n";
+
+	memset(&s, 0, sizeof(s));
+	s.tab = -1;
+	s.mem = SORT_DEFAULT_MEM;
+	s.tmpdir = getenv("TMPDIR") && *getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		for (const char *c = args[i] + 1; *c; c++) {
+			if (*c == 'n' || *c == 'r' || *c == 'u') {
+				if (*c == 'n')
+					s.numeric = 1;
+				else if (*c == 'r')
+					s.reverse = 1;
+				else
+					s.unique = 1;
+				continue;
+			}
+			// -k, -t and -S take the rest of the word or the next one
+			const char *value = c[1] ? c + 1 : args[i + 1];
+			if ((*c != 'k' && *c != 't' && *c != 'S') || !value) {
+				fprintf(stderr, "%s", usage);
+				free(s.keys);
+				return 2;
+			}
+			if (!c[1])
+				i++;
+			if (*c == 'k') {
+				s.keys = realloc(s.keys, (s.nkeys + 1) * sizeof(SortKey));
+				if (!s.keys) {
+					fprintf(stderr, "lsh: allocation error\n");
+					exit(EXIT_FAILURE);
+				}
+				if (sort_parse_key(value, &s.keys[s.nkeys++]) < 0) {
+					fprintf(stderr, "lsh: sort: invalid key: %s\n", value);
+					free(s.keys);
+					return 2;
+				}
+			}
+			else if (*c == 't') {
+				if (strlen(value) != 1) {
+					fprintf(stderr, "lsh: sort: the separator must be one character: %s\n", value);
+					free(s.keys);
+					return 2;
+				}
+				s.tab = (unsigned char)value[0];
+			}
+			else if (sort_parse_size(value, &s.mem) < 0) {
+				fprintf(stderr, "lsh: sort: invalid size: %s\n", value);
+				free(s.keys);
+				return 2;
+			}
+			break;
+		}
+	}
+	files = args[i] ? args + i : stdin_only;
+	if (s.nkeys == 0) {
+		s.keys = malloc(sizeof(SortKey));
+		if (!s.keys) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		s.keys[0] = whole;
+		s.nkeys = 1;
+	}
+	for (int k = 0; k < s.nkeys; k++) {
+		if (!s.keys[k].flags) {
+			s.keys[k].numeric = s.numeric;
+			s.keys[k].reverse = s.reverse;
+		}
+	}
+
+	// A quarter of the budget for SortLines and their merge space, the
+	// rest for text
+	cap = s.mem / 4 * 3;
+	max_lines = s.mem / 8 / sizeof(SortLine);
+	buf = malloc(cap);
+	if (!buf) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	fflush(stdout);
+
+	for (;;) {
+		size_t n = 0, done = 0;
+		int eof = 0;
+
+		// Fill the buffer, keeping a byte to end a file's last line
+		while (used + 1 < cap) {
+			if (in < 0) {
+				if (!files[file]) {
+					eof = 1;
+					break;
+				}
+				in = strcmp(files[file], "-") == 0 ? STDIN_FILENO : open(files[file], O_RDONLY | O_CLOEXEC);
+				if (in < 0) {
+					fprintf(stderr, "lsh: sort: %s: %s\n", files[file], strerror(errno));
+					ret = 2;
+					goto out;
+				}
+				posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+			}
+			ssize_t r = read(in, buf + used, cap - used - 1);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0) {
+				fprintf(stderr, "lsh: sort: %s: %s\n", files[file], strerror(errno));
+				ret = 2;
+				goto out;
+			}
+			if (r == 0) {
+				if (partial)
+					buf[used++] = '\n';
+				partial = 0;
+				if (in != STDIN_FILENO)
+					close(in);
+				in = -1;
+				file++;
+				continue;
+			}
+			used += r;
+			partial = buf[used - 1] != '\n';
+		}
+
+		// Split it into lines, as many as the budget allows
+		while (done < used && n < max_lines) {
+			char *nl = memchr(buf + done, '\n', used - done);
+			if (!nl)
+				break;
+			if (n == lines_cap) {
+				lines_cap = lines_cap ? lines_cap * 2 : 65536;
+				if (lines_cap > max_lines)
+					lines_cap = max_lines;
+				lines = realloc(lines, lines_cap * sizeof(SortLine));
+				if (!lines) {
+					fprintf(stderr, "lsh: allocation error\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			lines[n].line = buf + done;
+			lines[n].len = nl - (buf + done);
+			n++;
+			done = nl + 1 - buf;
+		}
+		if (n == 0 && !eof) {
+			// One line longer than the buffer
+			cap *= 2;
+			buf = realloc(buf, cap);
+			if (!buf) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+			continue;
+		}
+
+		if (eof && done == used && nruns == 0) {
+			// Everything fit: no temp files
+			if (sort_run(&s, lines, n, STDOUT_FILENO) < 0) {
+				fprintf(stderr, "lsh: sort: write error: %s\n", strerror(errno));
+				ret = 2;
+			}
+			goto out;
+		}
+		if (n > 0) {
+			int fd = sort_tempfile(&s);
+			if (fd < 0) {
+				ret = 2;
+				goto out;
+			}
+			if (nruns == runs_cap) {
+				runs_cap = runs_cap ? runs_cap * 2 : 16;
+				runs = realloc(runs, runs_cap * sizeof(int));
+				if (!runs) {
+					fprintf(stderr, "lsh: allocation error\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			runs[nruns++] = fd;
+			if (sort_run(&s, lines, n, fd) < 0) {
+				fprintf(stderr, "lsh: sort: temporary file: %s\n", strerror(errno));
+				ret = 2;
+				goto out;
+			}
+		}
+		memmove(buf, buf + done, used - done);
+		used -= done;
+		if (eof && used == 0)
+			break;
+	}
+
+	// The run buffer's memory goes to the merge's read buffers
+	free(buf);
+	free(lines);
+	buf = NULL;
+	lines = NULL;
+	if (sort_merge_runs(&s, runs, nruns) < 0)
+		ret = 2;
+	nruns = 0;
+
+out:
+	if (in > STDIN_FILENO)
+		close(in);
+	for (i = 0; i < nruns; i++)
+		close(runs[i]);
+	free(runs);
+	free(buf);
+	free(lines);
+	free(s.keys);
+	return ret;
+}
+
+
+/* count [-d delim] [-f field] [-n top] [file...]
+ * uniq [-c] [-d | -u] [--hash] [file]
+ *
+ * count does what `sort | uniq -c | sort -rn` does without sorting the
+ * input: every line, or its -f field, goes into an open-addressing hash
+ * table whose keys are copied into an arena, and the distinct keys are
+ * printed by count, highest first, ties in byte order. With -n only a
+ * heap of the best `top` entries is kept while scanning the table.
+ *
+ * A regular file of COUNT_PARALLEL_MIN or more is mapped and cut into a
+ * piece per CPU at line boundaries; each piece is counted into a table of
+ * its own, without locks, and the tables are merged at the end. Pipes are
+ * read COUNT_BUFSIZE at a time into the first table.
+ *
+ * Fields are split at each -d character, or else at runs of blanks as in
+ * awk; lines without the field are not counted. uniq folds adjacent
+ * repeats as usual, or with --hash all repeats wherever they are, in the
+ * order of their first occurrence, through the same table.
+ */
+
+#define COUNT_BUFSIZE (1024 * 1024)
+#define COUNT_ARENA_BLOCK (1024 * 1024)
+#define COUNT_PARALLEL_MIN (16 * 1024 * 1024)
+
+typedef struct CountBlock {
+	struct CountBlock *next;
+	size_t used;
+	size_t cap;
+	char data[];
+} CountBlock;
+
+typedef struct {
+	uint64_t hash;
+	uint64_t count;
+	uint64_t first;     // input offset of the first occurrence
+	const char *key;    // NULL marks an empty slot
+	size_t len;
+} CountEntry;
+
+typedef struct {
+	CountEntry *slots;
+	size_t cap;
+	size_t count;
+	CountBlock *arena;  // the keys
+} CountTable;
+
+typedef struct {
+	int delim;          // -d, or -1 for blank-separated fields
+	size_t field;       // -f, or 0 for the whole line
+	CountTable *tables; // one per CPU
+	size_t ntables;
+	const char *map;    // the file being counted in parallel
+	size_t len;
+	uint64_t base;      // offset of this file in the whole input
+} Count;
+
+static inline uint64_t count_hash(const char *p, size_t n)
+{
+	uint64_t h = n * 0x9e3779b97f4a7c15ull, v;
+
+	for (; n >= 8; p += 8, n -= 8) {
+		memcpy(&v, p, 8);
+		h = (h ^ v) * 0x9e3779b97f4a7c15ull;
+		h ^= h >> 29;
+	}
+	if (n > 0) {
+		v = 0;
+		memcpy(&v, p, n);
+		h = (h ^ v) * 0x9e3779b97f4a7c15ull;
+	}
+	return h ^ h >> 32;
+}
+
+char *count_intern(CountTable *t, const char *key, size_t len)
+{
+	CountBlock *b = t->arena;
+
+	if (!b || b->cap - b->used < len) {
+		size_t cap = len > COUNT_ARENA_BLOCK ? len : COUNT_ARENA_BLOCK;
+		b = malloc(sizeof(CountBlock) + cap);
+		if (!b) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		b->next = t->arena;
+		b->used = 0;
+		b->cap = cap;
+		t->arena = b;
+	}
+	memcpy(b->data + b->used, key, len);
+	b->used += len;
+	return b->data + b->used - len;
+}
+
+CountEntry *count_slot(CountEntry *slots, size_t cap, uint64_t hash, const char *key, size_t len)
+{
+	size_t i = hash & (cap - 1);
+	while (slots[i].key && (slots[i].hash != hash || slots[i].len != len || memcmp(slots[i].key, key, len) != 0))
+		i = (i + 1) & (cap - 1);
+	return &slots[i];
+}
+
+// Add n occurrences of key; the key is copied only when it is new, unless
+// owned says it already lives in this table's arena
+void count_add(CountTable *t, const char *key, size_t len, uint64_t n, uint64_t first, int owned)
+{
+	uint64_t hash = count_hash(key, len);
+	CountEntry *slot;
+
+	// Keep the table at most half full
+	if ((t->count + 1) * 2 > t->cap) {
+		size_t cap = t->cap ? t->cap * 2 : 1024;
+		CountEntry *slots = calloc(cap, sizeof(CountEntry));
+		if (!slots) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		for (size_t i = 0; i < t->cap; i++) {
+			CountEntry *old = &t->slots[i];
+			if (old->key)
+				*count_slot(slots, cap, old->hash, old->key, old->len) = *old;
+		}
+		free(t->slots);
+		t->slots = slots;
+		t->cap = cap;
+	}
+	slot = count_slot(t->slots, t->cap, hash, key, len);
+	if (!slot->key) {
+		// A zero-length key still needs a non-NULL pointer
+		slot->key = owned || len == 0 ? (len ? key : "") : count_intern(t, key, len);
+		slot->len = len;
+		slot->hash = hash;
+		slot->first = first;
+		t->count++;
+	}
+	else if (first < slot->first) {
+		slot->first = first;
+	}
+	slot->count += n;
+}
+
+void count_free(CountTable *t)
+{
+	while (t->arena) {
+		CountBlock *next = t->arena->next;
+		free(t->arena);
+		t->arena = next;
+	}
+	free(t->slots);
+	memset(t, 0, sizeof(*t));
+}
+
+// The key to count for the line [p, end), or NULL when it has no such field
+const char *count_key(Count *c, const char *p, const char *end, size_t *len)
+{
+	if (!c->field) {
+		*len = end - p;
+		return p;
+	}
+	for (size_t f = 1; ; f++) {
+		const char *e;
+		if (c->delim >= 0) {
+			e = memchr(p, c->delim, end - p);
+			if (!e)
+				e = end;
+		}
+		else {
+			while (p < end && (*p == ' ' || *p == '\t'))
+				p++;
+			if (p == end)
+				return NULL;
+			for (e = p; e < end && *e != ' ' && *e != '\t'; e++)
+				;
+		}
+		if (f == c->field) {
+			*len = e - p;
+			return p;
+		}
+		if (e == end)
+			return NULL;
+		p = e + (c->delim >= 0);
+	}
+}
+
+// Count the lines of [p, end); the last one may lack its newline
+void count_text(Count *c, CountTable *t, const char *p, const char *end, uint64_t offset)
+{
+	const char *start = p;
+
+	while (p < end) {
+		const char *nl = memchr(p, '\n', end - p);
+		const char *eol = nl ? nl : end;
+		size_t len;
+		const char *key = count_key(c, p, eol, &len);
+
+		if (key)
+			count_add(t, key, len, 1, offset + (p - start), 0);
+		p = eol + 1;
+	}
+}
+
+// Where the first line starting at or after off begins
+size_t count_line_start(Count *c, size_t off)
+{
+	const char *nl;
+
+	if (off == 0 || off >= c->len)
+		return off < c->len ? off : c->len;
+	nl = memchr(c->map + off - 1, '\n', c->len - off + 1);
+	return nl ? (size_t)(nl + 1 - c->map) : c->len;
+}
+
+void count_piece(void *ctx, size_t begin, size_t end)
+{
+	Count *c = ctx;
+	size_t piece = (c->len + c->ntables - 1) / c->ntables;
+	size_t from = count_line_start(c, begin), to = count_line_start(c, end);
+
+	count_text(c, &c->tables[begin / piece], c->map + from, c->map + to, c->base + from);
+}
+
+// Count one input; -1 with errno set if reading it failed
+int count_fd(Count *c, int fd)
+{
+	struct stat st;
+	char *buf;
+	size_t cap = COUNT_BUFSIZE, used = 0;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= COUNT_PARALLEL_MIN && c->ntables > 1) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			c->map = map;
+			c->len = st.st_size;
+			parallel_for(c->len, (c->len + c->ntables - 1) / c->ntables, count_piece, c);
+			munmap(map, st.st_size);
+			c->base += st.st_size;
+			return 0;
+		}
+	}
+
+	buf = malloc(cap);
+	if (!buf) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (;;) {
+		ssize_t n = read(fd, buf + used, cap - used);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			int err = errno;
+			free(buf);
+			errno = err;
+			return -1;
+		}
+		if (n == 0) {
+			count_text(c, &c->tables[0], buf, buf + used, c->base);
+			c->base += used;
+			break;
+		}
+		used += n;
+		// Count the complete lines, keep the last partial one
+		char *last = memrchr(buf, '\n', used);
+		if (last) {
+			size_t done = last + 1 - buf;
+			count_text(c, &c->tables[0], buf, buf + done, c->base);
+			c->base += done;
+			memmove(buf, buf + done, used - done);
+			used -= done;
+		}
+		else if (used == cap) {
+			cap *= 2;
+			buf = realloc(buf, cap);
+			if (!buf) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	free(buf);
+	return 0;
+}
+
+// Count every input into c->tables[0]; 1 if some could not be read
+int count_inputs(Count *c, char **files, const char *cmd)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	char *stdin_only[] = {"-", NULL};
+	int ret = 0;
+
+	c->ntables = ncpu < 1 ? 1 : ncpu > PARALLEL_MAX_THREADS ? PARALLEL_MAX_THREADS : ncpu;
+	c->tables = calloc(c->ntables, sizeof(CountTable));
+	if (!c->tables) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!files[0])
+		files = stdin_only;
+	for (int i = 0; files[i]; i++) {
+		int fd = strcmp(files[i], "-") == 0 ? STDIN_FILENO : open(files[i], O_RDONLY | O_CLOEXEC);
+		if (fd < 0 || count_fd(c, fd) < 0) {
+			fprintf(stderr, "lsh: %s: %s: %s\n", cmd, files[i], strerror(errno));
+			ret = 1;
+		}
+		if (fd > STDIN_FILENO)
+			close(fd);
+	}
+
+	// Merge the per-CPU tables into the first; their arenas go with them
+	for (size_t i = 1; i < c->ntables; i++) {
+		CountTable *t = &c->tables[i];
+		for (size_t j = 0; j < t->cap; j++) {
+			if (t->slots[j].key)
+				count_add(&c->tables[0], t->slots[j].key, t->slots[j].len, t->slots[j].count, t->slots[j].first, 1);
+		}
+		if (t->arena) {
+			CountBlock *b = t->arena;
+			while (b->next)
+				b = b->next;
+			b->next = c->tables[0].arena;
+			c->tables[0].arena = t->arena;
+			t->arena = NULL;
+		}
+		count_free(t);
+	}
+	return ret;
+}
+
+// Higher counts first, then keys in byte order
+int count_before(const CountEntry *a, const CountEntry *b)
+{
+	int r;
+
+	if (a->count != b->count)
+		return a->count > b->count;
+	r = memcmp(a->key, b->key, a->len < b->len ? a->len : b->len);
+	return r < 0 || (r == 0 && a->len < b->len);
+}
+
+int count_compare(const void *a, const void *b)
+{
+	const CountEntry *x = *(CountEntry *const *)a, *y = *(CountEntry *const *)b;
+	return count_before(y, x) - count_before(x, y);
+}
+
+int count_compare_first(const void *a, const void *b)
+{
+	const CountEntry *x = *(CountEntry *const *)a, *y = *(CountEntry *const *)b;
+	return (x->first > y->first) - (x->first < y->first);
+}
+
+// Sift heap[i] down a heap whose root is the entry that would be printed last
+void count_sift(CountEntry **heap, size_t n, size_t i)
+{
+	for (;;) {
+		size_t l = 2 * i + 1, r = l + 1, worst = i;
+		if (l < n && count_before(heap[worst], heap[l]))
+			worst = l;
+		if (r < n && count_before(heap[worst], heap[r]))
+			worst = r;
+		if (worst == i)
+			return;
+		CountEntry *tmp = heap[i];
+		heap[i] = heap[worst];
+		heap[worst] = tmp;
+		i = worst;
+	}
+}
+
+void count_print(OutBuf *out, const CountEntry *e, int with_count)
+{
+	char num[32];
+
+	if (with_count) {
+		int n = snprintf(num, sizeof(num), "%7llu ", (unsigned long long)e->count);
+		outbuf_write(out, STDOUT_FILENO, num, n);
+	}
+	outbuf_write(out, STDOUT_FILENO, e->key, e->len);
+	outbuf_write(out, STDOUT_FILENO, "\n", 1);
+}
+
+int lsh_count(char **args)
+{
+	Count c;
+	CountTable *t;
+	CountEntry **list;
+	OutBuf out = {0};
+	size_t top = 0, n = 0;
+	int i, ret;
+
+	memset(&c, 0, sizeof(c));
+	c.delim = -1;
+	for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		if (strcmp(args[i], "-d") == 0 && args[i + 1] && strlen(args[i + 1]) == 1)
+			c.delim = (unsigned char)args[++i][0];
+		else if (strcmp(args[i], "-f") == 0 && args[i + 1] && atol(args[i + 1]) > 0)
+			c.field = atol(args[++i]);
+		else if (strcmp(args[i], "-n") == 0 && args[i + 1] && atol(args[i + 1]) > 0)
+			top = atol(args[++i]);
+		else {
+			fprintf(stderr, "lsh: count: usage: count [-d delim] [-f field] [-n top] [file...]\n");
+			return 2;
+		}
+	}
+
+	ret = count_inputs(&c, args + i, "count");
+	t = &c.tables[0];
+	list = malloc((t->count ? t->count : 1) * sizeof(CountEntry *));
+	if (!list) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t j = 0; j < t->cap; j++) {
+		CountEntry *e = &t->slots[j];
+		if (!e->key)
+			continue;
+		if (!top || n < top) {
+			list[n++] = e;
+			if (top && n == top) {
+				for (size_t k = n / 2; k-- > 0; )
+					count_sift(list, n, k);
+			}
+		}
+		else if (count_before(e, list[0])) {
+			// Better than the worst of the best so far
+			list[0] = e;
+			count_sift(list, n, 0);
+		}
+	}
+	qsort(list, n, sizeof(CountEntry *), count_compare);
+
+	fflush(stdout);
+	for (size_t j = 0; j < n; j++)
+		count_print(&out, list[j], 1);
+	outbuf_flush(&out, STDOUT_FILENO);
+	free(list);
+	count_free(t);
+	free(c.tables);
+	return ret;
+}
+
+// uniq --hash: every distinct line once, where it first appeared
+int uniq_hash(char **files, int with_count, int which)
+{
+	Count c;
+	CountTable *t;
+	CountEntry **list;
+	OutBuf out = {0};
+	size_t n = 0;
+	int ret;
+
+	memset(&c, 0, sizeof(c));
+	c.delim = -1;
+	ret = count_inputs(&c, files, "uniq");
+	t = &c.tables[0];
+	list = malloc((t->count ? t->count : 1) * sizeof(CountEntry *));
+	if (!list) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t j = 0; j < t->cap; j++) {
+		CountEntry *e = &t->slots[j];
+		if (e->key && (!which || (which == 'd') == (e->count > 1)))
+			list[n++] = e;
+	}
+	qsort(list, n, sizeof(CountEntry *), count_compare_first);
+
+	fflush(stdout);
+	for (size_t j = 0; j < n; j++)
+		count_print(&out, list[j], with_count);
+	outbuf_flush(&out, STDOUT_FILENO);
+	free(list);
+	count_free(t);
+	free(c.tables);
+	return ret;
+}
+
+int lsh_uniq(char **args)
+{
+	int with_count = 0, which = 0, hash = 0, i;
+	char *files[2] = {NULL, NULL};
+	FILE *fp;
+	char *line = NULL, *prev = NULL;
+	size_t cap = 0, prev_cap = 0, prev_len = 0;
+	uint64_t repeats = 0;
+	ssize_t len;
+	OutBuf out = {0};
+
+	for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		if (strcmp(args[i], "--hash") == 0) {
+			hash = 1;
+			continue;
+		}
+		for (const char *c = args[i] + 1; *c; c++) {
+			if (*c == 'c')
+				with_count = 1;
+			else if (*c == 'd' || *c == 'u')
+				which = *c;
+			else {
+				fprintf(stderr, "lsh: uniq: usage: uniq [-c] [-d | -u] [--hash] [file]\n");
+				return 2;
+			}
+		}
+	}
+	files[0] = args[i];
+	if (hash)
+		return uniq_hash(files, with_count, which);
+
+	fp = !args[i] || strcmp(args[i], "-") == 0 ? stdin : fopen(args[i], "r");
+	if (!fp) {
+		fprintf(stderr, "lsh: uniq: %s: %s\n", args[i], strerror(errno));
+		return 1;
+	}
+	fflush(stdout);
+	for (;;) {
+		len = getline(&line, &cap, fp);
+		if (len > 0 && line[len - 1] == '\n')
+			len--;
+		if (repeats && (len < 0 || (size_t)len != prev_len || memcmp(line, prev, len) != 0)) {
+			// The run of prev ends here
+			CountEntry e = {0, repeats, 0, prev, prev_len};
+			if (!which || (which == 'd') == (repeats > 1))
+				count_print(&out, &e, with_count);
+			repeats = 0;
+		}
+		if (len < 0)
+			break;
+		if (repeats++ == 0) {
+			if ((size_t)len + 1 > prev_cap) {
+				prev_cap = len + 1;
+				prev = realloc(prev, prev_cap);
+				if (!prev) {
+					fprintf(stderr, "lsh: allocation error\n");
+					exit(EXIT_FAILURE);
+				}
+			}
+			memcpy(prev, line, len);
+			prev_len = len;
+		}
+	}
+	outbuf_flush(&out, STDOUT_FILENO);
+	if (fp != stdin)
+		fclose(fp);
+	free(line);
+	free(prev);
+	return 0;
+}
+
+
+/* head [-n lines | -c bytes] [file...]
+ * tail [-f] [-n [+]lines | -c [+]bytes] [file...]
+ *
+ * head counts newlines a block at a time with memcount() and only looks
+ * for the exact cut in the block where the count runs out. tail on a
+ * regular file never reads more than it prints, give or take a block: it
+ * preads TAIL_BLOCK bytes at a time backwards from the end, counting
+ * newlines the same way, and then copies from the cut to the end. A pipe
+ * is read to the end keeping only what the last lines could still need.
+ *
+ * tail -f follows by name. An inotify instance watches each file, and its
+ * directory so that a file rotated away and created again is seen; on any
+ * event every file is read up to its end, and reopened if its name now
+ * points to another inode, or read again from the start if it shrank.
+ * The wait is an epoll on the inotify fd and a signalfd for SIGINT, which
+ * ends the follow (the shell itself ignores SIGINT, but a blocked signal
+ * still reaches a signalfd).
+ */
+
+#define TAIL_BLOCK (256 * 1024)
+#define TAIL_PIPE_SLACK (4 * 1024 * 1024)
+
+typedef struct {
+	const char *name;
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	off_t pos;
+	int wd;           // watch on the file, -1 while it is gone
+} TailFile;
+
+typedef struct {
+	TailFile *files;
+	int nfiles;
+	int last;         // file whose output was printed last, for the headers
+	int ifd;          // inotify
+} TailFollow;
+
+// Print "==> name <==" before a file's output when there are several
+void ht_header(const char *name, int nfiles, int *first)
+{
+	char line[PATH_MAX + 16];
+	int n;
+
+	if (nfiles < 2)
+		return;
+	n = snprintf(line, sizeof(line), "%s==> %s <==\n", *first ? "" : "\n", name);
+	write_all(STDOUT_FILENO, line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
+	*first = 0;
+}
+
+// Parse the count of -n/-c: digits, with a + for tail's "from the start"
+int ht_count(const char *arg, uint64_t *n, int *plus)
+{
+	char *end;
+
+	*plus = *arg == '+';
+	if (*plus)
+		arg++;
+	if (!isdigit((unsigned char)*arg))
+		return -1;
+	*n = strtoull(arg, &end, 10);
+	return *end ? -1 : 0;
+}
+
+// Copy fd from its offset to the end, or at most limit bytes, to stdout
+int ht_copy(int fd, uint64_t limit)
+{
+	char *buf = malloc(TAIL_BLOCK);
+
+	if (!buf) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	while (limit > 0) {
+		ssize_t n = read(fd, buf, limit < TAIL_BLOCK ? limit : TAIL_BLOCK);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			int err = errno;
+			free(buf);
+			errno = err;
+			return n < 0 ? -1 : 0;
+		}
+		write_all(STDOUT_FILENO, buf, n);
+		limit -= n;
+	}
+	free(buf);
+	return 0;
+}
+
+// Print the first `lines` lines, or with bytes set the first `count` bytes
+int head_fd(int fd, uint64_t count, int bytes)
+{
+	char *buf;
+
+	if (bytes)
+		return ht_copy(fd, count);
+	buf = malloc(TAIL_BLOCK);
+	if (!buf) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	while (count > 0) {
+		ssize_t n = read(fd, buf, TAIL_BLOCK);
+		size_t len;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			int err = errno;
+			free(buf);
+			errno = err;
+			return n < 0 ? -1 : 0;
+		}
+		len = n;
+		size_t lines = memcount(buf, len, '\n');
+		if (lines >= count) {
+			// The cut is in this block: find the count-th newline
+			const char *p = buf;
+			for (; count > 0; count--)
+				p = memchr(p, '\n', buf + len - p) + 1;
+			len = p - buf;
+		}
+		else {
+			count -= lines;
+		}
+		write_all(STDOUT_FILENO, buf, len);
+	}
+	free(buf);
+	return 0;
+}
+
+// Where the last `lines` lines of p[0, len) start. A last line without
+// its newline counts; *need is what is still missing when the text is too
+// short, to go on with the text before it.
+size_t tail_cut(const char *p, size_t len, uint64_t *need)
+{
+	size_t found = memcount(p, len, '\n');
+
+	if (found < *need) {
+		*need -= found;
+		return 0;
+	}
+	// The cut is in here, after the need-th newline from the end
+	const char *q = p;
+	for (size_t skip = found - *need + 1; skip > 0; skip--)
+		q = memchr(q, '\n', p + len - q) + 1;
+	*need = 0;
+	return q - p;
+}
+
+// The offset the last `lines` lines of a regular file of size start at,
+// reading back from the end a block at a time
+off_t tail_file_start(int fd, off_t size, uint64_t lines, char *buf)
+{
+	off_t end = size, pos;
+	char last;
+
+	if (size == 0 || lines == 0)
+		return size;
+	// A final newline ends the last line; it is not a line of its own
+	if (pread(fd, &last, 1, size - 1) == 1 && last == '\n')
+		end--;
+	while (end > 0) {
+		size_t len = end < TAIL_BLOCK ? end : TAIL_BLOCK;
+		pos = end - len;
+		ssize_t n = pread(fd, buf, len, pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n != (ssize_t)len)
+			return -1;
+		size_t cut = tail_cut(buf, len, &lines);
+		if (lines == 0)
+			return pos + cut;
+		end = pos;
+	}
+	return 0;
+}
+
+// Print the end of fd: its last `count` lines or bytes, or with plus
+// everything from line or byte `count` on
+int tail_fd(int fd, uint64_t count, int bytes, int plus)
+{
+	struct stat st;
+	char *buf;
+	size_t len = 0, cap = TAIL_BLOCK;
+
+	if (plus) {
+		// Skip count - 1 lines or bytes and copy the rest
+		if (count > 1) {
+			if (bytes) {
+				if (lseek(fd, count - 1, SEEK_CUR) < 0) {
+					buf = malloc(TAIL_BLOCK);
+					if (!buf) {
+						fprintf(stderr, "lsh: allocation error\n");
+						exit(EXIT_FAILURE);
+					}
+					for (uint64_t skip = count - 1; skip > 0; ) {
+						ssize_t n = read(fd, buf, skip < TAIL_BLOCK ? skip : TAIL_BLOCK);
+						if (n <= 0)
+							break;
+						skip -= n;
+					}
+					free(buf);
+				}
+				return ht_copy(fd, UINT64_MAX);
+			}
+			buf = malloc(TAIL_BLOCK);
+			if (!buf) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+			for (uint64_t skip = count - 1; ; ) {
+				ssize_t n = read(fd, buf, TAIL_BLOCK);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0) {
+					free(buf);
+					return n < 0 ? -1 : 0;
+				}
+				size_t lines = memcount(buf, n, '\n');
+				if (lines >= skip) {
+					const char *p = buf;
+					for (; skip > 0; skip--)
+						p = memchr(p, '\n', buf + n - p) + 1;
+					write_all(STDOUT_FILENO, p, buf + n - p);
+					break;
+				}
+				skip -= lines;
+			}
+			free(buf);
+		}
+		return ht_copy(fd, UINT64_MAX);
+	}
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		off_t start;
+		buf = malloc(TAIL_BLOCK);
+		if (!buf) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		if (bytes)
+			start = (uint64_t)st.st_size > count ? st.st_size - (off_t)count : 0;
+		else
+			start = tail_file_start(fd, st.st_size, count, buf);
+		free(buf);
+		if (start < 0 || lseek(fd, start, SEEK_SET) < 0)
+			return -1;
+		return ht_copy(fd, st.st_size - start);
+	}
+
+	// A pipe: keep reading, dropping what can no longer be in the tail
+	buf = malloc(cap);
+	if (!buf) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
+	}
+	for (;;) {
+		if (len == cap) {
+			cap *= 2;
+			buf = realloc(buf, cap);
+			if (!buf) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		ssize_t n = read(fd, buf + len, cap - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			int err = errno;
+			free(buf);
+			errno = err;
+			return -1;
+		}
+		len += n;
+		if (n == 0 || len > TAIL_PIPE_SLACK + (bytes ? count : 0)) {
+			size_t start;
+			if (bytes) {
+				start = len > count ? len - count : 0;
+			}
+			else {
+				uint64_t need = count;
+				size_t end = len - (len > 0 && buf[len - 1] == '\n');
+				start = count ? tail_cut(buf, end, &need) : len;
+			}
+			if (n == 0) {
+				write_all(STDOUT_FILENO, buf + start, len - start);
+				break;
+			}
+			memmove(buf, buf + start, len - start);
+			len -= start;
+		}
+	}
+	free(buf);
+	return 0;
+}
+
+int lsh_head(char **args)
+{
+	uint64_t count = 10;
+	int bytes = 0, plus, first = 1, nfiles, ret = 0, i;
+	char *stdin_only[] = {"-", NULL}, **files;
+
+	for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+		const char *value = NULL;
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		if (isdigit((unsigned char)args[i][1])) {
+			value = args[i] + 1;
+			bytes = 0;
+		}
+		else if (args[i][1] == 'n' || args[i][1] == 'c') {
+			bytes = args[i][1] == 'c';
+			value = args[i][2] ? args[i] + 2 : args[++i];
+		}
+		if (!value || ht_count(value, &count, &plus) < 0 || plus) {
+			fprintf(stderr, "lsh: head: usage: head [-n lines | -c bytes] [file...]\n");
+			return 2;
+		}
+	}
+	files = args[i] ? args + i : stdin_only;
+	for (nfiles = 0; files[nfiles]; nfiles++)
+		;
+
+	fflush(stdout);
+	for (int k = 0; files[k]; k++) {
+		int fd = strcmp(files[k], "-") == 0 ? STDIN_FILENO : open(files[k], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "lsh: head: %s: %s\n", files[k], strerror(errno));
+			ret = 1;
+			continue;
+		}
+		ht_header(fd == STDIN_FILENO ? "standard input" : files[k], nfiles, &first);
+		if (head_fd(fd, count, bytes) < 0) {
+			fprintf(stderr, "lsh: head: %s: %s\n", files[k], strerror(errno));
+			ret = 1;
+		}
+		if (fd != STDIN_FILENO)
+			close(fd);
+	}
+	return ret;
+}
+
+// Read what was added to f since last time; reopen it if its name now
+// points to a new file, start over if it was truncated
+void tail_check(TailFollow *t, int i)
+{
+	TailFile *f = &t->files[i];
+	char buf[65536];
+	struct stat st;
+
+	for (int pass = 0; pass < 2; pass++) {
+		if (f->fd >= 0) {
+			for (;;) {
+				ssize_t n = read(f->fd, buf, sizeof(buf));
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					break;
+				if (t->nfiles > 1 && t->last != i) {
+					int first = t->last < 0;
+					ht_header(f->name, t->nfiles, &first);
+					t->last = i;
+				}
+				write_all(STDOUT_FILENO, buf, n);
+				f->pos += n;
+			}
+		}
+		if (stat(f->name, &st) < 0)
+			return; // gone for now; the directory watch sees it come back
+
+		if (f->fd >= 0 && st.st_dev == f->dev && st.st_ino == f->ino) {
+			if (st.st_size < f->pos) {
+				fprintf(stderr, "lsh: tail: %s: file truncated\n", f->name);
+				lseek(f->fd, 0, SEEK_SET);
+				f->pos = 0;
+				continue;
+			}
+			return;
+		}
+		// Rotated: the old file has been read to its end, follow the new one
+		int fd = open(f->name, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return;
+		if (f->fd >= 0) {
+			fprintf(stderr, "lsh: tail: %s: file replaced, following the new file\n", f->name);
+			close(f->fd);
+		}
+		f->fd = fd;
+		f->dev = st.st_dev;
+		f->ino = st.st_ino;
+		f->pos = 0;
+		f->wd = inotify_add_watch(t->ifd, f->name, IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+	}
+}
+
+// Follow the files until SIGINT
+int tail_follow(TailFollow *t)
+{
+	struct epoll_event ev;
+	sigset_t mask, old;
+	int ep, sfd;
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	t->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, &old);
+	sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (t->ifd < 0 || ep < 0 || sfd < 0) {
+		fprintf(stderr, "lsh: tail: cannot follow: %s\n", strerror(errno));
+		if (t->ifd >= 0)
+			close(t->ifd);
+		if (ep >= 0)
+			close(ep);
+		if (sfd >= 0)
+			close(sfd);
+		sigprocmask(SIG_SETMASK, &old, NULL);
+		return 1;
+	}
+	for (int i = 0; i < t->nfiles; i++) {
+		TailFile *f = &t->files[i];
+		char *slash = strrchr(f->name, '/');
+		char *dir = slash ? strndup(f->name, slash == f->name ? 1 : slash - f->name) : strdup(".");
+
+		if (!dir) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		if (f->fd >= 0)
+			f->wd = inotify_add_watch(t->ifd, f->name, IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+		// The same directory twice gives the same watch
+		inotify_add_watch(t->ifd, dir, IN_CREATE | IN_MOVED_TO);
+		free(dir);
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = t->ifd;
+	epoll_ctl(ep, EPOLL_CTL_ADD, t->ifd, &ev);
+	ev.data.fd = sfd;
+	epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev);
 
+	for (int stop = 0; !stop; ) {
+		struct epoll_event ready[2];
+		int n = epoll_wait(ep, ready, 2, -1);
+		if (n < 0 && errno != EINTR)
+			break;
+		for (int k = 0; k < n; k++) {
+			if (ready[k].data.fd == sfd) {
+				struct signalfd_siginfo si;
+				while (read(sfd, &si, sizeof(si)) == sizeof(si))
+					;
+				stop = 1;
+			}
+		}
+		if (stop)
+			break;
+		// Which file changed matters little: check them all, but note
+		// the watches that went away with their files
+		ssize_t len;
+		while ((len = read(t->ifd, events, sizeof(events))) > 0) {
+			for (char *p = events; p < events + len; ) {
+				struct inotify_event *e = (struct inotify_event *)p;
+				if (e->mask & IN_IGNORED) {
+					for (int i = 0; i < t->nfiles; i++)
+						if (t->files[i].wd == e->wd)
+							t->files[i].wd = -1;
+				}
+				p += sizeof(struct inotify_event) + e->len;
+			}
+		}
+		for (int i = 0; i < t->nfiles; i++)
+			tail_check(t, i);
+	}
+	close(sfd);
+	close(ep);
+	close(t->ifd);
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	return 130;
+}
 
-int lsh_launch(char **args)
+int lsh_tail(char **args)
 {
-	pid_t pid, wpid;
-	int status;
+	uint64_t count = 10;
+	int bytes = 0, plus = 0, follow = 0, first = 1, nfiles, ret = 0, i;
+	char *stdin_only[] = {"-", NULL}, **files;
+	TailFollow t;
 
-	pid = fork(); // Creates a copy of current process
-	if (pid == 0){
-		// Child process
-		// execvp replaces current process with new program
-		// args[0] is program name
-		// args is array of arguments
-		if (execvp(args[0], args) == -1) {
-			perror("lsh");
+	for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+		const char *value = NULL;
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		if (strcmp(args[i], "-f") == 0) {
+			follow = 1;
+			continue;
+		}
+		if (isdigit((unsigned char)args[i][1])) {
+			value = args[i] + 1;
+			bytes = 0;
+		}
+		else if (args[i][1] == 'n' || args[i][1] == 'c') {
+			bytes = args[i][1] == 'c';
+			value = args[i][2] ? args[i] + 2 : args[++i];
+		}
+		if (!value || ht_count(value, &count, &plus) < 0) {
+			fprintf(stderr, "lsh: tail: usage: tail [-f] [-n [+]lines | -c [+]bytes] [file...]\n");
+			return 2;
 		}
-		exit (EXIT_FAILURE);
 	}
-	else if (pid < 0) {
-		// Error forking
-		perror("lsh");
+	files = args[i] ? args + i : stdin_only;
+	for (nfiles = 0; files[nfiles]; nfiles++)
+		;
+
+	memset(&t, 0, sizeof(t));
+	t.files = calloc(nfiles, sizeof(TailFile));
+	if (!t.files) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
 	}
-	else {
-		// Parent process
-		do {
-			// wait for child process to finish/change state
-			wpid = waitpid(pid, &status, WUNTRACED);
-		} while (!WIFEXITED(status) && !WIFSIGNALED(status));
+	t.nfiles = nfiles;
+	t.last = -1;
+
+	fflush(stdout);
+	for (int k = 0; files[k]; k++) {
+		TailFile *f = &t.files[k];
+		struct stat st;
+
+		f->name = files[k];
+		f->wd = -1;
+		f->fd = strcmp(files[k], "-") == 0 ? STDIN_FILENO : open(files[k], O_RDONLY | O_CLOEXEC);
+		if (f->fd < 0) {
+			fprintf(stderr, "lsh: tail: %s: %s\n", files[k], strerror(errno));
+			ret = 1;
+			continue;
+		}
+		ht_header(f->fd == STDIN_FILENO ? "standard input" : files[k], nfiles, &first);
+		t.last = k;
+		if (tail_fd(f->fd, count, bytes, plus) < 0) {
+			fprintf(stderr, "lsh: tail: %s: %s\n", files[k], strerror(errno));
+			ret = 1;
+		}
+		if (fstat(f->fd, &st) == 0) {
+			f->dev = st.st_dev;
+			f->ino = st.st_ino;
+			f->pos = lseek(f->fd, 0, SEEK_CUR);
+		}
 	}
-	return 1;
+
+	// Only named files can be followed: stdin has been read to its end
+	if (follow) {
+		int n = 0, last = t.last;
+		t.last = -1;
+		for (int k = 0; k < nfiles; k++) {
+			if (t.files[k].fd == STDIN_FILENO)
+				continue;
+			if (last == k)
+				t.last = n;
+			t.files[n++] = t.files[k];
+		}
+		t.nfiles = n;
+		if (n > 0)
+			ret = tail_follow(&t);
+		nfiles = n;
+	}
+	for (int k = 0; k < nfiles; k++)
+		if (t.files[k].fd > STDIN_FILENO)
+			close(t.files[k].fd);
+	free(t.files);
+	return ret;
 }
 
 
+/* cut [-s] [-d delim] -f list [file...]
+ * field [-c] [-d delim] [-o sep] list [file...]
+ *
+ * Both find field separators 64 bytes at a time: AVX2 (or SSE2) compares
+ * turn each block into bitmasks of its newlines, delimiters and quotes,
+ * and the set bits are walked with ctz, so the bytes in between are never
+ * looked at one by one. Once a line has all the fields wanted, only its
+ * newline bits are walked. Selected fields go straight from the read
+ * buffer into an OutBuf, which is written OUTBUF_BLOCK at a time.
+ *
+ * cut prints fields in input order joined by the delimiter (a tab unless
+ * -d), and lines without a delimiter whole unless -s. field prints them
+ * in the order listed, repeats allowed, a missing one as empty, joined by
+ * -o; it splits at runs of blanks as awk does, or at each -d character.
+ * With -c the input is CSV: a delimiter or newline between double quotes
+ * belongs to the field. The quoted stretches are a prefix XOR of the
+ * quote bits, carried from one block to the next, and "" inside quotes
+ * flips the state twice and leaves it quoted. Fields are printed as they
+ * are, quotes included. Lists are N, N-M, N- and -M, separated by commas.
+ */
 
+#define FIELD_BUFSIZE (1024 * 1024)
+#define FIELD_WINDOW 1024   // 64-byte blocks whose masks are made at a time
 
-// list of builtin commands followed by their corresponding functions
+typedef struct {
+	size_t lo, hi;      // 1-based; hi is SIZE_MAX for "to the end"
+} FieldRange;
 
-char *builtin_str[] = {
-	"cd",
-	"help",
-	"exit",
-	"ls",
-	"pwd",
-	"clear",
-	"history",
-	"cat",
-	"grep",
-	"touch",
-	"echo",
-	"rm"
-};
+typedef struct {
+	const char *b, *e;
+} FieldSpan;
 
-int (*builtin_func[]) (char **) = {
-	&lsh_cd,
-	&lsh_help,
-	&lsh_exit,
-	&lsh_ls,
-	&lsh_pwd,
-	&lsh_clear,
-	&lsh_history,
-	&lsh_cat,
-	&lsh_grep,
-	&lsh_touch,
-	&lsh_echo,
-	&lsh_rm
-};
+typedef struct {
+	FieldRange *ranges;
+	int nranges;
+	size_t last;        // the highest field wanted, SIZE_MAX for all
+	int delim;
+	int blanks;         // split at runs of blanks, skipping empty fields
+	int csv;
+	int cut;            // cut's rules rather than field's
+	int only_delimited; // cut -s
+	const char *sep;    // between printed fields
+	size_t seplen;
+	// the line being split
+	const char *line;
+	FieldSpan *spans;
+	size_t nfields;
+	size_t cap;
+	int saw_delim;
+	OutBuf out;
+} Field;
 
-int lsh_num_builtins() {
-	return sizeof(builtin_str) / sizeof(char *);
-}
+#ifdef __x86_64__
+__attribute__((target("avx2")))
+void field_masks_avx2(const unsigned char *p, size_t nblocks, Field *f, uint64_t *nl, uint64_t *dl, uint64_t *qt)
+{
+	const __m256i newline = _mm256_set1_epi8('\n'), quote = _mm256_set1_epi8('"');
+	const __m256i delim = _mm256_set1_epi8(f->blanks ? ' ' : (char)f->delim), tab = _mm256_set1_epi8('\t');
 
-// Builtin function implementations.
+	for (size_t b = 0; b < nblocks; b++, p += 64) {
+		__m256i lo = _mm256_loadu_si256((const __m256i *)p);
+		__m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+		__m256i dlo = _mm256_cmpeq_epi8(lo, delim), dhi = _mm256_cmpeq_epi8(hi, delim);
 
-int lsh_cd(char **args)
-{
-	if (args[1] == NULL) {
-		fprintf(stderr, "lsh: expected argument to \"cd\"\n");
-	}
-	else {
-		if (chdir(args[1]) != 0) {
-			perror("lsh");
+		if (f->blanks) {
+			dlo = _mm256_or_si256(dlo, _mm256_cmpeq_epi8(lo, tab));
+			dhi = _mm256_or_si256(dhi, _mm256_cmpeq_epi8(hi, tab));
 		}
+		nl[b] = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, newline)) |
+			(uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, newline)) << 32;
+		dl[b] = (uint32_t)_mm256_movemask_epi8(dlo) | (uint64_t)(uint32_t)_mm256_movemask_epi8(dhi) << 32;
+		if (f->csv)
+			qt[b] = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, quote)) |
+				(uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, quote)) << 32;
 	}
-	return 1;
 }
 
-
-int lsh_help(char **args)
+void field_masks_sse2(const unsigned char *p, size_t nblocks, Field *f, uint64_t *nl, uint64_t *dl, uint64_t *qt)
 {
-	int i;
-	printf("Based off Stephen Brennan's LSH\n");
-	printf("Type program names and arguments, and hit enter.\n");
-	printf("The following are built in:\n");
+	const __m128i newline = _mm_set1_epi8('\n'), quote = _mm_set1_epi8('"');
+	const __m128i delim = _mm_set1_epi8(f->blanks ? ' ' : (char)f->delim), tab = _mm_set1_epi8('\t');
 
-	for (i=0; i < lsh_num_builtins(); i++) {
-		printf(" %s\n", builtin_str[i]);
+	for (size_t b = 0; b < nblocks; b++) {
+		uint64_t n = 0, d = 0, q = 0;
+		for (int i = 0; i < 4; i++, p += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)p);
+			__m128i dv = _mm_cmpeq_epi8(v, delim);
+			if (f->blanks)
+				dv = _mm_or_si128(dv, _mm_cmpeq_epi8(v, tab));
+			n |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)) << (16 * i);
+			d |= (uint64_t)_mm_movemask_epi8(dv) << (16 * i);
+			if (f->csv)
+				q |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)) << (16 * i);
+		}
+		nl[b] = n;
+		dl[b] = d;
+		qt[b] = q;
 	}
-	printf("Use the man command for information on other programs.\n");
-	return 1;
 }
+#endif
 
-int lsh_exit(char **args)
+void field_masks(const unsigned char *p, size_t nblocks, Field *f, uint64_t *nl, uint64_t *dl, uint64_t *qt)
 {
-	return 0;
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("avx2"))
+		field_masks_avx2(p, nblocks, f, nl, dl, qt);
+	else
+		field_masks_sse2(p, nblocks, f, nl, dl, qt);
+#else
+	for (size_t b = 0; b < nblocks; b++) {
+		nl[b] = dl[b] = qt[b] = 0;
+		for (int i = 0; i < 64; i++, p++) {
+			nl[b] |= (uint64_t)(*p == '\n') << i;
+			dl[b] |= (uint64_t)(f->blanks ? *p == ' ' || *p == '\t' : *p == f->delim) << i;
+			qt[b] |= (uint64_t)(*p == '"') << i;
+		}
+	}
+#endif
 }
 
-
-int lsh_ls(char **args)
+// Bit i set when an odd number of bits up to i are: inside quotes
+static inline uint64_t field_prefix_xor(uint64_t x)
 {
-	DIR *dir;
-	struct dirent *entry;
-
-	// open current directory if no argument
-	const char *path = args[1] ? args[1] : ".";
-
-	dir = opendir(path);
-	if (dir == NULL) {
-		perror("lsh");
-		return 1;
-	}
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return x;
+}
 
-	while ((entry = readdir(dir)) != NULL) {
-		// skip hidden files unless -a flag is present
-		if (entry->d_name[0] == '.' && (!args[1] || strcmp(args[1], "-a") != 0))
-			continue;
-		printf("%s\n", entry->d_name);
+void field_add(Field *f, const char *b, const char *e)
+{
+	if (f->blanks && b == e)
+		return;
+	if (f->nfields == f->cap) {
+		f->cap = f->cap ? f->cap * 2 : 64;
+		f->spans = realloc(f->spans, f->cap * sizeof(FieldSpan));
+		if (!f->spans) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
 	}
-	closedir(dir);
-	return 1;
+	f->spans[f->nfields].b = b;
+	f->spans[f->nfields].e = e;
+	f->nfields++;
 }
 
+void field_print(Field *f, int *first, const char *b, const char *e)
+{
+	if (!*first)
+		outbuf_write(&f->out, STDOUT_FILENO, f->sep, f->seplen);
+	outbuf_write(&f->out, STDOUT_FILENO, b, e - b);
+	*first = 0;
+}
 
-int lsh_pwd(char **args)
+// The line ending at end is split: print what was asked for
+void field_line(Field *f, const char *end)
 {
-	char cwd[1024];
-	if (getcwd(cwd, sizeof(cwd)) != NULL) {
-		printf("%s\n", cwd);
+	int first = 1;
+
+	// RFC 4180 ends records with CRLF
+	if (f->csv && f->nfields > 0 && f->spans[f->nfields - 1].e > f->spans[f->nfields - 1].b &&
+	    f->spans[f->nfields - 1].e[-1] == '\r' && f->spans[f->nfields - 1].e == end)
+		f->spans[f->nfields - 1].e--;
+	if (f->cut) {
+		if (!f->saw_delim) {
+			if (!f->only_delimited) {
+				outbuf_write(&f->out, STDOUT_FILENO, f->line, end - f->line);
+				outbuf_write(&f->out, STDOUT_FILENO, "\n", 1);
+			}
+			return;
+		}
+		for (size_t i = 0; i < f->nfields; i++) {
+			for (int r = 0; r < f->nranges; r++) {
+				if (i + 1 >= f->ranges[r].lo && i + 1 <= f->ranges[r].hi) {
+					field_print(f, &first, f->spans[i].b, f->spans[i].e);
+					break;
+				}
+			}
+		}
 	}
 	else {
-		perror("lsh");
+		for (int r = 0; r < f->nranges; r++) {
+			FieldRange *fr = &f->ranges[r];
+			if (fr->lo > f->nfields && fr->lo == fr->hi)
+				field_print(f, &first, "", ""); // like awk's $N past the end
+			for (size_t i = fr->lo; i <= fr->hi && i <= f->nfields; i++)
+				field_print(f, &first, f->spans[i - 1].b, f->spans[i - 1].e);
+		}
 	}
-	return 1;
+	outbuf_write(&f->out, STDOUT_FILENO, "\n", 1);
 }
 
-
-int lsh_clear(char **args) 
+// Split and print the complete lines of buf[0, len); returns the length of
+// what was printed. buf must have 64 zero bytes after len.
+size_t field_scan(Field *f, const char *buf, size_t len)
 {
-	//ANSI escape code to clear screen and move cursor to top
-	printf("\033[2J\033[H");
-	return 1;
-}
+	uint64_t nl[FIELD_WINDOW], dl[FIELD_WINDOW], qt[FIELD_WINDOW];
+	uint64_t quoted = 0;       // all ones while a quote is open
+	const char *start = buf;   // of the current field
+	int done = 0;              // the line has all the fields wanted
 
+	f->line = buf;
+	f->nfields = 0;
+	f->saw_delim = 0;
+	for (size_t w = 0; w < len; w += FIELD_WINDOW * 64) {
+		size_t nblocks = (len - w + 63) / 64;
+		if (nblocks > FIELD_WINDOW)
+			nblocks = FIELD_WINDOW;
+		field_masks((const unsigned char *)buf + w, nblocks, f, nl, dl, qt);
 
-int lsh_cat(char **args)
-{
-	if (args[1] == NULL) {
-		fprintf(stderr, "lsh: expected argument to \"cat\"\n");
-		return 1;
-	}
+		for (size_t b = 0; b < nblocks; b++) {
+			uint64_t n = nl[b], d = dl[b], above = ~0ULL;
 
-	FILE *fp = fopen(args[1], "r");
-	if (fp == NULL) {
-		perror("lsh");
-		return 1;
+			if (f->csv) {
+				uint64_t q = field_prefix_xor(qt[b]) ^ quoted;
+				quoted = (uint64_t)((int64_t)q >> 63);
+				n &= ~q;
+				d &= ~q;
+			}
+			for (uint64_t s = done ? n : n | d; s; s = (done ? n : n | d) & above) {
+				int bit = __builtin_ctzll(s);
+				const char *p = buf + w + b * 64 + bit;
+
+				above = bit == 63 ? 0 : ~0ULL << (bit + 1);
+				if (!done)
+					field_add(f, start, p);
+				start = p + 1;
+				if (*p == '\n') {
+					field_line(f, p);
+					f->line = start;
+					f->nfields = 0;
+					f->saw_delim = 0;
+					done = 0;
+				}
+				else {
+					f->saw_delim = 1;
+					done = f->nfields >= f->last;
+				}
+			}
+		}
 	}
+	return f->line - buf;
+}
 
-	char buffer[1024];
-	while (fgets(buffer, sizeof(buffer), fp)) {
-		printf("%s", buffer);
+// Split one input; -1 with errno set if it could not be read
+int field_fd(Field *f, int fd)
+{
+	size_t cap = FIELD_BUFSIZE, used = 0, done;
+	char *buf = malloc(cap + 64);
+
+	if (!buf) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
 	}
+	for (;;) {
+		// Keep a byte for the newline a last line may lack
+		ssize_t n = read(fd, buf + used, cap - used - 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			int err = errno;
+			free(buf);
+			errno = err;
+			return -1;
+		}
+		if (n == 0 && used > 0)
+			buf[used++] = '\n';
+		else
+			used += n;
+		memset(buf + used, 0, 64);
+		done = field_scan(f, buf, used);
+		if (n == 0) {
+			if (done < used) {
+				// A quote left open to the end: split the rest as plain text
+				int csv = f->csv;
+				f->csv = 0;
+				field_scan(f, buf + done, used - done);
+				f->csv = csv;
+			}
+			break;
+		}
+		memmove(buf, buf + done, used - done);
+		used -= done;
+		if (used == cap - 1) {
+			cap *= 2;
+			buf = realloc(buf, cap + 64);
+			if (!buf) {
+				fprintf(stderr, "lsh: allocation error\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	free(buf);
+	return 0;
+}
 
-	fclose(fp);
-	return 1;
+// Parse a list like 1,3-5,7- into f->ranges
+int field_parse_list(Field *f, const char *list)
+{
+	const char *p = list;
+
+	f->last = 0;
+	do {
+		FieldRange r = {1, SIZE_MAX};
+		char *end;
+
+		if (*p == ',')
+			p++;
+		if (isdigit((unsigned char)*p)) {
+			r.lo = strtoul(p, &end, 10);
+			p = end;
+			r.hi = *p == '-' ? SIZE_MAX : r.lo;
+		}
+		else if (*p != '-') {
+			return -1;
+		}
+		if (*p == '-' && isdigit((unsigned char)p[1])) {
+			r.hi = strtoul(p + 1, &end, 10);
+			p = end;
+		}
+		else if (*p == '-') {
+			if (p == list || p[-1] == ',')
+				return -1; // a lone "-"
+			p++;
+		}
+		if (r.lo == 0 || r.hi < r.lo)
+			return -1;
+		f->ranges = realloc(f->ranges, (f->nranges + 1) * sizeof(FieldRange));
+		if (!f->ranges) {
+			fprintf(stderr, "lsh: allocation error\n");
+			exit(EXIT_FAILURE);
+		}
+		f->ranges[f->nranges++] = r;
+		if (r.hi > f->last)
+			f->last = r.hi;
+	} while (*p == ',');
+	return *p ? -1 : 0;
 }
 
+int field_run(Field *f, char **files, const char *cmd)
+{
+	char *stdin_only[] = {"-", NULL};
+	int ret = 0;
 
-int lsh_grep(char **args) {
-	if (args[1] == NULL || args[2] == NULL) {
-		fprintf(stderr, "lsh: grep requires pattern and filename\n");
-		return 1;
+	if (!files[0])
+		files = stdin_only;
+	fflush(stdout);
+	for (int i = 0; files[i]; i++) {
+		int fd = strcmp(files[i], "-") == 0 ? STDIN_FILENO : open(files[i], O_RDONLY | O_CLOEXEC);
+		if (fd < 0 || field_fd(f, fd) < 0) {
+			fprintf(stderr, "lsh: %s: %s: %s\n", cmd, files[i], strerror(errno));
+			ret = 1;
+		}
+		if (fd > STDIN_FILENO)
+			close(fd);
 	}
+	outbuf_flush(&f->out, STDOUT_FILENO);
+	free(f->ranges);
+	free(f->spans);
+	return ret;
+}
 
-	FILE *fp = fopen(args[2], "r");
-	if (fp == NULL) {
-		perror("lsh");
-		return 1;
-	}
+int lsh_cut(char **args)
+{
+	Field f;
+	char sep[2] = {0};
+	int i, bad = 0;
 
-	char *pattern = args[1];
-	char buffer[1024];
-	int line_number = 1;
+	memset(&f, 0, sizeof(f));
+	f.cut = 1;
+	f.delim = '\t';
+	for (i = 1; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+		char opt = args[i][1];
+		const char *value;
 
-	while (fgets(buffer, sizeof(buffer), fp)) {
-		if (strstr(buffer, pattern)) {
-			printf("%d: %s", line_number, buffer);
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		if (strcmp(args[i], "-s") == 0) {
+			f.only_delimited = 1;
+			continue;
+		}
+		// -d and -f take the rest of the word or the next one
+		value = args[i][2] ? args[i] + 2 : args[++i];
+		if (opt == 'd' && value && strlen(value) == 1) {
+			f.delim = (unsigned char)value[0];
+		}
+		else if (opt != 'f' || !value || field_parse_list(&f, value) < 0) {
+			bad = 1;
+			break;
 		}
-		line_number++;
 	}
-	fclose(fp);
-	return 1;
+	if (bad || f.nranges == 0) {
+		fprintf(stderr, "lsh: cut: usage: cut [-s] [-d delim] -f list [file...]\n");
+		free(f.ranges);
+		return 2;
+	}
+	sep[0] = f.delim;
+	f.sep = sep;
+	f.seplen = 1;
+	return field_run(&f, args + i, "cut");
 }
 
+int lsh_field(char **args)
+{
+	Field f;
+	char sep[2] = {0};
+	int i;
 
-int lsh_touch(char **args) {
-	if (args[1] == NULL) {
-		fprintf(stderr, "lsh: touch requires a filename\n");
-		return 1;
+	memset(&f, 0, sizeof(f));
+	f.blanks = 1;
+	for (i = 1; args[i] && args[i][0] == '-' && args[i][1] && !isdigit((unsigned char)args[i][1]); i++) {
+		if (strcmp(args[i], "--") == 0) {
+			i++;
+			break;
+		}
+		if (strcmp(args[i], "-c") == 0) {
+			f.csv = 1;
+		}
+		else if (strcmp(args[i], "-d") == 0 && args[i + 1] && strlen(args[i + 1]) == 1) {
+			f.delim = (unsigned char)args[++i][0];
+			f.blanks = 0;
+		}
+		else if (strcmp(args[i], "-o") == 0 && args[i + 1]) {
+			f.sep = args[++i];
+		}
+		else {
+			fprintf(stderr, "lsh: field: usage: field [-c] [-d delim] [-o sep] list [file...]\n");
+			return 2;
+		}
 	}
-
-	FILE *fp = fopen(args[1], "a"); // 'a' creates file if doesn't exist
-	if (fp == NULL) {
-		perror("lsh");
-		return 1;
+	if (!args[i] || field_parse_list(&f, args[i]) < 0) {
+		fprintf(stderr, "lsh: field: usage: field [-c] [-d delim] [-o sep] list [file...]\n");
+		free(f.ranges);
+		return 2;
 	}
-	fclose(fp);
-	return 1;
+	// CSV is comma-separated unless -d says otherwise
+	if (f.csv && f.blanks) {
+		f.delim = ',';
+		f.blanks = 0;
+	}
+	if (!f.sep) {
+		sep[0] = f.blanks ? ' ' : f.delim;
+		f.sep = sep;
+	}
+	f.seplen = strlen(f.sep);
+	return field_run(&f, args + i + 1, "field");
 }
 
+// Run one pipeline: args holds raw words (expanded here, globs included,
+// just before the pipeline runs, so "$?" sees the previous one) and
+// OP_PIPE tokens. A leading "!" negates the status and "time" reports
+// resource usage.
+int lsh_execute_pipeline(char **args, int background)
+{
+	int i, ret;
+	int negate = 0;
+	int timed = 0;
+	uint64_t t0 = now_ns();
 
-int lsh_echo(char **args) {
-	if (args[1] == NULL) {
-		printf("\n");
-		return 1;
+	for (;; args++) {
+		if (strcmp(args[0], "!") == 0)
+			negate = !negate;
+		else if (strcmp(args[0], "time") == 0) // covers the whole pipeline
+			timed = 1;
+		else
+			break;
+		if (args[1] == NULL)
+			return negate;
 	}
 
-	int i = 1;
-	while (args[i] != NULL && strcmp(args[i], ">") != 0) {
-		printf("%s ", args[i]);
-		i++;
+	char **words = NULL;
+	size_t n = 0, cap = 0;
+	for (i = 0; args[i]; i++) {
+		if (is_operator(args[i]))
+			words_push(&words, &n, &cap, args[i]);
+		else
+			expand_word_list(args[i], &words, &n, &cap);
 	}
+	words[n] = NULL;
 
-	if (args[i] && strcmp(args[i], ">") == 0 && args[i+1]) {
-		// Redirect to file
-		FILE *fp = fopen(args[i+1], "w");
-		if (fp == NULL) {
-			perror("lsh");
-			return 1;
-		}
-		for (int j = 1; j < i; j++) {
-			fprintf(fp, "%s ", args[j]);
-		}
-		fclose(fp);
-	}
-	else {
-		printf("\n");
+	for (i = 0; words[i] && words[i] != OP_PIPE; i++)
+		;
+	stats_phase(PHASE_DISPATCH, t0);
+	// Pipelines always run in child processes, builtins included
+	if (words[i]) {
+		ret = lsh_launch(words, background, timed);
+		goto out;
 	}
-	return 1;
-}
 
+	for (i=0; i < lsh_num_builtins(); i++) {
+		if (strcmp(words[0], builtin_str[i]) == 0) {
+			if (!timed) {
+				t0 = now_ns();
+				ret = (*builtin_func[i])(words);
+				stats_record_command("builtin", words[0], now_ns() - t0);
+				goto builtin_done;
+			}
 
-int lsh_rm(char **args) {
-	if (args[1] == NULL) {
-		fprintf(stderr, "lsh: rm requires a filename\n");
-		return 1;
+			struct rusage before, after;
+			double start = monotonic_seconds();
+
+			getrusage(RUSAGE_SELF, &before);
+			ret = (*builtin_func[i])(words);
+			fflush(stdout);
+			getrusage(RUSAGE_SELF, &after);
+			// A builtin runs inside the shell, so report the shell's own usage delta
+			after.ru_utime.tv_sec -= before.ru_utime.tv_sec;
+			after.ru_utime.tv_usec -= before.ru_utime.tv_usec;
+			after.ru_stime.tv_sec -= before.ru_stime.tv_sec;
+			after.ru_stime.tv_usec -= before.ru_stime.tv_usec;
+			after.ru_nvcsw -= before.ru_nvcsw;
+			after.ru_nivcsw -= before.ru_nivcsw;
+			after.ru_majflt -= before.ru_majflt;
+			time_report_header();
+			time_report_row(words[0], monotonic_seconds() - start, &after);
+			stats_record_command("builtin", words[0], (uint64_t)((monotonic_seconds() - start) * 1e9));
+			goto builtin_done;
+		}
 	}
+	ret = lsh_launch(words, background, timed);
+	goto out;
 
-	if (remove(args[1]) != 0) {
-		perror("lsh");
-		return 1;
+builtin_done:
+	pipestatus = realloc(pipestatus, sizeof(int));
+	if (!pipestatus) {
+		fprintf(stderr, "lsh: allocation error\n");
+		exit(EXIT_FAILURE);
 	}
-	return 1;
+	pipestatus[0] = ret;
+	pipestatus_len = 1;
+out:
+	// job_new() turned the OP_PIPE tokens into NULLs
+	for (size_t k = 0; k < n; k++)
+		if (!is_operator(words[k]))
+			free(words[k]);
+	free(words);
+	return negate ? !ret : ret;
 }
 
-
+// Run a command list: pipelines separated by ";", "&", "&&" and "||".
+// The pipeline after "&&" runs only if the one before succeeded, the one
+// after "||" only if it failed; "&" starts it in the background. A
+// skipped pipeline leaves $? alone, so "false && a || b" runs b. Returns
+// the status of the last pipeline, which is also left in $?.
 int lsh_execute(char **args)
 {
-	int i;
+	char *op = NULL, *prev = NULL;
+	int start = 0;
 
 	if (args[0] == NULL) {
 		// an empty command was entered
-		return 1;
+		return last_status;
 	}
 
-	for (i=0; i < lsh_num_builtins(); i++) {
-		if (strcmp(args[0], builtin_str[i]) == 0) {
-			return (*builtin_func[i])(args);
+	// Check the whole line first, so nothing runs from a malformed one:
+	// every operator needs a word before it, and all but ";" and "&" a
+	// word after it too
+	for (int i = 0; args[i]; i++) {
+		int missing = 0;
+		if (is_operator(args[i])) {
+			if (i == 0 || is_operator(args[i - 1]))
+				missing = 1;
+			else if (!args[i + 1] && args[i] != OP_SEMI && args[i] != OP_BG)
+				missing = 1;
 		}
+		if (missing) {
+			fprintf(stderr, "lsh: syntax error near \"%s\"\n", args[i]);
+			last_status = 2;
+			return last_status;
+		}
+	}
+
+	for (int i = 0; ; i++) {
+		if (args[i] && (!is_operator(args[i]) || args[i] == OP_PIPE))
+			continue;
+		op = args[i];
+		args[i] = NULL;
+		if (start < i && !lsh_exit_requested) {
+			if (prev == OP_AND && last_status != 0)
+				; // skipped
+			else if (prev == OP_OR && last_status == 0)
+				; // skipped
+			else
+				last_status = lsh_execute_pipeline(&args[start], op == OP_BG);
+		}
+		if (!op)
+			break;
+		prev = op;
+		start = i + 1;
 	}
-	return lsh_launch(args);
+	return last_status;
 }
 
 
@@ -564,7 +11766,7 @@ int lsh_history(char **args) {
 	for (int i = 0; i < shell_history->count; i++) {
 		printf("%d %s\n", i + 1, shell_history->commands[i]);
 	}
-	return 1;
+	return 0;
 }
 
 
@@ -583,15 +11785,20 @@ char **get_completions(const char *partial) {
 
 
 	// Now let's try with files
-	DIR *dir = opendir(".");
-	struct dirent *entry;
+	int fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DirList dl;
 
-	while ((entry = readdir(dir)) && count < LSH_TOK_BUFSIZE) {
-		if (strncmp(partial, entry->d_name, strlen(partial)) == 0) {
-			completions[count++] = strdup(entry->d_name);
+	memset(&dl, 0, sizeof(dl));
+	if (fd >= 0 && dircache_list(fd, &dl, DL_HIDDEN | DL_DOTS) == 0) {
+		for (size_t i = 0; i < dl.count && count < LSH_TOK_BUFSIZE - 1; i++) {
+			if (strncmp(partial, dl.entries[i].name, strlen(partial)) == 0) {
+				completions[count++] = strdup(dl.entries[i].name);
+			}
 		}
 	}
-	closedir(dir);
+	dirlist_free(&dl);
+	if (fd >= 0)
+		close(fd);
 
 	// show all matches if multiple found
 	if (count > 1) {
@@ -616,6 +11823,7 @@ void free_completions(char **completions) {
 
 int main(int argc, char **argv)
 {
+	init_shell();
 	shell_history = history_init();
 	history_load(shell_history);
 	// Load config files, if any
@@ -628,7 +11836,7 @@ int main(int argc, char **argv)
 
 	// Perform any shutdown/cleanup
 	
-	return EXIT_SUCCESS;
+	return lsh_exit_status;
 }
 
 
@@ -0,0 +1,30 @@
+#!/bin/sh
+# ls -Ra / -aR must list "." and ".." without descending into them.
+# Usage: tests/ls_recursive.sh [path/to/shell]; builds main.c when no shell is given.
+set -e
+root=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+sh_bin=${1:-}
+if [ -z "$sh_bin" ]; then
+	gcc -Wall -o "$tmp/lsh" "$root/main.c" -lm -pthread
+	sh_bin=$tmp/lsh
+fi
+
+mkdir -p "$tmp/w/d/sub" "$tmp/w/empty"
+touch "$tmp/w/d/sub/f"
+cd "$tmp/w"
+for opts in -Ra -aR; do
+	for dir in d empty; do
+		if ! out=$(echo "ls $opts $dir" | timeout 10 "$sh_bin" 2>&1); then
+			echo "FAIL: ls $opts $dir did not finish" >&2
+			exit 1
+		fi
+		if echo "$out" | grep -q '/\.\{1,2\}:$'; then
+			echo "FAIL: ls $opts $dir descended into . or .." >&2
+			exit 1
+		fi
+	done
+done
+echo "ok"